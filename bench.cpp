@@ -0,0 +1,662 @@
+/*
+ * Throughput and latency benchmarks for the queue and skip-list
+ * operations.
+ *
+ * Every combination of benchmark, size, key distribution and thread count
+ * given on the command line is run, and reported as one JSON object per
+ * line on stdout:
+ *
+ *   {"bench":"sl_search","n":1000000,"dist":"zipf","threads":4,
+ *    "ops":4000000,"ops_per_sec":...,"p50_ns":...,"p99_ns":...,
+ *    "p999_ns":...}
+ *
+ * Notes:
+ * -Structures that are not thread-safe get one private instance per
+ *   thread, so their thread counts measure scaling across independent
+ *   instances; the concurrent ones (csl_*, lfq_*) share one instance.
+ * -Operations run in segments of n. Work that restores the starting state
+ *   between segments (refilling a drained queue, say) is not timed.
+ * -Every LAT_EVERY-th operation is timed on its own for the percentiles;
+ *   ops_per_sec comes from the segment times.
+ * -Zipfian keys use theta = 0.99 and are scattered over [0, n) by a hash,
+ *   so that the hot keys are not neighbours.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "q.h"
+#include "skip.h"
+#include "cskip.h"
+#include "lfq.h"
+#include "lru.h"
+#include "bskip.h"
+
+#define LAT_EVERY 8 // time one in this many operations
+#define LAT_SUB 16 // histogram buckets per power of two
+#define LAT_BUCKETS (LAT_SUB + 48 * LAT_SUB)
+#define MAX_ARGS 16 // values per command-line list
+#define ZIPF_THETA 0.99
+#define PAYLOAD 16 // payload bytes per element
+
+int sl_compare(void *h1, void *h2) {
+  return (h1 == h2) ? 0 : ((h1 > h2) ? 1 : -1);
+}
+
+typedef skip_list bench_sl_t;  // the shipped type, grown past its default
+typedef concurrent_skip_list<int64_t, int64_t, sl_three_way<int64_t>, 32>
+    bench_csl_t;
+typedef bskip_list<int64_t, 32> bench_bsl_t;
+
+/************** Keys ***************************************/
+
+typedef enum { DIST_SEQ, DIST_UNIFORM, DIST_ZIPF } dist_t;
+static const char *dist_names[] = {"seq", "uniform", "zipf"};
+
+typedef struct {
+    size_t n;
+    double zetan, alpha, eta;
+} zipf_t;
+
+/*
+ * Gray et al., "Quickly generating billion-record synthetic databases".
+ * zeta(n) is summed once per size.
+ */
+static void zipf_init(zipf_t *z, size_t n)
+{
+  z->n = n;
+  z->zetan = 0;
+  for (size_t i = 1; i <= n; i++) z->zetan += 1.0 / pow((double) i, ZIPF_THETA);
+  double zeta2 = 1.0 + pow(0.5, ZIPF_THETA);
+  z->alpha = 1.0 / (1.0 - ZIPF_THETA);
+  z->eta = (1.0 - pow(2.0 / (double) n, 1.0 - ZIPF_THETA)) /
+           (1.0 - zeta2 / z->zetan);
+}
+
+typedef struct {
+    dist_t dist;
+    size_t n;
+    uint64_t rng;
+    uint64_t seq;
+    const zipf_t *zipf;
+} keygen_t;
+
+static uint64_t key_next(keygen_t *g)
+{
+  switch (g->dist)
+  {
+  case DIST_SEQ:
+    return g->seq++ % g->n;
+  case DIST_UNIFORM:
+    return sl_rng::next(&g->rng) % g->n;
+  default:
+  {
+    const zipf_t *z = g->zipf;
+    double u = (double) (sl_rng::next(&g->rng) >> 11) / 9007199254740992.0;
+    double uz = u * z->zetan;
+    uint64_t rank;
+    if (uz < 1.0) rank = 0;
+    else if (uz < 1.0 + pow(0.5, ZIPF_THETA)) rank = 1;
+    else rank = (uint64_t) ((double) z->n *
+                            pow(z->eta * u - z->eta + 1.0, z->alpha));
+    if (rank >= z->n) rank = z->n - 1;
+    return q_hash_int((void *) (uintptr_t) rank) % z->n;
+  }
+  }
+}
+
+/*
+ * Make the compiler assume v is used, so that a lookup whose result is
+ * otherwise ignored is not optimized away along with the time it takes.
+ */
+static inline void bench_keep(const void *v)
+{
+  __asm__ volatile("" : : "g"(v) : "memory");
+}
+
+/************** Latency histogram **************************/
+
+typedef struct {
+    uint64_t count[LAT_BUCKETS];
+} hist_t;
+
+static inline uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/* Log-linear buckets: exact below LAT_SUB ns, then 16 per power of two */
+static void hist_add(hist_t *h, uint64_t ns)
+{
+  size_t b = ns;
+  if (ns >= LAT_SUB)
+  {
+    int e = 63 - __builtin_clzll(ns);
+    b = LAT_SUB + (size_t) (e - 4) * LAT_SUB + ((ns >> (e - 4)) & (LAT_SUB - 1));
+    if (b >= LAT_BUCKETS) b = LAT_BUCKETS - 1;
+  }
+  h->count[b]++;
+}
+
+static uint64_t hist_bucket_ns(size_t b)
+{
+  if (b < LAT_SUB) return b;
+  int e = (int) ((b - LAT_SUB) / LAT_SUB) + 4;
+  return (uint64_t) (LAT_SUB + (b - LAT_SUB) % LAT_SUB) << (e - 4);
+}
+
+static uint64_t hist_pct(const hist_t *h, double pct)
+{
+  uint64_t total = 0;
+  for (size_t b = 0; b < LAT_BUCKETS; b++) total += h->count[b];
+  if (total == 0) return 0;
+  uint64_t want = (uint64_t) ceil(pct * (double) total);
+  if (want == 0) want = 1;
+  uint64_t seen = 0;
+  for (size_t b = 0; b < LAT_BUCKETS; b++)
+  {
+    seen += h->count[b];
+    if (seen >= want) return hist_bucket_ns(b);
+  }
+  return hist_bucket_ns(LAT_BUCKETS - 1);
+}
+
+/************** Benchmarks *********************************/
+
+/*
+ * A benchmark is a per-thread state built by setup() (given the shared
+ * instance, if the benchmark has one), an operation on one key, and an
+ * optional untimed reset() between segments.
+ */
+typedef struct {
+    const char *name;
+    void *(*shared_setup)(size_t n);
+    void (*shared_free)(void *shared);
+    void *(*setup)(size_t n, void *shared);
+    void (*op)(void *state, uint64_t key);
+    void (*reset)(void *state);
+    void (*teardown)(void *state);
+    size_t max_ops;   /* Cap on ops per thread for O(n) operations, per n */
+} bench_def_t;
+
+typedef struct {
+    size_t n;
+    queue_t *q;
+    list_ele_t **eles;   /* By key */
+    list_ele_t *ring[1024];
+    size_t at;
+    char payload[PAYLOAD];
+} q_state_t;
+
+static q_state_t *qs_new(size_t n)
+{
+  q_state_t *s = (q_state_t *) calloc(1, sizeof(q_state_t));
+  s->n = n;
+  memset(s->payload, 'x', PAYLOAD);
+  return s;
+}
+
+static void qs_fill(q_state_t *s, unsigned flags, bool index, bool keep)
+{
+  s->q = q_new_flags(flags);
+  if (index) q_index(s->q, NULL);
+  if (keep) s->eles = (list_ele_t **) malloc(s->n * sizeof(list_ele_t *));
+  for (size_t k = 0; k < s->n; k++)
+  {
+    list_ele_t *ele = q_pack(s->q, s->payload, PAYLOAD,
+                             (void *) (uintptr_t) (k + 1));
+    q_insert_tail(s->q, ele);
+    if (keep) s->eles[k] = ele;
+  }
+}
+
+static void qs_free(void *state)
+{
+  q_state_t *s = (q_state_t *) state;
+  for (size_t i = 0; i < 1024; i++) unpack(NULL, s->ring[i]);
+  q_free(s->q);
+  free(s->eles);
+  free(s);
+}
+
+/* pack(), paired with the unpack() of the element packed 1024 ops ago */
+static void *pack_setup(size_t n, void *) { return qs_new(n); }
+static void pack_op(void *state, uint64_t key)
+{
+  q_state_t *s = (q_state_t *) state;
+  size_t i = s->at++ & 1023;
+  unpack(NULL, s->ring[i]);
+  s->ring[i] = pack(s->payload, PAYLOAD, (void *) (uintptr_t) key);
+}
+
+static void *qins_setup(size_t n, void *)
+{
+  q_state_t *s = qs_new(n);
+  s->q = q_new_pooled();
+  return s;
+}
+static void qins_reset(void *state)
+{
+  q_state_t *s = (q_state_t *) state;
+  q_free(s->q);
+  s->q = q_new_pooled();
+}
+static void qins_head_op(void *state, uint64_t key)
+{
+  q_state_t *s = (q_state_t *) state;
+  q_insert_head(s->q, q_pack(s->q, s->payload, PAYLOAD,
+                             (void *) (uintptr_t) key));
+}
+static void qins_tail_op(void *state, uint64_t key)
+{
+  q_state_t *s = (q_state_t *) state;
+  q_insert_tail(s->q, q_pack(s->q, s->payload, PAYLOAD,
+                             (void *) (uintptr_t) key));
+}
+
+static void *qrem_setup(size_t n, void *)
+{
+  q_state_t *s = qs_new(n);
+  qs_fill(s, Q_POOLED, false, false);
+  return s;
+}
+static void qrem_reset(void *state)
+{
+  q_state_t *s = (q_state_t *) state;
+  q_free(s->q);
+  qs_fill(s, Q_POOLED, false, false);
+}
+static void qrem_op(void *state, uint64_t)
+{
+  q_remove_head(((q_state_t *) state)->q, true);
+}
+
+static void *qsearch_setup(size_t n, void *)
+{
+  q_state_t *s = qs_new(n);
+  qs_fill(s, Q_POOLED, true, false);
+  return s;
+}
+static void *qscan_setup(size_t n, void *)
+{
+  q_state_t *s = qs_new(n);
+  qs_fill(s, Q_POOLED, false, false);
+  return s;
+}
+/* Hashes are offset by one, since q_search() never matches NULL */
+static void qsearch_op(void *state, uint64_t key)
+{
+  bench_keep(q_search(((q_state_t *) state)->q, (void *) (uintptr_t) (key + 1),
+                &hash_compare));
+}
+
+static void *qshuffle_setup(size_t n, void *)
+{
+  q_state_t *s = qs_new(n);
+  qs_fill(s, Q_POOLED | Q_DOUBLY, false, true);
+  return s;
+}
+static void qshuffle_op(void *state, uint64_t key)
+{
+  q_state_t *s = (q_state_t *) state;
+  q_shuffle(s->q, s->eles[key]);
+}
+
+typedef struct {
+    size_t n;
+    bench_sl_t *sl;
+    list_ele_t *ele;   /* Reused for every insert, with its hash changed */
+} sl_state_t;
+
+static void *sl_setup_empty(size_t n, void *)
+{
+  sl_state_t *s = (sl_state_t *) calloc(1, sizeof(sl_state_t));
+  char payload[PAYLOAD] = "payload";
+  s->n = n;
+  s->sl = new bench_sl_t(SL_MAX_LEVELS, 0.5f, true);
+  s->ele = pack(payload, PAYLOAD, NULL);
+  return s;
+}
+static void *sl_setup_full(size_t n, void *)
+{
+  sl_state_t *s = (sl_state_t *) sl_setup_empty(n, NULL);
+  for (size_t k = 0; k < n; k++)
+  {
+    s->ele->hash = (void *) (uintptr_t) k;
+    s->sl->sl_insert_finger(s->ele);
+  }
+  return s;
+}
+static void sl_reset(void *state)
+{
+  sl_state_t *s = (sl_state_t *) state;
+  delete s->sl;
+  s->sl = new bench_sl_t(SL_MAX_LEVELS, 0.5f, true);
+}
+static void sl_teardown(void *state)
+{
+  sl_state_t *s = (sl_state_t *) state;
+  delete s->sl;
+  unpack(NULL, s->ele);
+  free(s);
+}
+static void sl_insert_op(void *state, uint64_t key)
+{
+  sl_state_t *s = (sl_state_t *) state;
+  s->ele->hash = (void *) (uintptr_t) key;
+  s->sl->sl_insert(s->ele);
+}
+static void sl_search_op(void *state, uint64_t key)
+{
+  bench_keep(((sl_state_t *) state)->sl->sl_search((void *) (uintptr_t) key));
+}
+
+/* The node at position key, as for a quantile lookup */
+static void sl_select_op(void *state, uint64_t key)
+{
+  bench_keep(((sl_state_t *) state)->sl->sl_select((size_t) key));
+}
+
+/* Fire the earliest of n timers and re-arm it up to n ticks later */
+static void sl_timer_op(void *state, uint64_t key)
+{
+  sl_state_t *s = (sl_state_t *) state;
+  bench_sl_t::node_t *due = s->sl->sl_pop_min();
+  s->ele->hash = (void *) ((uintptr_t) due->hash + 1 + key);
+  s->sl->sl_recycle(due);
+  s->sl->sl_insert(s->ele);
+}
+
+static void *csl_shared_empty(size_t) { return new bench_csl_t(32, 0.5f); }
+static void *csl_shared_full(size_t n)
+{
+  bench_csl_t *sl = new bench_csl_t(32, 0.5f);
+  for (size_t k = 0; k < n; k++) sl->insert((int64_t) k, (int64_t) k);
+  return sl;
+}
+static void csl_shared_free(void *shared) { delete (bench_csl_t *) shared; }
+static void *shared_state(size_t, void *shared) { return shared; }
+static void csl_insert_op(void *state, uint64_t key)
+{
+  ((bench_csl_t *) state)->insert((int64_t) key, (int64_t) key);
+}
+static void csl_search_op(void *state, uint64_t key)
+{
+  bench_csl_t *sl = (bench_csl_t *) state;
+  bench_keep((void *) (uintptr_t) sl->sl_contains((int64_t) key));
+}
+
+/* One lfq_insert_tail() and one lfq_remove_head() per op */
+static void *lfq_shared(size_t) { return lfq_new(); }
+static void lfq_shared_free(void *shared) { lfq_free((lfq_t *) shared); }
+static void lfq_pair_op(void *state, uint64_t key)
+{
+  lfq_t *q = (lfq_t *) state;
+  uint64_t v = key;
+  lfq_insert_tail(q, pack(&v, sizeof(v), (void *) (uintptr_t) key));
+  unpack(NULL, lfq_remove_head(q));
+}
+
+static void *bsl_setup(size_t n, void *)
+{
+  bench_bsl_t *sl = new bench_bsl_t(32);
+  for (size_t k = 0; k < n; k++) sl->insert((int64_t) k, (int64_t) k);
+  return sl;
+}
+static void bsl_search_op(void *state, uint64_t key)
+{
+  bench_keep(((bench_bsl_t *) state)->sl_search((int64_t) key));
+}
+static void bsl_teardown(void *state) { delete (bench_bsl_t *) state; }
+
+/* lru_get(), with an lru_put() on a miss, over a cache of n / LRU_FRACTION */
+#define LRU_FRACTION 8
+static void *lru_setup(size_t n, void *)
+{
+  return lru_new(0, (int) (n / LRU_FRACTION + 1), NULL, NULL);
+}
+static void lru_op(void *state, uint64_t key)
+{
+  static char payload[PAYLOAD];
+  lru_cache_t *c = (lru_cache_t *) state;
+  void *hash = (void *) (uintptr_t) (key + 1);
+  if (lru_get(c, hash) == NULL) lru_put(c, payload, PAYLOAD, hash);
+}
+static void lru_teardown(void *state) { lru_free((lru_cache_t *) state); }
+
+static const bench_def_t benches[] = {
+  {"pack", NULL, NULL, pack_setup, pack_op, NULL, qs_free, 0},
+  {"q_insert_head", NULL, NULL, qins_setup, qins_head_op, qins_reset, qs_free, 0},
+  {"q_insert_tail", NULL, NULL, qins_setup, qins_tail_op, qins_reset, qs_free, 0},
+  {"q_remove_head", NULL, NULL, qrem_setup, qrem_op, qrem_reset, qs_free, 0},
+  {"q_search", NULL, NULL, qsearch_setup, qsearch_op, NULL, qs_free, 0},
+  {"q_search_scan", NULL, NULL, qscan_setup, qsearch_op, NULL, qs_free,
+   100000000},
+  {"q_shuffle", NULL, NULL, qshuffle_setup, qshuffle_op, NULL, qs_free, 0},
+  {"sl_insert", NULL, NULL, sl_setup_empty, sl_insert_op, sl_reset,
+   sl_teardown, 0},
+  {"sl_search", NULL, NULL, sl_setup_full, sl_search_op, NULL, sl_teardown, 0},
+  {"sl_select", NULL, NULL, sl_setup_full, sl_select_op, NULL, sl_teardown, 0},
+  {"sl_timer", NULL, NULL, sl_setup_full, sl_timer_op, NULL, sl_teardown, 0},
+  {"bsl_search", NULL, NULL, bsl_setup, bsl_search_op, NULL, bsl_teardown, 0},
+  {"csl_insert", csl_shared_empty, csl_shared_free, shared_state,
+   csl_insert_op, NULL, NULL, 0},
+  {"csl_search", csl_shared_full, csl_shared_free, shared_state,
+   csl_search_op, NULL, NULL, 0},
+  {"lru_get_put", NULL, NULL, lru_setup, lru_op, NULL, lru_teardown, 0},
+  {"lfq_pair", lfq_shared, lfq_shared_free, shared_state, lfq_pair_op, NULL,
+   NULL, 0},
+};
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+/************** Runner *************************************/
+
+typedef struct {
+    const bench_def_t *def;
+    size_t n;
+    size_t ops;
+    dist_t dist;
+    const zipf_t *zipf;
+    uint64_t seed;
+    int id;
+    void *shared;
+    pthread_barrier_t *start;
+    hist_t hist;
+    uint64_t busy_ns;    /* Time spent in segments */
+} worker_t;
+
+static void *bench_worker(void *p)
+{
+  worker_t *w = (worker_t *) p;
+  const bench_def_t *def = w->def;
+  void *state = def->setup(w->n, w->shared);
+  keygen_t g;
+  g.dist = w->dist;
+  g.n = w->n;
+  g.rng = sl_rng::seed(w->seed + (uint64_t) w->id);
+  g.seq = (uint64_t) w->id * (w->n / 64 + 1);
+  g.zipf = w->zipf;
+  pthread_barrier_wait(w->start);
+  size_t done = 0;
+  while (done < w->ops)
+  {
+    size_t seg = w->ops - done;
+    if (def->reset != NULL && seg > w->n) seg = w->n;
+    uint64_t t0 = now_ns();
+    for (size_t i = 0; i < seg; i++)
+    {
+      uint64_t key = key_next(&g);
+      if (i % LAT_EVERY != 0)
+      {
+        def->op(state, key);
+        continue;
+      }
+      uint64_t s = now_ns();
+      def->op(state, key);
+      hist_add(&w->hist, now_ns() - s);
+    }
+    w->busy_ns += now_ns() - t0;
+    done += seg;
+    if (done < w->ops && def->reset != NULL) def->reset(state);
+  }
+  if (def->teardown != NULL) def->teardown(state);
+  return NULL;
+}
+
+static void bench_run(const bench_def_t *def, size_t n, dist_t dist,
+                      const zipf_t *zipf, int threads, size_t ops,
+                      uint64_t seed)
+{
+  if (def->max_ops > 0 && ops > def->max_ops / n)
+    ops = (def->max_ops / n > 0) ? def->max_ops / n : 1;
+  worker_t *w = (worker_t *) calloc(threads, sizeof(worker_t));
+  pthread_t *tid = (pthread_t *) malloc(threads * sizeof(pthread_t));
+  if (w == NULL || tid == NULL)
+  {
+    fprintf(stderr, "bench: out of memory\n");
+    exit(1);
+  }
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, threads);
+  void *shared = def->shared_setup ? def->shared_setup(n) : NULL;
+  for (int t = 0; t < threads; t++)
+  {
+    w[t].def = def;
+    w[t].n = n;
+    w[t].ops = ops;
+    w[t].dist = dist;
+    w[t].zipf = zipf;
+    w[t].seed = seed;
+    w[t].id = t;
+    w[t].shared = shared;
+    w[t].start = &start;
+    pthread_create(&tid[t], NULL, bench_worker, &w[t]);
+  }
+  hist_t *all = (hist_t *) calloc(1, sizeof(hist_t));
+  double ops_per_sec = 0;
+  for (int t = 0; t < threads; t++)
+  {
+    pthread_join(tid[t], NULL);
+    for (size_t b = 0; b < LAT_BUCKETS; b++) all->count[b] += w[t].hist.count[b];
+    if (w[t].busy_ns > 0) ops_per_sec += (double) ops * 1e9 / (double) w[t].busy_ns;
+  }
+  if (def->shared_free) def->shared_free(shared);
+  pthread_barrier_destroy(&start);
+  printf("{\"bench\":\"%s\",\"n\":%zu,\"dist\":\"%s\",\"threads\":%d,"
+         "\"ops\":%zu,\"ops_per_sec\":%.0f,\"p50_ns\":%lu,\"p99_ns\":%lu,"
+         "\"p999_ns\":%lu}\n",
+         def->name, n, dist_names[dist], threads, ops * (size_t) threads,
+         ops_per_sec, (unsigned long) hist_pct(all, 0.50),
+         (unsigned long) hist_pct(all, 0.99),
+         (unsigned long) hist_pct(all, 0.999));
+  fflush(stdout);
+  free(all);
+  free(tid);
+  free(w);
+}
+
+/************** Command line *******************************/
+
+static void usage()
+{
+  fprintf(stderr,
+          "usage: bench [-b bench,...] [-n size,...] [-d dist,...] "
+          "[-t threads,...]\n"
+          "             [-o ops per thread] [-s seed] [-l]\n"
+          "  sizes accept 1e6 style; dists are seq, uniform, zipf\n"
+          "  -l lists the benchmarks\n");
+  exit(2);
+}
+
+/* Split a comma-separated list in place */
+static int split(char *arg, char **out)
+{
+  int n = 0;
+  for (char *tok = strtok(arg, ","); tok && n < MAX_ARGS; tok = strtok(NULL, ","))
+    out[n++] = tok;
+  return n;
+}
+
+int main(int argc, char **argv)
+{
+  char *bench_arg[MAX_ARGS], *size_arg[MAX_ARGS], *dist_arg[MAX_ARGS];
+  char *thread_arg[MAX_ARGS];
+  char defaults[4][64] = {"", "1e3,1e5", "uniform", "1"};
+  int nb = 0, ns = split(defaults[1], size_arg), nd = split(defaults[2], dist_arg);
+  int nt = split(defaults[3], thread_arg);
+  size_t ops = 1000000;
+  uint64_t seed = 1;
+  int c;
+  while ((c = getopt(argc, argv, "b:n:d:t:o:s:lh")) != -1)
+  {
+    switch (c)
+    {
+    case 'b': nb = split(optarg, bench_arg); break;
+    case 'n': ns = split(optarg, size_arg); break;
+    case 'd': nd = split(optarg, dist_arg); break;
+    case 't': nt = split(optarg, thread_arg); break;
+    case 'o': ops = (size_t) strtod(optarg, NULL); break;
+    case 's': seed = strtoull(optarg, NULL, 0); break;
+    case 'l':
+      for (size_t i = 0; i < NUM_BENCHES; i++) printf("%s\n", benches[i].name);
+      return 0;
+    default: usage();
+    }
+  }
+  const bench_def_t *run[NUM_BENCHES];
+  size_t nrun = 0;
+  if (nb == 0)
+  {
+    for (size_t i = 0; i < NUM_BENCHES; i++) run[nrun++] = &benches[i];
+  }
+  for (int i = 0; i < nb; i++)
+  {
+    size_t j = 0;
+    while (j < NUM_BENCHES && strcmp(benches[j].name, bench_arg[i]) != 0) j++;
+    if (j == NUM_BENCHES)
+    {
+      fprintf(stderr, "bench: unknown benchmark %s\n", bench_arg[i]);
+      usage();
+    }
+    run[nrun++] = &benches[j];
+  }
+  dist_t dists[MAX_ARGS];
+  for (int i = 0; i < nd; i++)
+  {
+    int j = 0;
+    while (j < 3 && strcmp(dist_names[j], dist_arg[i]) != 0) j++;
+    if (j == 3) usage();
+    dists[i] = (dist_t) j;
+  }
+  if (ops == 0) usage();
+  for (int si = 0; si < ns; si++)
+  {
+    size_t n = (size_t) strtod(size_arg[si], NULL);
+    if (n == 0) usage();
+    zipf_t zipf;
+    bool zipf_ready = false;
+    for (int di = 0; di < nd; di++)
+    {
+      if (dists[di] == DIST_ZIPF && !zipf_ready)
+      {
+        zipf_init(&zipf, n);
+        zipf_ready = true;
+      }
+      for (int ti = 0; ti < nt; ti++)
+      {
+        int threads = atoi(thread_arg[ti]);
+        if (threads < 1) usage();
+        for (size_t b = 0; b < nrun; b++)
+          bench_run(run[b], n, dists[di], &zipf, threads, ops, seed);
+      }
+    }
+  }
+  return 0;
+}
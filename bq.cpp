@@ -0,0 +1,291 @@
+/*
+ * This program implements a blocking queue for pipeline stages.
+ *
+ * See bq.h for the wakeup rules.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "bq.h"
+
+bq_t *bq_new(unsigned flags)
+{
+  bq_t *b = (bq_t *) malloc(sizeof(bq_t));
+  if (b==NULL) return NULL;
+  b->q = q_new_flags(flags);
+  if (b->q==NULL)
+  {
+    free(b);
+    return NULL;
+  }
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&b->ready, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&b->lock, NULL);
+  b->sleepers = 0;
+  b->waiters = NULL;
+  b->closed = false;
+  b->wakeups = 0;
+  return b;
+}
+
+void bq_free(bq_t *b)
+{
+  if (b==NULL) return;
+  q_free(b->q);
+  pthread_cond_destroy(&b->ready);
+  pthread_mutex_destroy(&b->lock);
+  free(b);
+}
+
+/*
+ * With the lock held and data in the queue, wake one sleeper or pop one
+ * registered callback, to be run by the caller after unlocking.
+ */
+static bq_waiter_t *bq_wake_one(bq_t *b)
+{
+  if (b->sleepers > 0)
+  {
+    b->wakeups++;
+    pthread_cond_signal(&b->ready);
+    return NULL;
+  }
+  bq_waiter_t *w = b->waiters;
+  if (w!=NULL)
+  {
+    b->waiters = w->next;
+    b->wakeups++;
+  }
+  return w;
+}
+
+bool bq_put(bq_t *b, void *val, size_t size, void *hash)
+{
+  if (b==NULL) return false;
+  pthread_mutex_lock(&b->lock);
+  list_ele_t *ele = b->closed ? NULL : q_pack(b->q, val, size, hash);
+  if (ele==NULL || !q_insert_tail(b->q, ele))
+  {
+    q_release(b->q, ele);
+    pthread_mutex_unlock(&b->lock);
+    return false;
+  }
+  bq_waiter_t *w = (b->q->nodes == 1) ? bq_wake_one(b) : NULL;
+  pthread_mutex_unlock(&b->lock);
+  if (w!=NULL) w->fn(w->arg);
+  return true;
+}
+
+/*
+ * A consumer that leaves data behind passes the wakeup on, so that a
+ * producer only ever has to signal the empty to non-empty transition.
+ */
+int bq_take(bq_t *b, list_ele_t **out, int max, int timeout_ms)
+{
+  if (b==NULL || out==NULL || max <= 0) return 0;
+  struct timespec deadline;
+  if (timeout_ms > 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+  pthread_mutex_lock(&b->lock);
+  while (b->q->nodes == 0 && !b->closed && timeout_ms != 0)
+  {
+    b->sleepers++;
+    int rc = (timeout_ms < 0)
+      ? pthread_cond_wait(&b->ready, &b->lock)
+      : pthread_cond_timedwait(&b->ready, &b->lock, &deadline);
+    b->sleepers--;
+    if (rc == ETIMEDOUT) break;
+  }
+  int n = q_remove_batch(b->q, max, out);
+  bq_waiter_t *w = (b->q->nodes > 0) ? bq_wake_one(b) : NULL;
+  pthread_mutex_unlock(&b->lock);
+  if (w!=NULL) w->fn(w->arg);
+  return n;
+}
+
+void bq_release(bq_t *b, list_ele_t **eles, int n)
+{
+  if (b==NULL || n <= 0) return;
+  pthread_mutex_lock(&b->lock);
+  for (int i = 0; i < n; i++) q_release(b->q, eles[i]);
+  pthread_mutex_unlock(&b->lock);
+}
+
+void bq_close(bq_t *b)
+{
+  if (b==NULL) return;
+  pthread_mutex_lock(&b->lock);
+  b->closed = true;
+  pthread_cond_broadcast(&b->ready);
+  bq_waiter_t *w = b->waiters;
+  b->waiters = NULL;
+  pthread_mutex_unlock(&b->lock);
+  while (w!=NULL)
+  {
+    bq_waiter_t *next = w->next;
+    w->fn(w->arg);
+    w = next;
+  }
+}
+
+bool bq_on_ready(bq_t *b, bq_waiter_t *w)
+{
+  if (b==NULL) return false;
+  pthread_mutex_lock(&b->lock);
+  bool wait = b->q->nodes == 0 && !b->closed;
+  if (wait)
+  {
+    w->next = b->waiters;
+    b->waiters = w;
+  }
+  pthread_mutex_unlock(&b->lock);
+  return wait;
+}
+
+int bq_nodes(bq_t *b)
+{
+  if (b==NULL) return 0;
+  pthread_mutex_lock(&b->lock);
+  int n = b->q->nodes;
+  pthread_mutex_unlock(&b->lock);
+  return n;
+}
+
+#define BQ_PRODUCERS 3
+#define BQ_PER_PRODUCER 20000
+#define BQ_BATCH 64
+
+typedef struct {
+    bq_t *b;
+    int id;
+    long sum;
+    int taken;
+    int batches;
+} bq_arg_t;
+
+static void *bq_producer(void *p)
+{
+  bq_arg_t *arg = (bq_arg_t *) p;
+  for (int i = 0; i < BQ_PER_PRODUCER; i++)
+  {
+    intptr_t k = (intptr_t) arg->id * BQ_PER_PRODUCER + i;
+    assert(bq_put(arg->b, &i, sizeof(i), (void *) k));
+  }
+  return NULL;
+}
+
+/* Each producer's elements must come out in the order it put them in */
+static void *bq_consumer(void *p)
+{
+  bq_arg_t *arg = (bq_arg_t *) p;
+  list_ele_t *batch[BQ_BATCH];
+  int seen[BQ_PRODUCERS];
+  for (int t = 0; t < BQ_PRODUCERS; t++) seen[t] = -1;
+  int n;
+  while ((n = bq_take(arg->b, batch, BQ_BATCH, -1)) > 0)
+  {
+    for (int j = 0; j < n; j++)
+    {
+      intptr_t h = (intptr_t) batch[j]->hash;
+      int from = h / BQ_PER_PRODUCER, i = *(int *) batch[j]->value;
+      assert(i == h % BQ_PER_PRODUCER && i > seen[from]);
+      seen[from] = i;
+      arg->sum += h;
+    }
+    arg->taken += n;
+    arg->batches++;
+    bq_release(arg->b, batch, n);
+  }
+  return NULL;
+}
+
+static void count_ready(void *arg)
+{
+  (*(int *) arg)++;
+}
+
+void test_bq()
+{
+  int v = 7;
+  list_ele_t *out[8];
+  bq_t *b = bq_new(Q_POOLED | Q_DOUBLY);
+  // Empty: no wait returns at once, a timed wait gives up
+  assert(b && bq_take(b, out, 8, 0) == 0);
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  assert(bq_take(b, out, 8, 20) == 0);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  long ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+  assert(ms >= 19);
+  // Batches come out in order, at most max at a time
+  for (intptr_t k = 1; k <= 10; k++) assert(bq_put(b, &v, sizeof(v), (void *) k));
+  assert(bq_nodes(b) == 10 && bq_take(b, out, 8, -1) == 8);
+  assert(out[0]->hash == (void *) 1 && out[7]->hash == (void *) 8);
+  assert(b->q->head->hash == (void *) 9 && *ele_prev(b->q->head) == NULL);
+  bq_release(b, out, 8);
+  assert(bq_take(b, out, 8, 0) == 2 && b->q->head == NULL && b->q->tail == NULL);
+  assert(q_size(b->q) == 0);
+  bq_release(b, out, 2);
+  // Callbacks run once, on the put that ends an empty spell
+  int fired = 0;
+  bq_waiter_t w1 = {NULL, count_ready, &fired}, w2 = {NULL, count_ready, &fired};
+  assert(bq_on_ready(b, &w1) && bq_on_ready(b, &w2));
+  assert(bq_put(b, &v, sizeof(v), (void *) 1) && fired == 1);
+  assert(bq_put(b, &v, sizeof(v), (void *) 2) && fired == 1);
+  assert(!bq_on_ready(b, &w1));
+  assert(bq_take(b, out, 1, 0) == 1 && fired == 2);  // passed on, data left
+  bq_release(b, out, 1);
+  bq_close(b);
+  assert(!bq_put(b, &v, sizeof(v), (void *) 3) && !bq_on_ready(b, &w1));
+  assert(bq_take(b, out, 8, -1) == 1 && bq_take(b, out + 1, 8, -1) == 0);
+  bq_release(b, out, 1);
+  bq_free(b);
+  bq_free(NULL);
+
+  // Producers and consumers, drained in batches until closed
+  b = bq_new(Q_POOLED);
+  pthread_t prod[BQ_PRODUCERS], cons[BQ_PRODUCERS];
+  bq_arg_t args[2 * BQ_PRODUCERS];
+  memset(args, 0, sizeof(args));
+  for (int t = 0; t < BQ_PRODUCERS; t++)
+  {
+    args[t].b = args[BQ_PRODUCERS + t].b = b;
+    args[t].id = t;
+    assert(0 == pthread_create(&cons[t], NULL, bq_consumer,
+                               &args[BQ_PRODUCERS + t]));
+  }
+  for (int t = 0; t < BQ_PRODUCERS; t++)
+    assert(0 == pthread_create(&prod[t], NULL, bq_producer, &args[t]));
+  for (int t = 0; t < BQ_PRODUCERS; t++) pthread_join(prod[t], NULL);
+  bq_close(b);
+  long sum = 0;
+  int taken = 0, batches = 0;
+  for (int t = 0; t < BQ_PRODUCERS; t++)
+  {
+    pthread_join(cons[t], NULL);
+    sum += args[BQ_PRODUCERS + t].sum;
+    taken += args[BQ_PRODUCERS + t].taken;
+    batches += args[BQ_PRODUCERS + t].batches;
+  }
+  long n = (long) BQ_PRODUCERS * BQ_PER_PRODUCER;
+  assert(taken == n && sum == n * (n - 1) / 2 && batches <= taken);
+  assert(b->wakeups <= (uint64_t) n && bq_nodes(b) == 0);
+  bq_free(b);
+}
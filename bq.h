@@ -0,0 +1,127 @@
+/*
+ * This program implements a blocking queue for handing batches of work
+ * between pipeline stages.
+ *
+ * A bq_t is a queue_t behind one mutex. Consumers sleep on a condition
+ * variable instead of polling q_nodes(), and drain up to a whole batch
+ * per wakeup with q_remove_batch(). Producers only signal when the queue
+ * goes from empty to non-empty while a consumer is waiting, so a burst of
+ * inserts costs one wakeup rather than one per element.
+ *
+ * Elements are packed and released through the queue, under the lock, so
+ * that a pooled queue's pool is never used by two threads at once; pass
+ * a whole batch to bq_release() to take the lock once for all of it.
+ *
+ * Built as C++20, bq_await is an awaitable for coroutines: awaiting it
+ * suspends until the queue has data (or is closed) and resumes with a
+ * batch. Any C caller can use the same hook through bq_on_ready().
+ */
+#ifndef BQ_H
+#define BQ_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "q.h"
+
+/************** Data structure declarations ****************/
+
+/*
+ * A callback registered with bq_on_ready(), run once by the producer that
+ * next makes data available, or by bq_close(), outside the lock.
+ */
+typedef struct BQ_WAITER {
+    struct BQ_WAITER *next;
+    void (*fn)(void *arg);
+    void *arg;
+} bq_waiter_t;
+
+typedef struct {
+    queue_t *q;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;        /* Signalled when q becomes non-empty */
+    int sleepers;                /* Threads waiting on ready */
+    bq_waiter_t *waiters;        /* Registered callbacks, LIFO */
+    bool closed;
+    uint64_t wakeups;            /* Signals and callbacks issued */
+} bq_t;
+
+/************** Operations on bq ***************************/
+
+/*
+  Create an empty blocking queue over q_new_flags(flags).
+  Return NULL if could not allocate space.
+*/
+bq_t *bq_new(unsigned flags);
+
+/*
+  Free the queue and every element in it. No thread may be using it.
+  No effect if b is NULL
+*/
+void bq_free(bq_t *b);
+
+/*
+  Append a copy of size bytes of val, waking a consumer if the queue was
+  empty.
+  Return false if b is NULL, closed, or could not allocate space.
+*/
+bool bq_put(bq_t *b, void *val, size_t size, void *hash);
+
+/*
+  Detach up to max elements into out, waiting up to timeout_ms for the
+  first to arrive: 0 does not wait, a negative timeout waits for ever.
+  Return the number detached, 0 if b or out is NULL, on timeout or once b
+  is closed and empty.
+*/
+int bq_take(bq_t *b, list_ele_t **out, int max, int timeout_ms);
+
+/*
+  Release n elements obtained from bq_take().
+*/
+void bq_release(bq_t *b, list_ele_t **eles, int n);
+
+/*
+  Refuse further puts and wake every waiting consumer, which drain what
+  is left and then get 0.
+*/
+void bq_close(bq_t *b);
+
+/*
+  Register w to be run once data is available.
+  Return false, without registering, if data is available already or b
+  is closed.
+*/
+bool bq_on_ready(bq_t *b, bq_waiter_t *w);
+
+int bq_nodes(bq_t *b);
+
+#if __cplusplus >= 202002L
+#include <coroutine>
+
+/*
+ * co_await bq_await(b, out, max) suspends the coroutine until b has data
+ * or is closed, and evaluates to bq_take(b, out, max, 0). The coroutine
+ * resumes on the thread of the producer that woke it, and may still get
+ * 0 if another consumer took the data first. Tested by make coro.
+ */
+struct bq_await {
+    bq_t *b;
+    list_ele_t **out;
+    int max;
+    bq_waiter_t w;
+    bq_await(bq_t *b, list_ele_t **out, int max) : b(b), out(out), max(max) {}
+    bool await_ready() const { return bq_nodes(b) > 0; }
+    bool await_suspend(std::coroutine_handle<> h) {
+      w.fn = resume;
+      w.arg = h.address();
+      return bq_on_ready(b, &w);
+    }
+    int await_resume() { return bq_take(b, out, max, 0); }
+  private:
+    static void resume(void *arg) {
+      std::coroutine_handle<>::from_address(arg).resume();
+    }
+};
+#endif
+
+#endif
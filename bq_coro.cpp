@@ -0,0 +1,78 @@
+/*
+ * This program tests bq_await, which needs C++20: make coro
+ *
+ * The rest of the tree builds as gnu++11, so the coroutine test lives
+ * apart from the harness and links against the same objects.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "bq.h"
+
+/* Runs eagerly and frees itself on completion */
+struct bq_task {
+  struct promise_type {
+    bq_task get_return_object() { return bq_task(); }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { abort(); }
+  };
+};
+
+typedef struct {
+  bq_t *b;
+  list_ele_t *out[4];
+  int got;                     /* -1 while suspended */
+  pthread_t thread;            /* Thread that resumed the coroutine */
+} coro_arg_t;
+
+static bq_task consume(coro_arg_t *a)
+{
+  a->got = co_await bq_await(a->b, a->out, 4);
+  a->thread = pthread_self();
+}
+
+static void *put_one(void *arg)
+{
+  static int v = 7;
+  assert(bq_put(((coro_arg_t *) arg)->b, &v, sizeof(v), (void *) 1));
+  return NULL;
+}
+
+static void test_bq_await()
+{
+  int v = 7;
+  coro_arg_t a;
+  a.b = bq_new(Q_POOLED);
+  // Data already there: no suspend
+  assert(a.b && bq_put(a.b, &v, sizeof(v), (void *) 1));
+  a.got = -1;
+  consume(&a);
+  assert(a.got == 1 && pthread_equal(a.thread, pthread_self()));
+  bq_release(a.b, a.out, a.got);
+
+  // Suspend on empty, resumed on the producer's thread
+  a.got = -1;
+  consume(&a);
+  assert(a.got == -1);
+  pthread_t prod;
+  assert(0 == pthread_create(&prod, NULL, put_one, &a));
+  pthread_join(prod, NULL);
+  assert(a.got == 1 && !pthread_equal(a.thread, pthread_self()));
+  bq_release(a.b, a.out, a.got);
+
+  // Suspend on empty, resumed by close with nothing to take
+  a.got = -1;
+  consume(&a);
+  assert(a.got == -1);
+  bq_close(a.b);
+  assert(a.got == 0 && pthread_equal(a.thread, pthread_self()));
+  bq_free(a.b);
+}
+
+int main() {
+  test_bq_await();
+  return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Tests for the block skip list.
+ *
+ * The list itself is the bskip_list template in bskip.h.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include "bskip.h"
+
+/* Walk every block, checking order and occupancy, and return the keys */
+template <typename V, int L, int B>
+static size_t bsl_check(bskip_list<V, L, B> &list) {
+  size_t n = 0;
+  int64_t last = INT64_MIN;
+  for (auto *b = list.heads[0]; b != NULL; b = b->next[0]) {
+    assert(b->n > 0 && b->n <= B);
+    for (int i = 0; i < b->n; i++) {
+      assert(n == 0 || b->keys[i] > last);
+      last = b->keys[i];
+      n++;
+    }
+  }
+  // Every upper sublist is a sorted subsequence of the blocks
+  for (int i = 1; i < list.sl_levels(); i++) {
+    auto *lower = list.heads[i - 1];
+    for (auto *b = list.heads[i]; b != NULL; b = b->next[i]) {
+      while (lower != b) {
+        assert(lower != NULL);
+        lower = lower->next[i - 1];
+      }
+    }
+  }
+  assert(n == list.sl_count());
+  return n;
+}
+
+void test_bskip() {
+  bskip_list<int64_t, 8, 8> small(8, 0.5f, 42);
+  assert(small.sl_search(1) == NULL && !small.sl_delete_key(1));
+  assert(small.begin() == small.end());
+  // Descending inserts keep lowering the first separator, then split
+  for (int64_t k = 100; k > 0; k--) {
+    assert(small.insert(k * 10, k));
+  }
+  assert(!small.insert(500, 0) && small.sl_count() == 100);
+  assert(bsl_check(small) == 100 && small.sl_blocks() > 100 / 8);
+  for (int64_t k = 1; k <= 100; k++) {
+    int64_t *v = small.sl_search(k * 10);
+    assert(v && *v == k && !small.sl_search(k * 10 + 1));
+  }
+  assert(small.sl_search(INT64_MIN) == NULL && small.sl_search(5) == NULL);
+  auto it = small.lower_bound(455);
+  assert(it.key() == 460 && *it.value() == 46);
+  ++it;
+  assert(it.key() == 470);
+  assert(small.lower_bound(-7).key() == 10);
+  assert(small.lower_bound(1001) == small.end());
+  int64_t expect = 10;
+  for (it = small.begin(); it != small.end(); ++it, expect += 10) {
+    assert(it.key() == expect);
+  }
+  // Deletes merge sparse blocks and unlink empty ones
+  for (int64_t k = 1; k <= 100; k++) {
+    if (k % 3 != 0) assert(small.sl_delete_key(k * 10));
+  }
+  assert(!small.sl_delete_key(10) && !small.sl_delete_key(31));
+  assert(bsl_check(small) == 33 && small.sl_search(30) && !small.sl_search(40));
+  for (int64_t k = 3; k <= 100; k += 3) {
+    assert(small.sl_delete_key(k * 10));
+    bsl_check(small);
+  }
+  assert(small.sl_blocks() == 0 && small.heads[0] == NULL);
+  assert(small.insert(-1, 9) && *small.sl_search(-1) == 9);
+
+  // Random keys against a sorted reference, with the default block size
+  const int n = 4000;
+  int64_t *ref = (int64_t *) calloc(n, sizeof(int64_t));
+  bskip_list<int64_t> list(16, BSL_P, 7);
+  uint64_t rng = sl_rng::seed(99);
+  size_t live = 0;
+  for (int round = 0; round < 4 * n; round++) {
+    rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+    int slot = (int) ((rng >> 33) % n);
+    int64_t key = (int64_t) slot * 2654435761LL - n;   // spread, some negative
+    if (ref[slot] == 0) {
+      assert(list.insert(key, slot));
+      ref[slot] = 1;
+      live++;
+    } else if (round & 1) {
+      assert(list.sl_delete_key(key));
+      ref[slot] = 0;
+      live--;
+    } else {
+      assert(!list.insert(key, -1) && *list.sl_search(key) == slot);
+    }
+  }
+  assert(bsl_check(list) == live);
+  for (int slot = 0; slot < n; slot++) {
+    int64_t key = (int64_t) slot * 2654435761LL - n;
+    int64_t *v = list.sl_search(key);
+    assert(ref[slot] ? (v && *v == slot) : v == NULL);
+  }
+  assert(list.sl_blocks() * BSL_BLOCK >= live && list.sl_blocks() <= live);
+  free(ref);
+}
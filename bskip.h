@@ -0,0 +1,288 @@
+/*
+ * Implements an unrolled ("B-") skip list: the bottom list is a chain of
+ * blocks, each holding up to Block sorted int64_t keys with their values
+ * in parallel arrays, and the sublists above index those blocks by their
+ * smallest key.
+ *
+ * Interface notes:
+ * -A search hops between blocks as a skip list hops between nodes, then
+ *   finds its key inside the block with simd_find_ge(), so that most of
+ *   the keys it looks at are read sequentially from a few cache lines
+ *   rather than through one dependent pointer load each.
+ * -Block towers are rolled with sl_rng, as basic_skip_list rolls node
+ *   towers, when a full block splits; balancing stays probabilistic.
+ * -Keys are unique; insert() fails on a key already present. A block that
+ *   falls to a quarter full after a delete absorbs its successor if the
+ *   two fit in half a block, and blocks that empty are unlinked.
+ * -Values are copied in and must be trivially copyable. Pointers returned
+ *   by sl_search() are valid until the next insert or delete.
+ */
+#ifndef BSKIP_H
+#define BSKIP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <type_traits>
+#include "pool.h"
+#include "simd.h"
+#include "skip.h"
+
+#define BSL_BLOCK 32 // keys per block: four cache lines of keys
+#define BSL_P 0.25f // block promotion probability
+
+/*
+ * keys[0] is the block's separator: every key in the blocks before it is
+ * smaller, every key in it and after it is at least as large.
+ */
+template <typename V, int Block>
+struct bsl_block {
+  int64_t keys[Block];
+  int n;       // keys in use
+  int height;
+  V vals[Block];
+  struct bsl_block *next[];
+};
+
+template <typename V, int MaxLevel = 16, int Block = BSL_BLOCK>
+class bskip_list {
+  static_assert(MaxLevel >= 1, "at least one list");
+  static_assert(Block >= 4, "blocks split in halves and merge at quarters");
+  static_assert(std::is_trivially_copyable<V>::value,
+                "values are copied bytewise");
+  public:
+    typedef bsl_block<V, Block> block_t;
+    block_t *heads[MaxLevel];  // first block of each sublist
+    explicit bskip_list(int max_levels = MaxLevel, float p = BSL_P,
+                        uint64_t seed = 0)
+      : levels(max_levels), count(0), nblocks(0), roll(p) {
+      assert(1 <= max_levels && max_levels <= MaxLevel);
+      for (int i = 0; i < MaxLevel; i++) {
+        heads[i] = NULL;
+      }
+      if (seed == 0) seed = (uint64_t) (uintptr_t) this ^ (uint64_t) time(NULL);
+      rng = sl_rng::seed(seed);
+      pool_init(&pool);
+    }
+    ~bskip_list() {
+      pool_destroy(&pool);
+    }
+    bskip_list(const bskip_list &) = delete;
+    bskip_list &operator=(const bskip_list &) = delete;
+
+    bool insert(int64_t key, const V &val);
+    V *sl_search(int64_t key);
+    bool sl_delete_key(int64_t key);
+    size_t sl_count() const { return count; }
+    size_t sl_blocks() const { return nblocks; }
+    int sl_levels() const { return levels; }
+
+    /* Forward iterator in key order */
+    class iterator {
+      public:
+        explicit iterator(block_t *b = NULL, int i = 0) : b(b), i(i) {}
+        int64_t key() const { return b->keys[i]; }
+        V *value() const { return &b->vals[i]; }
+        iterator &operator++() {
+          if (++i == b->n) {
+            b = b->next[0];
+            i = 0;
+          }
+          return *this;
+        }
+        bool operator==(const iterator &o) const { return b == o.b && i == o.i; }
+        bool operator!=(const iterator &o) const { return !(*this == o); }
+      private:
+        block_t *b;
+        int i;
+    };
+    iterator begin() { return iterator(heads[0]); }
+    iterator end() { return iterator(); }
+    iterator lower_bound(int64_t key);
+  private:
+    pool_t pool;
+    int levels;
+    size_t count;
+    size_t nblocks;
+    sl_rng roll;
+    uint64_t rng;
+    block_t **sl_link(block_t *prev, int i) {
+      return prev ? &prev->next[i] : &heads[i];
+    }
+    block_t *bsl_find(int64_t key, bool strict, block_t **prev_pts);
+    block_t *bsl_new_block(int height);
+    void bsl_free_block(block_t *b);
+    void bsl_unlink(block_t *b, block_t **prev_pts);
+};
+
+/*
+ * Descend to the last block of each sublist whose separator is at most
+ * key (strict: less than key), storing it in prev_pts (NULL for the head)
+ * and returning the bottom one. Only separators are compared on the way.
+ */
+template <typename V, int L, int B>
+typename bskip_list<V, L, B>::block_t *
+bskip_list<V, L, B>::bsl_find(int64_t key, bool strict, block_t **prev_pts) {
+  block_t *prev = NULL;
+  for (int i = levels - 1; i >= 0; i--) {
+    block_t *pt = *sl_link(prev, i);
+    while (pt != NULL && (strict ? pt->keys[0] < key : pt->keys[0] <= key)) {
+      prev = pt;
+      pt = pt->next[i];
+    }
+    prev_pts[i] = prev;
+  }
+  return prev;
+}
+
+template <typename V, int L, int B>
+typename bskip_list<V, L, B>::block_t *
+bskip_list<V, L, B>::bsl_new_block(int height) {
+  block_t *b = (block_t *) pool_alloc(&pool, sizeof(block_t) +
+                                             height * sizeof(block_t *));
+  if (b == NULL) return NULL;
+  b->n = 0;
+  b->height = height;
+  nblocks++;
+  return b;
+}
+
+template <typename V, int L, int B>
+void bskip_list<V, L, B>::bsl_free_block(block_t *b) {
+  pool_release(&pool, b, sizeof(block_t) + b->height * sizeof(block_t *));
+  nblocks--;
+}
+
+/*
+ * Unlink b from every sublist it is in, given for each level a block at
+ * or before b's predecessor there.
+ */
+template <typename V, int L, int B>
+void bskip_list<V, L, B>::bsl_unlink(block_t *b, block_t **prev_pts) {
+  for (int i = 0; i < b->height; i++) {
+    block_t **link = sl_link(prev_pts[i], i);
+    while (*link != b) {
+      link = &(*link)->next[i];
+    }
+    *link = b->next[i];
+  }
+}
+
+/*
+ * Insert into the block that covers key. A full block first splits in
+ * half; the upper half becomes a new block with a freshly rolled tower,
+ * linked in right after the old one, whose predecessor in each sublist is
+ * the one found on the way down. Keys below the first separator go into
+ * the first block, lowering its separator.
+ */
+template <typename V, int L, int B>
+bool bskip_list<V, L, B>::insert(int64_t key, const V &val) {
+  block_t *prev_pts[L];
+  block_t *cur = bsl_find(key, false, prev_pts);
+  if (cur == NULL) {
+    cur = heads[0];
+    for (int i = 0; i < levels; i++) {
+      prev_pts[i] = (cur != NULL && heads[i] == cur) ? cur : NULL;
+    }
+  }
+  if (cur == NULL) {
+    cur = bsl_new_block(levels);
+    if (cur == NULL) return false;
+    for (int i = 0; i < levels; i++) {
+      cur->next[i] = NULL;
+      heads[i] = cur;
+    }
+  }
+  int at = (int) simd_find_ge(cur->keys, cur->n, key);
+  if (at < cur->n && cur->keys[at] == key) return false;
+  if (cur->n == B) {
+    block_t *upper = bsl_new_block(roll.height(&rng, levels));
+    if (upper == NULL) return false;
+    int half = B / 2;
+    upper->n = B - half;
+    memcpy(upper->keys, cur->keys + half, upper->n * sizeof(int64_t));
+    memcpy(upper->vals, cur->vals + half, upper->n * sizeof(V));
+    cur->n = half;
+    for (int i = 0; i < upper->height; i++) {
+      block_t *prev = (i < cur->height) ? cur : prev_pts[i];
+      block_t **link = sl_link(prev, i);
+      upper->next[i] = *link;
+      *link = upper;
+    }
+    if (at >= half) {
+      cur = upper;
+      at -= half;
+    }
+  }
+  memmove(cur->keys + at + 1, cur->keys + at, (cur->n - at) * sizeof(int64_t));
+  memmove(cur->vals + at + 1, cur->vals + at, (cur->n - at) * sizeof(V));
+  cur->keys[at] = key;
+  cur->vals[at] = val;
+  cur->n++;
+  count++;
+  return true;
+}
+
+template <typename V, int L, int B>
+V *bskip_list<V, L, B>::sl_search(int64_t key) {
+  block_t *prev_pts[L];
+  block_t *cur = bsl_find(key, false, prev_pts);
+  if (cur == NULL) return NULL;
+  size_t at = simd_find_ge(cur->keys, cur->n, key);
+  if (at < (size_t) cur->n && cur->keys[at] == key) return &cur->vals[at];
+  return NULL;
+}
+
+template <typename V, int L, int B>
+typename bskip_list<V, L, B>::iterator
+bskip_list<V, L, B>::lower_bound(int64_t key) {
+  block_t *prev_pts[L];
+  block_t *cur = bsl_find(key, false, prev_pts);
+  if (cur == NULL) return begin();
+  size_t at = simd_find_ge(cur->keys, cur->n, key);
+  if (at == (size_t) cur->n) return iterator(cur->next[0]);
+  return iterator(cur, (int) at);
+}
+
+/*
+ * Locate key with a strict descent, so that prev_pts holds blocks before
+ * the one holding key in every sublist, and remove it from its block.
+ * An emptied block is unlinked; one left a quarter full merges with its
+ * successor when both fit in half a block. The successor's predecessor is
+ * cur itself in the sublists cur is in, and found on the way down below.
+ */
+template <typename V, int L, int B>
+bool bskip_list<V, L, B>::sl_delete_key(int64_t key) {
+  block_t *prev_pts[L];
+  block_t *cur = bsl_find(key, true, prev_pts);
+  block_t *next = *sl_link(cur, 0);
+  if (next != NULL && next->keys[0] == key) cur = next;
+  if (cur == NULL) return false;
+  int at = (int) simd_find_ge(cur->keys, cur->n, key);
+  if (at == cur->n || cur->keys[at] != key) return false;
+  cur->n--;
+  memmove(cur->keys + at, cur->keys + at + 1, (cur->n - at) * sizeof(int64_t));
+  memmove(cur->vals + at, cur->vals + at + 1, (cur->n - at) * sizeof(V));
+  count--;
+  if (cur->n == 0) {
+    bsl_unlink(cur, prev_pts);
+    bsl_free_block(cur);
+    return true;
+  }
+  next = cur->next[0];
+  if (cur->n <= B / 4 && next != NULL && cur->n + next->n <= B / 2) {
+    memcpy(cur->keys + cur->n, next->keys, next->n * sizeof(int64_t));
+    memcpy(cur->vals + cur->n, next->vals, next->n * sizeof(V));
+    cur->n += next->n;
+    for (int i = 0; i < cur->height; i++) {
+      prev_pts[i] = cur;
+    }
+    bsl_unlink(next, prev_pts);
+    bsl_free_block(next);
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ * This program implements a queue stored as a list of element chunks.
+ *
+ * See cq.h for the layout.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "cq.h"
+#include "simd.h"
+
+static_assert(sizeof(cq_chunk_t) <= 2048, "chunk outgrew its size class");
+
+static inline void *cq_value(cq_chunk_t *c, int i)
+{
+  return c->value[i] ? c->value[i] : c->data[i];
+}
+
+cq_t *cq_new()
+{
+  cq_t *q = (cq_t *) malloc(sizeof(cq_t));
+  if (q==NULL) return NULL;
+  q->head = NULL;
+  q->tail = NULL;
+  q->spare = NULL;
+  q->nodes = 0;
+  q->size = 0;
+  pool_init(&q->pool);
+  return q;
+}
+
+void cq_free(cq_t *q)
+{
+  if (q==NULL) return;
+  pool_destroy(&q->pool);
+  free(q);
+}
+
+/*
+ * An emptied chunk is reused for the next one needed, so that a queue
+ * hovering around a chunk boundary does not allocate on every crossing.
+ * A chunk starts out empty at the end it will be filled from.
+ */
+static cq_chunk_t *chunk_get(cq_t *q, bool at_head)
+{
+  cq_chunk_t *c = q->spare;
+  if (c != NULL) q->spare = NULL;
+  else c = (cq_chunk_t *) pool_alloc(&q->pool, sizeof(cq_chunk_t));
+  if (c==NULL) return NULL;
+  c->next = NULL;
+  c->prev = NULL;
+  c->begin = c->end = at_head ? CQ_CHUNK : 0;
+  return c;
+}
+
+static void chunk_put(cq_t *q, cq_chunk_t *c)
+{
+  if (q->spare == NULL) q->spare = c;
+  else pool_release(&q->pool, c, sizeof(cq_chunk_t));
+}
+
+/*
+ * Copy the payload into slot i of c, inline if it fits. A fresh chunk is
+ * only linked in once this succeeds, so that no chunk in the list is empty.
+ */
+static bool slot_fill(cq_t *q, cq_chunk_t *c, int i, void *val, size_t size,
+                      void *hash)
+{
+  void *dst = c->data[i];
+  c->value[i] = NULL;
+  if (size > CQ_INLINE)
+  {
+    dst = pool_alloc(&q->pool, size);
+    if (dst==NULL) return false;
+    c->value[i] = dst;
+  }
+  if (size > 0) memcpy(dst, val, size);
+  c->hash[i] = hash;
+  c->size[i] = size;
+  q->nodes++;
+  q->size += size;
+  return true;
+}
+
+bool cq_insert_head(cq_t *q, void *val, size_t size, void *hash)
+{
+  if (q==NULL) return false;
+  cq_chunk_t *c = q->head;
+  bool fresh = c == NULL || c->begin == 0;
+  if (fresh)
+  {
+    c = chunk_get(q, true);
+    if (c==NULL) return false;
+  }
+  if (!slot_fill(q, c, c->begin - 1, val, size, hash))
+  {
+    if (fresh) chunk_put(q, c);
+    return false;
+  }
+  c->begin--;
+  if (fresh)
+  {
+    c->next = q->head;
+    if (q->head != NULL) q->head->prev = c;
+    else q->tail = c;
+    q->head = c;
+  }
+  return true;
+}
+
+bool cq_insert_tail(cq_t *q, void *val, size_t size, void *hash)
+{
+  if (q==NULL) return false;
+  cq_chunk_t *c = q->tail;
+  bool fresh = c == NULL || c->end == CQ_CHUNK;
+  if (fresh)
+  {
+    c = chunk_get(q, false);
+    if (c==NULL) return false;
+  }
+  if (!slot_fill(q, c, c->end, val, size, hash))
+  {
+    if (fresh) chunk_put(q, c);
+    return false;
+  }
+  c->end++;
+  if (fresh)
+  {
+    c->prev = q->tail;
+    if (q->tail != NULL) q->tail->next = c;
+    else q->head = c;
+    q->tail = c;
+  }
+  return true;
+}
+
+bool cq_remove_head(cq_t *q, void *sp, size_t bufsize)
+{
+  if (q==NULL || q->head==NULL) return false;
+  cq_chunk_t *c = q->head;
+  int i = c->begin;
+  size_t size = c->size[i];
+  if (sp != NULL) memcpy(sp, cq_value(c, i), size < bufsize ? size : bufsize);
+  if (c->value[i] != NULL) pool_release(&q->pool, c->value[i], size);
+  q->nodes--;
+  q->size -= size;
+  if (++c->begin == c->end)
+  {
+    q->head = c->next;
+    if (q->head != NULL) q->head->prev = NULL;
+    else q->tail = NULL;
+    chunk_put(q, c);
+  }
+  return true;
+}
+
+void *cq_peek_head(cq_t *q, size_t *size, void **hash)
+{
+  if (q==NULL || q->head==NULL) return NULL;
+  cq_chunk_t *c = q->head;
+  if (size != NULL) *size = c->size[c->begin];
+  if (hash != NULL) *hash = c->hash[c->begin];
+  return cq_value(c, c->begin);
+}
+
+int cq_nodes(cq_t *q)
+{
+  if (q==NULL) return 0;
+  return q->nodes;
+}
+
+size_t cq_size(cq_t *q)
+{
+  if (q==NULL) return 0;
+  return q->size;
+}
+
+/*
+ * Reverse the chunk list, then each chunk's live slots in place. Inline
+ * payloads move with their slot.
+ */
+void cq_reverse(cq_t *q)
+{
+  if (q==NULL) return;
+  for (cq_chunk_t *c = q->head; c != NULL; c = c->prev)
+  {
+    cq_chunk_t *next = c->next;
+    c->next = c->prev;
+    c->prev = next;
+    for (int i = c->begin, j = c->end - 1; i < j; i++, j--)
+    {
+      void *h = c->hash[i];
+      c->hash[i] = c->hash[j];
+      c->hash[j] = h;
+      size_t s = c->size[i];
+      c->size[i] = c->size[j];
+      c->size[j] = s;
+      void *v = c->value[i];
+      c->value[i] = c->value[j];
+      c->value[j] = v;
+      char tmp[CQ_INLINE];
+      memcpy(tmp, c->data[i], CQ_INLINE);
+      memcpy(c->data[i], c->data[j], CQ_INLINE);
+      memcpy(c->data[j], tmp, CQ_INLINE);
+    }
+  }
+  cq_chunk_t *head = q->head;
+  q->head = q->tail;
+  q->tail = head;
+}
+
+void *cq_search(cq_t *q, void *hash, size_t *size)
+{
+  if (q==NULL) return NULL;
+  for (cq_chunk_t *c = q->head; c != NULL; c = c->next)
+  {
+    size_t n = c->end - c->begin;
+    size_t i = c->begin + simd_find_eq((const uint64_t *) (c->hash + c->begin),
+                                       n, (uint64_t) (uintptr_t) hash);
+    if (i < (size_t) c->end)
+    {
+      if (size != NULL) *size = c->size[i];
+      return cq_value(c, i);
+    }
+  }
+  return NULL;
+}
+
+void cq_print(cq_t *q) {
+  int i = 0;
+  for (cq_chunk_t *c = q->head; c != NULL; c = c->next) {
+    for (int j = c->begin; j < c->end; j++) {
+      printf("Node %d with hash %p has size %#zx\n", i, c->hash[j],
+             c->size[j]);
+      i++;
+    }
+  }
+}
+
+void test_cq() {
+  char val[40] = "Corruption check, out of line";
+  size_t size = 1 + (size_t) strlen(val);
+  cq_t *q = cq_new();
+  assert(q && !cq_remove_head(q, NULL, 0) && !cq_peek_head(q, NULL, NULL));
+  assert(cq_insert_tail(q, val, size, (void *) 1));
+  assert(cq_insert_head(q, val, 4, (void *) 2));
+  assert(cq_nodes(q) == 2 && cq_size(q) == size + 4);
+  size_t got = 0;
+  char *hit = (char *) cq_search(q, (void *) 1, &got);
+  assert(hit && got == size && 0 == strcmp(hit, val));
+  assert(cq_search(q, (void *) 2, NULL) && !cq_search(q, (void *) 3, NULL));
+  cq_print(q);
+  cq_reverse(q);
+  void *h = NULL;
+  assert(cq_peek_head(q, &got, &h) && h == (void *) 1 && got == size);
+  char buf[40];
+  assert(cq_remove_head(q, buf, sizeof(buf)) && 0 == strcmp(buf, val));
+  assert(cq_remove_head(q, buf, 2) && 0 == memcmp(buf, val, 2));
+  assert(cq_nodes(q) == 0 && cq_size(q) == 0 && q->head == NULL);
+
+  // A payload that cannot be allocated leaves no empty chunk behind
+  assert(!cq_insert_tail(q, val, SIZE_MAX, (void *) 3));
+  assert(!cq_insert_head(q, val, SIZE_MAX, (void *) 3));
+  assert(q->head == NULL && q->tail == NULL && !cq_peek_head(q, NULL, NULL));
+  for (int i = 0; i < CQ_CHUNK; i++) {
+    assert(cq_insert_tail(q, val, 4, (void *) 4));
+  }
+  assert(!cq_insert_tail(q, val, SIZE_MAX, (void *) 3));
+  assert(!cq_insert_head(q, val, SIZE_MAX, (void *) 3));
+  assert(q->head == q->tail && cq_nodes(q) == CQ_CHUNK);
+  for (int i = 0; i < CQ_CHUNK; i++) {
+    assert(cq_remove_head(q, NULL, 0));
+  }
+  assert(q->head == NULL && !cq_remove_head(q, NULL, 0));
+
+  // Mixed ends across many chunks: head gets odd keys, tail even ones
+  for (intptr_t i = 0; i < 1000; i++) {
+    size_t n = (i % 3 == 0) ? sizeof(val) : sizeof(i);
+    memcpy(val, &i, sizeof(i));
+    bool ok = (i & 1) ? cq_insert_head(q, val, n, (void *) i)
+                      : cq_insert_tail(q, val, n, (void *) i);
+    assert(ok);
+  }
+  assert(cq_nodes(q) == 1000);
+  for (intptr_t i = 0; i < 1000; i++) {
+    intptr_t *v = (intptr_t *) cq_search(q, (void *) i, NULL);
+    assert(v && *v == i);
+  }
+  cq_reverse(q);
+  for (int pass = 0; pass < 2; pass++) {
+    // reversed: even keys descending, then odd keys ascending
+    intptr_t expect = 998;
+    for (cq_chunk_t *c = q->head; c != NULL; c = c->next) {
+      for (int j = c->begin; j < c->end; j++) {
+        assert(c->hash[j] == (void *) expect);
+        assert(*(intptr_t *) cq_value(c, j) == expect);
+        expect = (expect == 0) ? 1 : ((expect & 1) ? expect + 2 : expect - 2);
+      }
+    }
+    assert(expect == 1001);
+    if (pass == 0) {
+      cq_reverse(q);
+      cq_reverse(q);
+    }
+  }
+  for (int i = 0; i < 990; i++) {
+    assert(cq_remove_head(q, NULL, 0));
+  }
+  assert(cq_nodes(q) == 10);
+  cq_free(q);
+}
@@ -0,0 +1,103 @@
+/*
+ * This program implements a queue supporting FIFO and LIFO insertion,
+ * stored as a doubly-linked list of fixed-size chunks rather than of
+ * single elements.
+ *
+ * Each chunk keeps the hashes, sizes and payload pointers of up to
+ * CQ_CHUNK elements in parallel arrays, so that searching, reversing and
+ * printing walk memory sequentially and inspect CQ_CHUNK elements per
+ * pointer chased; cq_search() compares several hashes per instruction
+ * (simd.h). Payloads of at most CQ_INLINE bytes live in the chunk
+ * itself; larger ones are copied into the queue's pool. Elements are
+ * copied in and out rather than handed over as packed list_ele_t nodes.
+ */
+#ifndef CQ_H
+#define CQ_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "pool.h"
+
+#define CQ_CHUNK 48 // elements per chunk; a chunk fills a 2 KB pool block
+#define CQ_INLINE 16 // largest payload stored in the chunk
+
+/************** Data structure declarations ****************/
+
+typedef struct CHUNK {
+    void *hash[CQ_CHUNK];
+    size_t size[CQ_CHUNK];
+    void *value[CQ_CHUNK];        /* Payload, NULL if it is in data */
+    struct CHUNK *next;
+    struct CHUNK *prev;
+    int begin;                    /* Live slots are [begin, end) */
+    int end;
+    char data[CQ_CHUNK][CQ_INLINE];
+} cq_chunk_t;
+
+typedef struct {
+    cq_chunk_t *head;
+    cq_chunk_t *tail;
+    cq_chunk_t *spare;            /* Last emptied chunk, kept for reuse */
+    int nodes;
+    size_t size;
+    pool_t pool;                  /* Chunks and large payloads */
+} cq_t;
+
+/************** Operations on cq ***************************/
+
+/*
+  Create empty queue.
+  Return NULL if could not allocate space.
+*/
+cq_t *cq_new();
+
+/*
+  Free all storage used by queue.
+  No effect if q is NULL
+*/
+void cq_free(cq_t *q);
+
+/*
+  Attempt to insert a copy of size bytes of val at head or tail of queue.
+  Return true if successful.
+  Return false if q is NULL or could not allocate space.
+ */
+bool cq_insert_head(cq_t *q, void *val, size_t size, void *hash);
+bool cq_insert_tail(cq_t *q, void *val, size_t size, void *hash);
+
+/*
+  Attempt to remove element from head of queue.
+  If sp is non-NULL, copy up to bufsize bytes of its payload there.
+  Return false if queue is NULL or empty.
+*/
+bool cq_remove_head(cq_t *q, void *sp, size_t bufsize);
+
+/*
+  Payload of the head element, with its size and hash if requested.
+  Return NULL if queue is NULL or empty.
+*/
+void *cq_peek_head(cq_t *q, size_t *size, void **hash);
+
+/*
+  Return number of elements and total payload bytes in queue.
+  Return 0 if q is NULL or empty
+ */
+int cq_nodes(cq_t *q);
+size_t cq_size(cq_t *q);
+
+/*
+  Reverse elements in queue
+  No effect if q is NULL or empty
+ */
+void cq_reverse(cq_t *q);
+
+/*
+  Payload of the element closest to the head whose hash equals hash, with
+  its size if requested. Valid until that element is removed.
+  Return NULL if there is none.
+ */
+void *cq_search(cq_t *q, void *hash, size_t *size);
+
+void cq_print(cq_t *q);
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Implements a lock-free skip-list.
+ *
+ * The implementation is the concurrent_skip_list template in cskip.h; this
+ * file holds its tests.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "cskip.h"
+
+#define CSL_THREADS 4
+#define CSL_KEYS 20000
+
+typedef concurrent_skip_list<int64_t, int64_t, sl_three_way<int64_t>, 16>
+    csl_t;
+
+typedef struct {
+    csl_t *sl;
+    pthread_barrier_t *phase;   /* Writers finish inserting before deleting */
+    int id;
+    size_t won;   /* Inserts or deletes that succeeded */
+} csl_arg_t;
+
+/*
+ * Every thread inserts every key and then deletes every third one, so each
+ * key is contended by all of them and exactly one of them wins each update.
+ */
+static void *csl_writer(void *p)
+{
+  csl_arg_t *arg = (csl_arg_t *) p;
+  for (int64_t i = 0; i < CSL_KEYS; i++) {
+    int64_t k = (i * 7919 + arg->id * 101) % CSL_KEYS;
+    arg->won += arg->sl->insert(k, -k);
+  }
+  pthread_barrier_wait(arg->phase);
+  for (int64_t k = 0; k < CSL_KEYS; k += 3) {
+    arg->won += arg->sl->sl_delete_key(k);
+  }
+  return NULL;
+}
+
+/*
+ * Keys below zero are inserted before the writers start and never deleted,
+ * so they must stay visible throughout.
+ */
+static void *csl_reader(void *p)
+{
+  csl_arg_t *arg = (csl_arg_t *) p;
+  for (int round = 0; round < 20; round++) {
+    for (int64_t k = -100; k < 0; k++) {
+      int64_t v = 0;
+      assert(arg->sl->get(k, &v) && v == -k);
+    }
+    for (int64_t k = 0; k < CSL_KEYS; k += 97) {
+      csl_t::guard g(*arg->sl);
+      csl_t::node_t *hit = arg->sl->sl_search(k);
+      assert(hit == NULL || *csl_t::value(hit) == -k);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Run the writers and readers on a list holding -100..-1, and check what
+ * is left.
+ */
+static void csl_churn(csl_t &sl) {
+  pthread_t threads[2 * CSL_THREADS];
+  csl_arg_t args[2 * CSL_THREADS];
+  pthread_barrier_t phase;
+  pthread_barrier_init(&phase, NULL, CSL_THREADS);
+  for (int t = 0; t < 2 * CSL_THREADS; t++) {
+    args[t].sl = &sl;
+    args[t].phase = &phase;
+    args[t].id = t;
+    args[t].won = 0;
+    assert(0 == pthread_create(&threads[t], NULL,
+                               (t < CSL_THREADS) ? csl_writer : csl_reader,
+                               &args[t]));
+  }
+  size_t won = 0;
+  for (int t = 0; t < 2 * CSL_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+    won += args[t].won;
+  }
+  pthread_barrier_destroy(&phase);
+  size_t deleted = (CSL_KEYS + 2) / 3;
+  assert(won == CSL_KEYS + deleted);
+  assert(sl.sl_count() == 100 + CSL_KEYS - deleted);
+
+  int64_t expect = -100;
+  size_t n = 0;
+  for (csl_t::node_t *pt = sl.sl_first(); pt != NULL; pt = sl.sl_next(pt)) {
+    assert(csl_t::key(pt) == expect && *csl_t::value(pt) == -expect);
+    do {
+      expect++;
+    } while (expect >= 0 && expect % 3 == 0);
+    n++;
+  }
+  assert(n == sl.sl_count());
+}
+
+void test_csl() {
+  csl_t sl;
+  for (int64_t k = -100; k < 0; k++) {
+    assert(sl.insert(k, -k));
+    assert(!sl.insert(k, 0));
+  }
+  assert(sl.sl_count() == 100);
+  assert(sl.sl_delete_key(-50) && !sl.sl_delete_key(-50));
+  assert(!sl.sl_contains(-50) && sl.sl_contains(-51));
+  assert(sl.insert(-50, 50));
+
+  char val[40] = "Payloads are always copied.";
+  list_ele_t *ele = pack(val, sizeof(val), (void *) (intptr_t) (CSL_KEYS + 1));
+  assert(sl.sl_insert(ele));
+  {
+    csl_t::guard g(sl);
+    csl_t::node_t *hit = sl.sl_search(CSL_KEYS + 1);
+    assert(hit && hit->value != ele->value);
+    assert(0 == strcmp((char *) hit->value, val));
+  }
+  assert(sl.sl_delete(ele) && !sl.sl_contains(CSL_KEYS + 1));
+  unpack(NULL, ele);
+
+  csl_churn(sl);
+
+  // The same churn with nodes from per-thread arenas, all returned after
+  pool_arenas_t *arenas = pool_arenas_new(POOL_NUMA_LOCAL, 0);
+  {
+    csl_t placed(16, SL_DEFAULT_P, arenas);
+    for (int64_t k = -100; k < 0; k++) {
+      assert(placed.insert(k, -k));
+    }
+    csl_churn(placed);
+  }
+  uint64_t allocs = 0, remote = 0;
+  for (int i = 0; i < POOL_ARENAS; i++) {
+    pool_usage_t u;
+    pool_arena_usage(arenas, i, &u);
+    assert(u.used == 0 && u.releases == u.allocs);
+    allocs += u.allocs;
+    remote += u.remote;
+  }
+  assert(allocs >= 100 + CSL_KEYS && remote > 0);
+  pool_arenas_free(arenas);
+}
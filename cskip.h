@@ -0,0 +1,375 @@
+/*
+ * Implements a lock-free skip-list that any number of threads may search,
+ * insert into and delete from at once.
+ * See: Herlihy & Shavit, The Art of Multiprocessor Programming, ch. 14
+ *
+ * Interface notes:
+ * -concurrent_skip_list mirrors basic_skip_list's template parameters and
+ *   sl_ operations, but holds a set: sl_insert() fails if the key is
+ *   already present.
+ * -Links are updated with compare-and-swap only. A node is deleted
+ *   logically by setting the low bit of each of its next pointers, top
+ *   down, and the marking of the bottom one is the moment it leaves the
+ *   set; whichever traversal next passes the node unlinks it physically.
+ *   Searches never write and never restart, so readers are not slowed
+ *   down by writers beyond the cache traffic.
+ * -Unlinked nodes are freed through epoch-based reclamation (epoch.h). A
+ *   node returned by sl_search() stays valid while the calling thread holds
+ *   a guard on the list; sl_contains() and get() copy out instead.
+ * -Payloads are always copied into the node, whatever their size, since
+ *   readers may still be looking at a node after it was deleted.
+ * -The height of each node is drawn from a per-thread generator, so no
+ *   seeding is needed.
+ * -Nodes come from malloc(), or from a pool_arenas_t given at creation,
+ *   in which case every thread allocates from its own arena, placed as
+ *   the family says; the family must outlive the list.
+ */
+#ifndef CSKIP_H
+#define CSKIP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <new>
+#include "q.h"
+#include "skip.h"
+#include "epoch.h"
+
+#define CSL_INSERTED 0x1 // inserter has stopped linking the node
+#define CSL_UNLINKED 0x2 // deleter has unlinked the node
+
+/*
+ * A node is a header plus a tower of tagged next pointers; the low bit of
+ * next[i] set means the node is being deleted from sublist i. state
+ * collects CSL_INSERTED and CSL_UNLINKED; the thread that completes it
+ * retires the node.
+ */
+template <typename K>
+struct csl_node {
+  void *value;
+  size_t payload_size;
+  K hash;
+  int height;
+  std::atomic<int> state;
+  std::atomic<uintptr_t> next[];
+};
+
+template <typename K, typename V, typename Compare, int MaxLevel>
+class concurrent_skip_list {
+  static_assert(MaxLevel >= 1, "at least one list");
+  public:
+    typedef csl_node<K> node_t;
+    explicit concurrent_skip_list(int max_levels = MaxLevel, float p = SL_DEFAULT_P,
+                                  pool_arenas_t *arenas = NULL)
+      : levels(max_levels), roll(p), count(0), arenas(arenas) {
+      assert(1 <= max_levels && max_levels <= MaxLevel);
+      assert(0.0f <= p && p < 1.0f);
+      head = sl_new_node(K(), NULL, 0, MaxLevel);
+      assert(head != NULL);
+      for (int i = 0; i < MaxLevel; i++) {
+        head->next[i].store(0);
+      }
+      bool ok = epoch_init(&domain);
+      assert(ok);
+      (void) ok;
+    }
+    /* No other thread may be using the list */
+    ~concurrent_skip_list() {
+      node_t *pt = head;
+      while (pt != NULL) {
+        node_t *next = sl_ptr(pt->next[0].load());
+        sl_free_node(pt);
+        pt = next;
+      }
+      epoch_destroy(&domain);
+    }
+    concurrent_skip_list(const concurrent_skip_list &) = delete;
+    concurrent_skip_list &operator=(const concurrent_skip_list &) = delete;
+
+    /* Keeps the calling thread inside a critical section while in scope */
+    class guard {
+      public:
+        explicit guard(concurrent_skip_list &sl) : rec(epoch_self(&sl.domain)) {
+          if (rec) epoch_enter(rec);
+        }
+        ~guard() { if (rec) epoch_exit(rec); }
+        bool ok() const { return rec != NULL; }
+        guard(const guard &) = delete;
+        guard &operator=(const guard &) = delete;
+      private:
+        epoch_rec_t *rec;
+        friend class concurrent_skip_list;
+    };
+
+    bool sl_insert(list_ele_t *node);
+    bool sl_delete(list_ele_t *node);
+    bool sl_delete_key(K key);
+    node_t *sl_search(K key);
+    bool sl_contains(K key);
+    int sl_levels() const { return levels; }
+    /* Exact only while no update is in flight */
+    size_t sl_count() const { return count.load(std::memory_order_relaxed); }
+
+    bool insert(K key, const V &val) {
+      static_assert(std::is_trivially_copyable<V>::value,
+                    "payloads are copied bytewise");
+      return sl_insert_kv(key, (void *) &val, sizeof(V));
+    }
+    /* Copy out the value stored under key */
+    bool get(K key, V *out) {
+      guard g(*this);
+      node_t *node = g.ok() ? sl_search(key) : NULL;
+      if (node == NULL) return false;
+      memcpy(out, node->value, sizeof(V));
+      return true;
+    }
+    static K key(const node_t *node) { return node->hash; }
+    static V *value(node_t *node) { return (V *) node->value; }
+    node_t *sl_first() { return sl_ptr(head->next[0].load()); }
+    static node_t *sl_next(node_t *node) {
+      return sl_ptr(node->next[0].load());
+    }
+  private:
+    node_t *head;    // sentinel, sorts before every key
+    int levels;
+    sl_rng roll;
+    std::atomic<size_t> count;
+    pool_arenas_t *arenas;
+    epoch_t domain;
+    static node_t *sl_ptr(uintptr_t link) { return (node_t *) (link & ~1UL); }
+    static bool sl_marked(uintptr_t link) { return link & 1; }
+    bool sl_find(K key, node_t **preds, node_t **succs);
+    node_t *sl_new_node(K key, void *val, size_t size, int height);
+    void sl_free_node(node_t *node) {
+      if (arenas) pool_arena_free(node);
+      else free(node);
+    }
+    bool sl_insert_kv(K key, void *val, size_t size);
+    void sl_retire(epoch_rec_t *rec, node_t *node, int flag);
+    int sl_height();
+};
+
+/*
+ * Allocate a node with room for height next pointers and a copy of the
+ * payload.
+ */
+template <typename K, typename V, typename C, int L>
+typename concurrent_skip_list<K, V, C, L>::node_t *
+concurrent_skip_list<K, V, C, L>::sl_new_node(K key, void *val, size_t size,
+                                              int height) {
+  size_t tower = sizeof(node_t) + height * sizeof(std::atomic<uintptr_t>);
+  node_t *node = (node_t *) pool_arena_alloc(arenas, tower + size);
+  if (!node) return NULL;
+  new (&node->state) std::atomic<int>(0);
+  for (int i = 0; i < height; i++) {
+    new (&node->next[i]) std::atomic<uintptr_t>(0);
+  }
+  node->hash = key;
+  node->payload_size = size;
+  node->height = height;
+  node->value = (char *) node + tower;
+  if (size > 0) memcpy(node->value, val, size);
+  return node;
+}
+
+/*
+ * Record in preds and succs, for every list, the last node before key and
+ * the first unmarked node not before it. Marked nodes met on the way are
+ * unlinked; if that fails because the predecessor changed under us, start
+ * over from the top. Returns true if the bottom successor matches key.
+ * Must be called inside a critical section.
+ */
+template <typename K, typename V, typename C, int L>
+bool concurrent_skip_list<K, V, C, L>::sl_find(K key, node_t **preds,
+                                               node_t **succs) {
+  C compare;
+retry:
+  node_t *prev = head;
+  for (int i = levels - 1; i >= 0; i--) {
+    node_t *pt = sl_ptr(prev->next[i].load());
+    while (pt != NULL) {
+      uintptr_t next = pt->next[i].load();
+      if (sl_marked(next)) {
+        uintptr_t expect = (uintptr_t) pt;
+        if (!prev->next[i].compare_exchange_strong(expect, next & ~1UL)) {
+          goto retry;
+        }
+        pt = sl_ptr(next);
+        continue;
+      }
+      if (0 <= compare(pt->hash, key)) break;
+      prev = pt;
+      pt = sl_ptr(next);
+    }
+    preds[i] = prev;
+    succs[i] = pt;
+  }
+  return succs[0] != NULL && 0 == compare(succs[0]->hash, key);
+}
+
+/*
+ * Node heights are drawn as in basic_skip_list, from generator state
+ * private to the calling thread and seeded from its address.
+ */
+template <typename K, typename V, typename C, int L>
+int concurrent_skip_list<K, V, C, L>::sl_height() {
+  static thread_local uint64_t state = 0;
+  if (state == 0) {
+    state = sl_rng::seed((uint64_t) (uintptr_t) &state ^
+                         (uint64_t) time(NULL));
+  }
+  return roll.height(&state, levels);
+}
+
+/*
+ * Hand node to the epoch scheme once both its inserter and its deleter are
+ * done with it; flag is the caller's part.
+ */
+template <typename K, typename V, typename C, int L>
+void concurrent_skip_list<K, V, C, L>::sl_retire(epoch_rec_t *rec,
+                                                 node_t *node, int flag) {
+  int other = (flag == CSL_INSERTED) ? CSL_UNLINKED : CSL_INSERTED;
+  if (node->state.fetch_or(flag) & other) {
+    epoch_retire(rec, node, arenas ? pool_arena_free : free);
+  }
+}
+
+template <typename K, typename V, typename C, int L>
+bool concurrent_skip_list<K, V, C, L>::sl_insert(list_ele_t *data) {
+  return sl_insert_kv(key_from_hash<K>(data->hash), data->value,
+                      data->payload_size);
+}
+
+/*
+ * Link the node into the bottom list with a single CAS, which is when it
+ * joins the set, then into the lists above one at a time, re-finding the
+ * predecessors whenever a CAS fails. Linking stops early if the node gets
+ * deleted meanwhile; since a link may then have landed after the deleter's
+ * cleanup, one more sl_find() removes it again before the node can be
+ * retired.
+ */
+template <typename K, typename V, typename C, int L>
+bool concurrent_skip_list<K, V, C, L>::sl_insert_kv(K key, void *val,
+                                                    size_t size) {
+  guard g(*this);
+  if (!g.ok()) return false;
+  node_t *preds[L], *succs[L];
+  int height = sl_height();
+  node_t *node = NULL;
+  while (true) {
+    if (sl_find(key, preds, succs)) {
+      sl_free_node(node);
+      return false;
+    }
+    if (node == NULL) {
+      node = sl_new_node(key, val, size, height);
+      if (node == NULL) return false;
+    }
+    for (int i = 0; i < height; i++) {
+      node->next[i].store((uintptr_t) succs[i]);
+    }
+    uintptr_t expect = (uintptr_t) succs[0];
+    if (preds[0]->next[0].compare_exchange_strong(expect, (uintptr_t) node)) {
+      break;
+    }
+  }
+  count.fetch_add(1, std::memory_order_relaxed);
+  for (int i = 1; i < height; i++) {
+    while (true) {
+      uintptr_t next = node->next[i].load();
+      if (sl_marked(next)) goto linked;
+      if (sl_ptr(next) != succs[i] &&
+          !node->next[i].compare_exchange_strong(next, (uintptr_t) succs[i])) {
+        goto linked;
+      }
+      uintptr_t expect = (uintptr_t) succs[i];
+      if (preds[i]->next[i].compare_exchange_strong(expect,
+                                                    (uintptr_t) node)) {
+        break;
+      }
+      sl_find(key, preds, succs);
+      if (succs[0] != node) goto linked;
+    }
+  }
+linked:
+  if (sl_marked(node->next[0].load())) sl_find(key, preds, succs);
+  sl_retire(g.rec, node, CSL_INSERTED);
+  return true;
+}
+
+template <typename K, typename V, typename C, int L>
+bool concurrent_skip_list<K, V, C, L>::sl_delete(list_ele_t *node) {
+  if (node==NULL) return false;
+  return sl_delete_key(key_from_hash<K>(node->hash));
+}
+
+/*
+ * Mark the node's links from the top down. The thread whose CAS marks the
+ * bottom link has deleted it; it then runs sl_find() once more so that the
+ * node is unlinked from every list before being retired.
+ */
+template <typename K, typename V, typename C, int L>
+bool concurrent_skip_list<K, V, C, L>::sl_delete_key(K key) {
+  guard g(*this);
+  if (!g.ok()) return false;
+  node_t *preds[L], *succs[L];
+  if (!sl_find(key, preds, succs)) return false;
+  node_t *node = succs[0];
+  for (int i = node->height - 1; i > 0; i--) {
+    uintptr_t next = node->next[i].load();
+    while (!sl_marked(next) &&
+           !node->next[i].compare_exchange_weak(next, next | 1)) {
+    }
+  }
+  uintptr_t next = node->next[0].load();
+  while (true) {
+    if (sl_marked(next)) return false;
+    if (node->next[0].compare_exchange_weak(next, next | 1)) break;
+  }
+  count.fetch_sub(1, std::memory_order_relaxed);
+  sl_find(key, preds, succs);
+  sl_retire(g.rec, node, CSL_UNLINKED);
+  return true;
+}
+
+/*
+ * Descend as sl_find() does, but step over marked nodes instead of
+ * unlinking them, so that no write and no restart is ever needed. The
+ * result is only valid while the caller holds a guard.
+ */
+template <typename K, typename V, typename C, int L>
+typename concurrent_skip_list<K, V, C, L>::node_t *
+concurrent_skip_list<K, V, C, L>::sl_search(K key) {
+  C compare;
+  guard g(*this);
+  if (!g.ok()) return NULL;
+  node_t *prev = head;
+  for (int i = levels - 1; i >= 0; i--) {
+    node_t *pt = sl_ptr(prev->next[i].load());
+    int cmp = 1;
+    while (pt != NULL) {
+      uintptr_t next = pt->next[i].load();
+      if (!sl_marked(next)) {
+        cmp = compare(pt->hash, key);
+        if (0 <= cmp) break;
+        prev = pt;
+      }
+      pt = sl_ptr(next);
+    }
+    if (pt != NULL && 0 == cmp) {
+      return sl_marked(pt->next[0].load()) ? NULL : pt;
+    }
+  }
+  return NULL;
+}
+
+template <typename K, typename V, typename C, int L>
+bool concurrent_skip_list<K, V, C, L>::sl_contains(K key) {
+  guard g(*this);
+  return g.ok() && sl_search(key) != NULL;
+}
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * This program implements epoch-based memory reclamation for the lock-free
+ * containers.
+ *
+ * See epoch.h for the protocol.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <new>
+#include <assert.h>
+#include "epoch.h"
+
+/*
+ * Thread exit: give the record up for adoption, after one last attempt at
+ * freeing what it still holds.
+ */
+static void epoch_orphan(void *arg)
+{
+  epoch_rec_t *rec = (epoch_rec_t *) arg;
+  epoch_reclaim(rec);
+  rec->in_use.store(false);
+}
+
+bool epoch_init(epoch_t *domain)
+{
+  domain->global.store(0);
+  domain->recs.store(NULL);
+  return 0 == pthread_key_create(&domain->key, epoch_orphan);
+}
+
+void epoch_destroy(epoch_t *domain)
+{
+  pthread_key_delete(domain->key);
+  epoch_rec_t *rec = domain->recs.load();
+  while (rec != NULL)
+  {
+    epoch_retired_t *r = rec->head;
+    while (r != NULL)
+    {
+      epoch_retired_t *next = r->next;
+      r->fn(r->ptr);
+      free(r);
+      r = next;
+    }
+    epoch_rec_t *next = rec->next;
+    rec->~epoch_rec_t();
+    free(rec);
+    rec = next;
+  }
+  domain->recs.store(NULL);
+}
+
+/*
+ * Adopt the record of an exited thread if there is one, else publish a new
+ * record at the front of the registry.
+ */
+epoch_rec_t *epoch_self(epoch_t *domain)
+{
+  epoch_rec_t *rec = (epoch_rec_t *) pthread_getspecific(domain->key);
+  if (rec != NULL) return rec;
+  for (rec = domain->recs.load(); rec != NULL; rec = rec->next)
+  {
+    bool free_rec = false;
+    if (!rec->in_use.load() && rec->in_use.compare_exchange_strong(free_rec,
+                                                                   true))
+      break;
+  }
+  if (rec == NULL)
+  {
+    void *mem = malloc(sizeof(epoch_rec_t));
+    if (mem == NULL) return NULL;
+    rec = new (mem) epoch_rec_t;
+    rec->epoch.store(0);
+    rec->active.store(false);
+    rec->in_use.store(true);
+    rec->nesting = 0;
+    rec->head = NULL;
+    rec->tail = NULL;
+    rec->pending = 0;
+    rec->domain = domain;
+    epoch_rec_t *first = domain->recs.load();
+    do
+    {
+      rec->next = first;
+    } while (!domain->recs.compare_exchange_weak(first, rec));
+  }
+  pthread_setspecific(domain->key, rec);
+  return rec;
+}
+
+void epoch_enter(epoch_rec_t *rec)
+{
+  if (rec->nesting++ > 0) return;
+  rec->epoch.store(rec->domain->global.load());
+  rec->active.store(true);
+  /* Re-read in case the epoch moved before we were seen as active */
+  rec->epoch.store(rec->domain->global.load());
+}
+
+void epoch_exit(epoch_rec_t *rec)
+{
+  assert(rec->nesting > 0);
+  if (--rec->nesting > 0) return;
+  rec->active.store(false);
+}
+
+bool epoch_retire(epoch_rec_t *rec, void *ptr, void (*fn)(void *ptr))
+{
+  epoch_retired_t *r = (epoch_retired_t *) malloc(sizeof(epoch_retired_t));
+  if (r == NULL) return false;
+  r->ptr = ptr;
+  r->fn = fn;
+  r->epoch = rec->domain->global.load();
+  r->next = NULL;
+  if (rec->tail != NULL) rec->tail->next = r;
+  else rec->head = r;
+  rec->tail = r;
+  if (++rec->pending % EPOCH_BATCH == 0) epoch_reclaim(rec);
+  return true;
+}
+
+/*
+ * The epoch may move from e to e + 1 once no active thread is still in an
+ * older one. Retired lists are in epoch order, so freeing stops at the
+ * first node retired less than two epochs ago.
+ */
+void epoch_reclaim(epoch_rec_t *rec)
+{
+  epoch_t *domain = rec->domain;
+  unsigned long e = domain->global.load();
+  bool behind = false;
+  for (epoch_rec_t *r = domain->recs.load(); r != NULL; r = r->next)
+  {
+    if (r->active.load() && r->epoch.load() != e)
+    {
+      behind = true;
+      break;
+    }
+  }
+  if (!behind) domain->global.compare_exchange_strong(e, e + 1);
+  unsigned long now = domain->global.load();
+  while (rec->head != NULL && rec->head->epoch + 2 <= now)
+  {
+    epoch_retired_t *r = rec->head;
+    rec->head = r->next;
+    r->fn(r->ptr);
+    free(r);
+    rec->pending--;
+  }
+  if (rec->head == NULL) rec->tail = NULL;
+}
+
+static void count_free(void *ptr)
+{
+  (*(int *) ptr)++;
+}
+
+void test_epoch() {
+  epoch_t domain;
+  assert(epoch_init(&domain));
+  epoch_rec_t *rec = epoch_self(&domain);
+  assert(rec != NULL && epoch_self(&domain) == rec);
+  int freed = 0;
+  epoch_enter(rec);
+  epoch_enter(rec);
+  epoch_exit(rec);
+  assert(rec->active.load());
+  assert(epoch_retire(rec, &freed, count_free));
+  epoch_reclaim(rec);
+  assert(freed == 0);  // retired in the current epoch
+  epoch_exit(rec);
+  epoch_reclaim(rec);
+  epoch_reclaim(rec);
+  assert(freed == 1);
+  assert(epoch_retire(rec, &freed, count_free));
+  epoch_destroy(&domain);
+  assert(freed == 2);
+}
@@ -0,0 +1,94 @@
+/*
+ * This program implements epoch-based memory reclamation for the lock-free
+ * containers.
+ *
+ * Threads bracket every access to shared nodes with epoch_enter() and
+ * epoch_exit(). A node that has been unlinked, so that no new reference to
+ * it can be obtained, is handed to epoch_retire(), and is only freed once
+ * the global epoch has moved two steps past the one it was retired in. The
+ * global epoch only moves when every thread inside a critical section has
+ * observed the current one, so by then nobody can still hold a reference.
+ *
+ * Each thread gets one record per domain on first use, found again through
+ * a pthread key. Records of exited threads are recycled.
+ */
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <atomic>
+
+#define EPOCH_BATCH 64 // retired nodes per thread before trying to reclaim
+
+/************** Data structure declarations ****************/
+
+typedef struct RETIRED {
+    void *ptr;
+    void (*fn)(void *ptr);
+    unsigned long epoch;   /* Global epoch when retired */
+    struct RETIRED *next;
+} epoch_retired_t;
+
+struct EPOCH;
+
+/* Per-thread record */
+typedef struct EPOCH_REC {
+    std::atomic<unsigned long> epoch;  /* Epoch observed on entry */
+    std::atomic<bool> active;          /* Inside a critical section */
+    std::atomic<bool> in_use;          /* Owned by a live thread */
+    int nesting;
+    epoch_retired_t *head;             /* Oldest retired node */
+    epoch_retired_t *tail;
+    size_t pending;
+    struct EPOCH *domain;
+    struct EPOCH_REC *next;            /* Registry link, never changes */
+} epoch_rec_t;
+
+typedef struct EPOCH {
+    std::atomic<unsigned long> global;
+    std::atomic<epoch_rec_t *> recs;   /* Every record ever registered */
+    pthread_key_t key;
+} epoch_t;
+
+/************** Operations on epoch ************************/
+
+/*
+  Initialize a reclamation domain.
+  Return false if could not allocate a thread key.
+*/
+bool epoch_init(epoch_t *domain);
+
+/*
+  Free every retired node and every record. No thread may be inside a
+  critical section or use the domain again.
+*/
+void epoch_destroy(epoch_t *domain);
+
+/*
+  Return the calling thread's record in domain, registering one first if
+  needed. Return NULL if could not allocate space.
+*/
+epoch_rec_t *epoch_self(epoch_t *domain);
+
+/*
+  Enter or leave a critical section. Sections nest.
+*/
+void epoch_enter(epoch_rec_t *rec);
+void epoch_exit(epoch_rec_t *rec);
+
+/*
+  Free ptr with fn once no critical section can still reference it.
+  Every EPOCH_BATCH calls, try to advance the epoch and reclaim.
+  Return false if could not allocate space; ptr is then leaked, not freed.
+*/
+bool epoch_retire(epoch_rec_t *rec, void *ptr, void (*fn)(void *ptr));
+
+/*
+  Try to advance the global epoch, then free whatever rec has retired that
+  is now safe to free.
+*/
+void epoch_reclaim(epoch_rec_t *rec);
+
+#endif
@@ -1,5 +1,16 @@
 extern void test_q();
 extern void test_sl();
+extern void test_pool();
+extern void test_epoch();
+extern void test_csl();
+extern void test_lfq();
+extern void test_cq();
+extern void test_simd();
+extern void test_snap();
+extern void test_shard();
+extern void test_lru();
+extern void test_bq();
+extern void test_bskip();
 
 int sl_compare(void *h1, void *h2) {
   if (h1 == h2) {
@@ -14,6 +25,18 @@ int sl_compare(void *h1, void *h2) {
 }
 
 int main() {
+  test_pool();
+  test_q();
   test_sl();
+  test_epoch();
+  test_csl();
+  test_lfq();
+  test_simd();
+  test_cq();
+  test_snap();
+  test_shard();
+  test_lru();
+  test_bq();
+  test_bskip();
   return 0;
 }
@@ -0,0 +1,386 @@
+/*
+ * This program implements lock-free FIFO queues of packed elements.
+ *
+ * See lfq.h for the two modes.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <assert.h>
+#include <pthread.h>
+#include <limits.h>
+#include "lfq.h"
+
+/*
+ * Only MPMC queues retire anything, so only they take an epoch domain and
+ * with it one of the process' limited pthread keys.
+ */
+static lfq_t *lfq_alloc(list_ele_t **ring)
+{
+  void *mem = NULL;
+  if (0 != posix_memalign(&mem, LFQ_LINE, sizeof(lfq_t))) return NULL;
+  lfq_t *q = new (mem) lfq_t();
+  q->head.store(NULL);
+  q->tail.store(NULL);
+  q->in.nodes.store(0);
+  q->in.size.store(0);
+  q->out.nodes.store(0);
+  q->out.size.store(0);
+  q->ring = ring;
+  q->mask = 0;
+  q->put.store(0);
+  q->get.store(0);
+  q->get_seen = 0;
+  q->put_seen = 0;
+  if (ring == NULL && !epoch_init(&q->domain))
+  {
+    q->~lfq_t();
+    free(q);
+    return NULL;
+  }
+  return q;
+}
+
+static void lfq_release(lfq_t *q)
+{
+  if (q->ring == NULL) epoch_destroy(&q->domain);
+  free(q->ring);
+  q->~lfq_t();
+  free(q);
+}
+
+static lfq_cell_t *cell_new(list_ele_t *ele)
+{
+  lfq_cell_t *cell = (lfq_cell_t *) malloc(sizeof(lfq_cell_t));
+  if (cell == NULL) return NULL;
+  new (&cell->next) std::atomic<lfq_cell_t *>(NULL);
+  cell->ele = ele;
+  return cell;
+}
+
+lfq_t *lfq_new()
+{
+  lfq_t *q = lfq_alloc(NULL);
+  if (q == NULL) return NULL;
+  lfq_cell_t *dummy = cell_new(NULL);
+  if (dummy == NULL)
+  {
+    lfq_release(q);
+    return NULL;
+  }
+  q->head.store(dummy);
+  q->tail.store(dummy);
+  return q;
+}
+
+lfq_t *lfq_new_spsc(size_t cap)
+{
+  if (cap == 0 || cap > ((size_t) 1 << 62)) return NULL;
+  size_t size = 1;
+  while (size < cap) size <<= 1;
+  list_ele_t **ring = (list_ele_t **) malloc(size * sizeof(list_ele_t *));
+  if (ring == NULL) return NULL;
+  lfq_t *q = lfq_alloc(ring);
+  if (q == NULL)
+  {
+    free(ring);
+    return NULL;
+  }
+  q->mask = size - 1;
+  return q;
+}
+
+void lfq_free(lfq_t *q)
+{
+  if (q==NULL) return;
+  list_ele_t *ele;
+  while ((ele = lfq_remove_head(q)) != NULL)
+  {
+    unpack(NULL, ele);
+  }
+  free(q->head.load());
+  lfq_release(q);
+}
+
+static void lfq_count(lfq_count_t *c, size_t bytes)
+{
+  c->nodes.fetch_add(1, std::memory_order_relaxed);
+  c->size.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+/*
+ * The producer only rereads get, the consumer's cache line, when its own
+ * copy says the ring is full.
+ */
+static bool spsc_put(lfq_t *q, list_ele_t *ele)
+{
+  size_t put = q->put.load(std::memory_order_relaxed);
+  if (put - q->get_seen > q->mask)
+  {
+    q->get_seen = q->get.load(std::memory_order_acquire);
+    if (put - q->get_seen > q->mask) return false;
+  }
+  q->ring[put & q->mask] = ele;
+  q->put.store(put + 1, std::memory_order_release);
+  return true;
+}
+
+static list_ele_t *spsc_get(lfq_t *q)
+{
+  size_t get = q->get.load(std::memory_order_relaxed);
+  if (get == q->put_seen)
+  {
+    q->put_seen = q->put.load(std::memory_order_acquire);
+    if (get == q->put_seen) return NULL;
+  }
+  list_ele_t *ele = q->ring[get & q->mask];
+  q->get.store(get + 1, std::memory_order_release);
+  return ele;
+}
+
+/*
+ * Link a new cell behind the last one, then swing tail to it. A tail that
+ * lags behind the chain is first helped forward, so that no producer
+ * waits on another one that stalled between its two steps.
+ */
+bool lfq_insert_tail(lfq_t *q, list_ele_t *ele)
+{
+  if (q==NULL || ele==NULL) return false;
+  /* ele may be consumed and freed as soon as it is published */
+  size_t bytes = ele->payload_size;
+  if (q->ring != NULL)
+  {
+    if (!spsc_put(q, ele)) return false;
+    lfq_count(&q->in, bytes);
+    return true;
+  }
+  lfq_cell_t *cell = cell_new(ele);
+  if (cell == NULL) return false;
+  epoch_rec_t *rec = epoch_self(&q->domain);
+  if (rec == NULL)
+  {
+    free(cell);
+    return false;
+  }
+  /* Count first, so that lfq_nodes() never sees more removals than inserts */
+  lfq_count(&q->in, bytes);
+  epoch_enter(rec);
+  while (true)
+  {
+    lfq_cell_t *tail = q->tail.load();
+    lfq_cell_t *next = tail->next.load();
+    if (tail != q->tail.load()) continue;
+    if (next != NULL)
+    {
+      q->tail.compare_exchange_weak(tail, next);
+      continue;
+    }
+    if (tail->next.compare_exchange_weak(next, cell))
+    {
+      q->tail.compare_exchange_strong(tail, cell);
+      break;
+    }
+  }
+  epoch_exit(rec);
+  return true;
+}
+
+/*
+ * The element travels in the cell after the dummy; once head has been
+ * swung to that cell it becomes the new dummy and the old one is retired.
+ */
+list_ele_t *lfq_remove_head(lfq_t *q)
+{
+  if (q==NULL) return NULL;
+  list_ele_t *ele = NULL;
+  if (q->ring != NULL)
+  {
+    ele = spsc_get(q);
+    if (ele != NULL) lfq_count(&q->out, ele->payload_size);
+    return ele;
+  }
+  epoch_rec_t *rec = epoch_self(&q->domain);
+  if (rec == NULL) return NULL;
+  epoch_enter(rec);
+  while (true)
+  {
+    lfq_cell_t *head = q->head.load();
+    lfq_cell_t *tail = q->tail.load();
+    lfq_cell_t *next = head->next.load();
+    if (head != q->head.load()) continue;
+    if (next == NULL) break;
+    if (head == tail)
+    {
+      q->tail.compare_exchange_weak(tail, next);
+      continue;
+    }
+    list_ele_t *taken = next->ele;  // ours only once the swing succeeds
+    if (q->head.compare_exchange_weak(head, next))
+    {
+      ele = taken;
+      epoch_retire(rec, head, free);
+      break;
+    }
+  }
+  epoch_exit(rec);
+  if (ele != NULL) lfq_count(&q->out, ele->payload_size);
+  return ele;
+}
+
+int lfq_nodes(lfq_t *q)
+{
+  if (q==NULL) return 0;
+  size_t out = q->out.nodes.load(std::memory_order_relaxed);
+  size_t in = q->in.nodes.load(std::memory_order_relaxed);
+  return (in > out) ? (int) (in - out) : 0;
+}
+
+size_t lfq_size(lfq_t *q)
+{
+  if (q==NULL) return 0;
+  size_t out = q->out.size.load(std::memory_order_relaxed);
+  size_t in = q->in.size.load(std::memory_order_relaxed);
+  return (in > out) ? in - out : 0;
+}
+
+#define LFQ_THREADS 4
+#define LFQ_PER_THREAD 20000
+
+typedef struct {
+    lfq_t *q;
+    int id;
+    long sum;    /* Sum of hashes seen by a consumer */
+    int taken;
+    std::atomic<int> *left;  /* Elements not yet consumed */
+} lfq_arg_t;
+
+static void *lfq_producer(void *p)
+{
+  lfq_arg_t *arg = (lfq_arg_t *) p;
+  for (int i = 0; i < LFQ_PER_THREAD; i++)
+  {
+    intptr_t h = (intptr_t) arg->id * LFQ_PER_THREAD + i;
+    list_ele_t *ele = pack(&i, sizeof(i), (void *) h);
+    assert(ele != NULL);
+    while (!lfq_insert_tail(arg->q, ele))
+    {
+      /* Only a full ring refuses */
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Elements of one producer must come out in the order it put them in.
+ */
+static void *lfq_consumer(void *p)
+{
+  lfq_arg_t *arg = (lfq_arg_t *) p;
+  int seen[LFQ_THREADS];
+  for (int t = 0; t < LFQ_THREADS; t++) seen[t] = -1;
+  while (arg->left->load() > 0)
+  {
+    list_ele_t *ele = lfq_remove_head(arg->q);
+    if (ele == NULL) continue;
+    intptr_t h = (intptr_t) ele->hash;
+    int from = h / LFQ_PER_THREAD;
+    int i = *(int *) ele->value;
+    assert(i == h % LFQ_PER_THREAD && i > seen[from]);
+    seen[from] = i;
+    arg->sum += h;
+    arg->taken++;
+    arg->left->fetch_sub(1);
+    unpack(NULL, ele);
+  }
+  return NULL;
+}
+
+/*
+ * Run producers and consumers against q; an SPSC ring gets one of each.
+ */
+static void lfq_run(lfq_t *q, int threads)
+{
+  std::atomic<int> left(threads * LFQ_PER_THREAD);
+  pthread_t prod[LFQ_THREADS], cons[LFQ_THREADS];
+  lfq_arg_t args[2 * LFQ_THREADS];
+  for (int t = 0; t < 2 * threads; t++)
+  {
+    args[t].q = q;
+    args[t].id = t % threads;
+    args[t].sum = 0;
+    args[t].taken = 0;
+    args[t].left = &left;
+  }
+  for (int t = 0; t < threads; t++)
+  {
+    assert(0 == pthread_create(&prod[t], NULL, lfq_producer, &args[t]));
+    assert(0 == pthread_create(&cons[t], NULL, lfq_consumer,
+                               &args[threads + t]));
+  }
+  long sum = 0;
+  int taken = 0;
+  for (int t = 0; t < threads; t++)
+  {
+    pthread_join(prod[t], NULL);
+    pthread_join(cons[t], NULL);
+    sum += args[threads + t].sum;
+    taken += args[threads + t].taken;
+  }
+  long n = (long) threads * LFQ_PER_THREAD;
+  assert(taken == n && sum == n * (n - 1) / 2);
+  assert(lfq_nodes(q) == 0 && lfq_size(q) == 0);
+}
+
+void test_lfq() {
+  lfq_t *q = lfq_new();
+  assert(q && lfq_remove_head(q) == NULL);
+  assert(!lfq_insert_tail(q, NULL) && !lfq_insert_tail(NULL, NULL));
+  for (intptr_t i = 0; i < 10; i++)
+  {
+    assert(lfq_insert_tail(q, pack(&i, sizeof(i), (void *) i)));
+  }
+  assert(lfq_nodes(q) == 10 && lfq_size(q) == 10 * sizeof(intptr_t));
+  for (intptr_t i = 0; i < 5; i++)
+  {
+    list_ele_t *ele = lfq_remove_head(q);
+    assert(ele && ele->hash == (void *) i);
+    unpack(NULL, ele);
+  }
+  assert(lfq_nodes(q) == 5);
+  lfq_free(q);  // frees the other five
+
+  q = lfq_new_spsc(3);
+  assert(q && q->mask == 3 && lfq_new_spsc(0) == NULL);
+  list_ele_t *eles[5];
+  for (intptr_t i = 0; i < 5; i++)
+  {
+    eles[i] = pack(&i, sizeof(i), (void *) i);
+  }
+  for (int i = 0; i < 4; i++) assert(lfq_insert_tail(q, eles[i]));
+  assert(!lfq_insert_tail(q, eles[4]) && lfq_nodes(q) == 4);
+  assert(lfq_remove_head(q) == eles[0]);
+  assert(lfq_insert_tail(q, eles[4]));
+  unpack(NULL, eles[0]);
+  lfq_free(q);
+
+  // Rings take no pthread key, so more of them than keys can coexist
+  const int rings = 2 * PTHREAD_KEYS_MAX;
+  lfq_t **many = (lfq_t **) malloc(rings * sizeof(lfq_t *));
+  for (int i = 0; i < rings; i++)
+  {
+    many[i] = lfq_new_spsc(1);
+    assert(many[i] != NULL);
+  }
+  for (int i = 0; i < rings; i++) lfq_free(many[i]);
+  free(many);
+
+  q = lfq_new();
+  lfq_run(q, LFQ_THREADS);
+  lfq_free(q);
+  q = lfq_new_spsc(64);
+  lfq_run(q, 1);
+  lfq_free(q);
+}
@@ -0,0 +1,100 @@
+/*
+ * This program implements lock-free FIFO queues of packed elements, for
+ * handing work between threads without an external lock.
+ *
+ * Two modes share the lfq_t handle:
+ * -lfq_new() makes an unbounded multi-producer multi-consumer queue after
+ *   Michael & Scott. Elements are chained through small link cells rather
+ *   than through list_ele_t.next, since the cell at the front of the chain
+ *   is a dummy that stays in the queue after its element was handed out.
+ *   Dequeued cells are freed through epoch reclamation (epoch.h).
+ * -lfq_new_spsc() makes a bounded ring for exactly one producer thread and
+ *   one consumer thread, which needs no atomic read-modify-write at all,
+ *   and no epoch domain since it frees nothing while in use.
+ *
+ * Elements come from pack() and are owned by the consumer once removed.
+ * Counters are split so that producers and consumers never write the same
+ * cache line; lfq_nodes() and lfq_size() are exact only when quiescent.
+ */
+#ifndef LFQ_H
+#define LFQ_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <atomic>
+#include "q.h"
+#include "epoch.h"
+
+#define LFQ_LINE 64 // assumed cache line size
+
+/************** Data structure declarations ****************/
+
+/* Link cell of an MPMC queue */
+typedef struct LFQ_CELL {
+    std::atomic<struct LFQ_CELL *> next;
+    list_ele_t *ele;
+} lfq_cell_t;
+
+/* Latest totals, written by one side only */
+typedef struct {
+    std::atomic<size_t> nodes;
+    std::atomic<size_t> size;
+} lfq_count_t;
+
+typedef struct {
+    alignas(LFQ_LINE) std::atomic<lfq_cell_t *> head;  /* Dummy cell */
+    alignas(LFQ_LINE) std::atomic<lfq_cell_t *> tail;
+    alignas(LFQ_LINE) lfq_count_t in;    /* Bumped by producers */
+    alignas(LFQ_LINE) lfq_count_t out;   /* Bumped by consumers */
+    /* SPSC ring, NULL for MPMC */
+    list_ele_t **ring;
+    size_t mask;                         /* Capacity - 1 */
+    alignas(LFQ_LINE) std::atomic<size_t> put;  /* Next slot to fill */
+    size_t get_seen;                     /* Producer's copy of get */
+    alignas(LFQ_LINE) std::atomic<size_t> get;  /* Next slot to drain */
+    size_t put_seen;                     /* Consumer's copy of put */
+    alignas(LFQ_LINE) epoch_t domain;    /* MPMC only */
+} lfq_t;
+
+/************** Operations on lfq **************************/
+
+/*
+  Create empty MPMC queue.
+  Return NULL if could not allocate space.
+*/
+lfq_t *lfq_new();
+
+/*
+  Create empty SPSC ring holding up to cap elements, rounded up to a power
+  of two. Return NULL if cap is 0 or could not allocate space.
+*/
+lfq_t *lfq_new_spsc(size_t cap);
+
+/*
+  Free the queue and every element still in it. No thread may be using it.
+  No effect if q is NULL
+*/
+void lfq_free(lfq_t *q);
+
+/*
+  Append ele. Safe from any number of threads (one, for SPSC queues).
+  Return false if q or ele is NULL, a ring is full, or could not allocate
+  space.
+*/
+bool lfq_insert_tail(lfq_t *q, list_ele_t *ele);
+
+/*
+  Detach and return the oldest element, which the caller then owns.
+  Safe from any number of threads (one, for SPSC queues).
+  Return NULL if q is NULL or empty.
+*/
+list_ele_t *lfq_remove_head(lfq_t *q);
+
+/*
+  Approximate number of elements and payload bytes in queue.
+  Return 0 if q is NULL
+*/
+int lfq_nodes(lfq_t *q);
+size_t lfq_size(lfq_t *q);
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ * This program implements a least-recently-used cache.
+ *
+ * See lru.h for the layout.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "lru.h"
+
+lru_cache_t *lru_new(size_t max_bytes, int max_entries,
+                     uint64_t (*hash_fn)(void *hash),
+                     bool (*hash_compare)(void *h1, void *h2))
+{
+  lru_cache_t *c = (lru_cache_t *) malloc(sizeof(lru_cache_t));
+  if (c==NULL) return NULL;
+  c->q = q_new_flags(Q_POOLED | Q_DOUBLY);
+  if (c->q==NULL || !q_index(c->q, hash_fn))
+  {
+    q_free(c->q);
+    free(c);
+    return NULL;
+  }
+  c->max_bytes = max_bytes;
+  c->max_entries = max_entries;
+  c->hash_compare = hash_compare ? hash_compare : ::hash_compare;
+  c->on_evict = NULL;
+  c->evict_arg = NULL;
+  memset(&c->counts, 0, sizeof(c->counts));
+  return c;
+}
+
+void lru_free(lru_cache_t *c)
+{
+  if (c==NULL) return;
+  q_free(c->q);
+  free(c);
+}
+
+void lru_on_evict(lru_cache_t *c, lru_evict_fn fn, void *arg)
+{
+  if (c==NULL) return;
+  c->on_evict = fn;
+  c->evict_arg = arg;
+}
+
+list_ele_t *lru_peek(lru_cache_t *c, void *hash)
+{
+  if (c==NULL) return NULL;
+  return q_search(c->q, hash, c->hash_compare);
+}
+
+list_ele_t *lru_get(lru_cache_t *c, void *hash)
+{
+  list_ele_t *ele = lru_peek(c, hash);
+  if (ele==NULL)
+  {
+    if (c!=NULL) c->counts.misses++;
+    return NULL;
+  }
+  c->counts.hits++;
+  q_shuffle(c->q, ele);
+  return ele;
+}
+
+bool lru_touch(lru_cache_t *c, void *hash)
+{
+  list_ele_t *ele = lru_peek(c, hash);
+  if (ele==NULL) return false;
+  q_shuffle(c->q, ele);
+  return true;
+}
+
+bool lru_erase(lru_cache_t *c, void *hash)
+{
+  list_ele_t *ele = lru_peek(c, hash);
+  if (ele==NULL) return false;
+  q_unlink(c->q, ele);
+  q_release(c->q, ele);
+  return true;
+}
+
+bool lru_evict(lru_cache_t *c)
+{
+  if (c==NULL || c->q->head==NULL) return false;
+  list_ele_t *ele = c->q->head;
+  if (c->on_evict!=NULL)
+    c->on_evict(c->evict_arg, ele->hash, ele->value, ele->payload_size);
+  c->counts.evictions++;
+  return q_remove_head(c->q, true);
+}
+
+/*
+ * Evict until the cache is back within budget.
+ */
+static void lru_make_room(lru_cache_t *c)
+{
+  while (c->q->head!=NULL &&
+         ((c->max_entries > 0 && c->q->nodes > c->max_entries) ||
+          (c->max_bytes > 0 && c->q->size > c->max_bytes)))
+    lru_evict(c);
+}
+
+/*
+ * The new element is packed and linked in, growing the index if need be,
+ * before anything is dropped, so that running out of memory leaves the
+ * cache as it was. A replaced payload does not count against the budget
+ * of its replacement.
+ */
+bool lru_put(lru_cache_t *c, void *val, size_t size, void *hash)
+{
+  if (c==NULL || hash==NULL) return false;
+  if (c->max_bytes > 0 && size > c->max_bytes) return false;
+  list_ele_t *ele = q_pack(c->q, val, size, hash);
+  if (ele==NULL) return false;
+  list_ele_t *old = lru_peek(c, hash);
+  if (!q_insert_tail(c->q, ele))
+  {
+    q_release(c->q, ele);
+    return false;
+  }
+  if (old!=NULL)
+  {
+    q_unlink(c->q, old);
+    q_release(c->q, old);
+    c->counts.updates++;
+  }
+  else c->counts.inserts++;
+  lru_make_room(c);
+  return true;
+}
+
+void lru_resize(lru_cache_t *c, size_t max_bytes, int max_entries)
+{
+  if (c==NULL) return;
+  c->max_bytes = max_bytes;
+  c->max_entries = max_entries;
+  lru_make_room(c);
+}
+
+int lru_entries(lru_cache_t *c)
+{
+  if (c==NULL) return 0;
+  return q_nodes(c->q);
+}
+
+size_t lru_bytes(lru_cache_t *c)
+{
+  if (c==NULL) return 0;
+  return q_size(c->q);
+}
+
+typedef struct {
+    int calls;
+    intptr_t last;
+    size_t bytes;
+} evict_log_t;
+
+static void log_evict(void *arg, void *hash, void *, size_t size) {
+  evict_log_t *log = (evict_log_t *) arg;
+  log->calls++;
+  log->last = (intptr_t) hash;
+  log->bytes += size;
+}
+
+void test_lru() {
+  char val[64] = "cached payload";
+  // Entry budget: 1..4 fit, touching 1 makes 2 the next victim
+  lru_cache_t *c = lru_new(0, 4, NULL, NULL);
+  evict_log_t log = {0, 0, 0};
+  lru_on_evict(c, log_evict, &log);
+  assert(c && !lru_put(c, val, 8, NULL) && !lru_get(c, (void *) 1));
+  for (intptr_t k = 1; k <= 4; k++) {
+    assert(lru_put(c, val, 8, (void *) k));
+  }
+  list_ele_t *hit = lru_get(c, (void *) 1);
+  assert(hit && 0 == memcmp(hit->value, "cached p", 8));
+  assert(lru_put(c, val, 8, (void *) 5));
+  assert(log.calls == 1 && log.last == 2 && !lru_peek(c, (void *) 2));
+  assert(lru_touch(c, (void *) 3) && !lru_touch(c, (void *) 2));
+  assert(lru_put(c, val, 8, (void *) 6) && log.last == 4);
+  assert(lru_entries(c) == 4 && lru_bytes(c) == 32);
+  // Replacing keeps the entry count and makes it most recent
+  assert(lru_put(c, val, 20, (void *) 1) && lru_entries(c) == 4);
+  assert(lru_bytes(c) == 44 && c->q->tail->hash == (void *) 1);
+  assert(lru_erase(c, (void *) 5) && !lru_erase(c, (void *) 5));
+  assert(log.calls == 2 && lru_entries(c) == 3);
+  assert(c->counts.hits == 1 && c->counts.misses == 1);
+  assert(c->counts.inserts == 6 && c->counts.updates == 1);
+  assert(c->counts.evictions == 2);
+  lru_resize(c, 0, 1);
+  assert(lru_entries(c) == 1 && c->q->head->hash == (void *) 1);
+  assert(log.calls == 4 && c->q->index->used == 1);
+  lru_free(c);
+
+  // Byte budget: payloads are evicted oldest first until the new one fits
+  c = lru_new(100, 0, NULL, NULL);
+  log.calls = 0;
+  log.bytes = 0;
+  lru_on_evict(c, log_evict, &log);
+  assert(!lru_put(c, val, 101, (void *) 1));
+  for (intptr_t k = 1; k <= 10; k++) {
+    assert(lru_put(c, val, 10, (void *) k));
+  }
+  assert(lru_bytes(c) == 100 && log.calls == 0);
+  assert(lru_put(c, val, 35, (void *) 11));
+  assert(log.calls == 4 && log.bytes == 40 && log.last == 4);
+  assert(lru_bytes(c) == 95 && lru_entries(c) == 7);
+  assert(lru_evict(c) && log.last == 5 && lru_entries(c) == 6);
+
+  // Steady state churn reuses pool nodes instead of allocating
+  size_t bytes = c->q->pool->bytes;
+  for (intptr_t k = 0; k < 10000; k++) {
+    intptr_t key = 100 + (k * 7919) % 50;
+    if (!lru_get(c, (void *) key)) assert(lru_put(c, val, 10, (void *) key));
+  }
+  assert(c->q->pool->bytes == bytes && lru_bytes(c) <= 100);
+  assert(c->counts.hits + c->counts.misses == 10000);
+  lru_free(c);
+  lru_free(NULL);
+}
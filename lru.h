@@ -0,0 +1,120 @@
+/*
+ * This program implements a least-recently-used cache with a budget in
+ * payload bytes and/or entries.
+ *
+ * Entries live in a Q_POOLED | Q_DOUBLY queue with a hash index, ordered
+ * from least recently used at the head to most recently used at the tail,
+ * so that a lookup is an index probe, a touch is a constant-time
+ * q_shuffle(), and an eviction is a q_remove_head() whose node goes back
+ * to the queue's pool. Every operation is expected O(1).
+ *
+ * Keys are hash fields, which must not be NULL, compared with the
+ * callbacks given at creation as for q_search() and q_index().
+ */
+#ifndef LRU_H
+#define LRU_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "q.h"
+
+/************** Data structure declarations ****************/
+
+/*
+ * Called with an entry about to be evicted to make room, before its node
+ * is released.
+ */
+typedef void (*lru_evict_fn)(void *arg, void *hash, void *val, size_t size);
+
+typedef struct {
+    uint64_t hits;       /* lru_get() calls that found their key */
+    uint64_t misses;
+    uint64_t inserts;    /* lru_put() calls that added a new key */
+    uint64_t updates;    /* lru_put() calls that replaced a payload */
+    uint64_t evictions;
+} lru_counts_t;
+
+typedef struct {
+    queue_t *q;
+    size_t max_bytes;    /* Payload byte budget, 0 for none */
+    int max_entries;     /* Entry budget, 0 for none */
+    bool (*hash_compare)(void *h1, void *h2);
+    lru_evict_fn on_evict;
+    void *evict_arg;
+    lru_counts_t counts;
+} lru_cache_t;
+
+/************** Operations on cache ************************/
+
+/*
+  Create an empty cache holding at most max_bytes of payload and at most
+  max_entries entries (0 for no limit on either). hash_fn and
+  hash_compare are as for q_index() and q_search(); NULL picks q_hash_int
+  and hash_compare().
+  Return NULL if could not allocate space.
+ */
+lru_cache_t *lru_new(size_t max_bytes, int max_entries,
+                     uint64_t (*hash_fn)(void *hash),
+                     bool (*hash_compare)(void *h1, void *h2));
+
+/*
+  Free the cache and every entry, without calling the eviction callback.
+  No effect if c is NULL
+ */
+void lru_free(lru_cache_t *c);
+
+/*
+  Call fn(arg, ...) for every entry evicted from now on; NULL for none.
+ */
+void lru_on_evict(lru_cache_t *c, lru_evict_fn fn, void *arg);
+
+/*
+  Look up hash and make it the most recently used entry.
+  Return its element, valid until the entry is replaced or removed, or
+  NULL on a miss.
+ */
+list_ele_t *lru_get(lru_cache_t *c, void *hash);
+
+/*
+  As lru_get(), but leave the order and the counters alone.
+ */
+list_ele_t *lru_peek(lru_cache_t *c, void *hash);
+
+/*
+  Store a copy of size bytes of val under hash as the most recently used
+  entry, replacing any previous payload, and evict least recently used
+  entries until the cache is back within budget.
+  Return false, leaving the cache unchanged, if c is NULL, hash is NULL,
+  the entry alone exceeds the byte budget or could not allocate space.
+ */
+bool lru_put(lru_cache_t *c, void *val, size_t size, void *hash);
+
+/*
+  Make hash the most recently used entry.
+  Return false if it is not cached.
+ */
+bool lru_touch(lru_cache_t *c, void *hash);
+
+/*
+  Remove hash without counting it as an eviction or calling back.
+  Return false if it is not cached.
+ */
+bool lru_erase(lru_cache_t *c, void *hash);
+
+/*
+  Evict the least recently used entry.
+  Return false if c is NULL or empty.
+ */
+bool lru_evict(lru_cache_t *c);
+
+/*
+  Change the budget, evicting as needed to meet it.
+ */
+void lru_resize(lru_cache_t *c, size_t max_bytes, int max_entries);
+
+int lru_entries(lru_cache_t *c);
+
+size_t lru_bytes(lru_cache_t *c);
+
+#endif
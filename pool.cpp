@@ -0,0 +1,619 @@
+/*
+ * This program implements a slab allocator for the nodes and payloads
+ * handed out by pack().
+ *
+ * See pool.h for the allocation model.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <atomic>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+#include "pool.h"
+
+/*
+ * Map a request size onto its size class, or -1 if it is too large to be
+ * served from a slab.
+ */
+static int pool_class(size_t size)
+{
+  if (size > POOL_MAX_SIZE) return -1;
+  if (size <= ((size_t) 1 << POOL_MIN_SHIFT)) return 0;
+  int bits = 64 - __builtin_clzll((unsigned long long) (size - 1));
+  return bits - POOL_MIN_SHIFT;
+}
+
+static void slab_link(pool_slab_t **list, pool_slab_t *slab)
+{
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL) (*list)->prev = slab;
+  *list = slab;
+}
+
+static void slab_unlink(pool_slab_t **list, pool_slab_t *slab)
+{
+  if (slab->prev != NULL) slab->prev->next = slab->next;
+  else *list = slab->next;
+  if (slab->next != NULL) slab->next->prev = slab->prev;
+}
+
+#ifdef __linux__
+/*
+ * Mask of the online nodes among the first 64, read once from sysfs
+ * ("0-3,5" style lists). Without sysfs, node 0 is taken to be the only one.
+ */
+static unsigned long numa_online()
+{
+  static std::atomic<unsigned long> online(0);
+  unsigned long mask = online.load(std::memory_order_relaxed);
+  if (mask != 0) return mask;
+  FILE *f = fopen("/sys/devices/system/node/online", "r");
+  int lo, hi;
+  while (f != NULL && fscanf(f, "%d", &lo) == 1)
+  {
+    hi = lo;
+    int c = fgetc(f);
+    if (c == '-')
+    {
+      if (fscanf(f, "%d", &hi) != 1) break;
+      c = fgetc(f);
+    }
+    for (int n = lo < 0 ? 0 : lo; n <= hi && n < 64; n++) mask |= 1UL << n;
+    if (c != ',') break;
+  }
+  if (f != NULL) fclose(f);
+  if (mask == 0) mask = 1;
+  online.store(mask, std::memory_order_relaxed);
+  return mask;
+}
+#endif
+
+/*
+ * Apply pool's policy to a fresh mapping, returning false if it could not
+ * be (no NUMA support, a node that is not online); the pages are then left
+ * to the default policy.
+ */
+static bool slab_place(const pool_t *pool, void *addr, size_t bytes)
+{
+#ifdef __linux__
+  unsigned long mask;
+  int mode;
+  switch (pool->numa)
+  {
+  case POOL_NUMA_LOCAL:
+  case POOL_NUMA_BIND:
+    if (pool->node < 0 || pool->node >= 64) return false;
+    mode = (pool->numa == POOL_NUMA_LOCAL) ? MPOL_PREFERRED : MPOL_BIND;
+    mask = 1UL << pool->node;
+    break;
+  case POOL_NUMA_INTERLEAVE:
+    mode = MPOL_INTERLEAVE;
+    mask = numa_online();
+    break;
+  default:
+    return true;
+  }
+  // The kernel counts maxnode one past the last bit it reads
+  return 0 == syscall(SYS_mbind, addr, bytes, mode, &mask,
+                      8 * sizeof(mask) + 1, 0);
+#else
+  (void) addr;
+  (void) bytes;
+  return pool->numa == POOL_NUMA_NONE;
+#endif
+}
+
+/*
+ * Obtain bytes for a slab or an oversized block. Pools with a placement
+ * policy, and arena pools, map it at a POOL_SLAB_SIZE boundary instead of
+ * calling malloc(): the former so that mbind() covers whole pages of
+ * their own, the latter so that pool_arena_free() can find the header.
+ */
+static pool_slab_t *slab_get(pool_t *pool, size_t bytes, int cls)
+{
+  pool_slab_t *slab;
+  if (pool->numa == POOL_NUMA_NONE && pool->arena == NULL)
+  {
+    slab = (pool_slab_t *) malloc(bytes);
+    if (slab == NULL) return NULL;
+    slab->mapped = 0;
+    pool->bytes += bytes;
+  }
+  else
+  {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t len = (bytes + page - 1) & ~(page - 1);
+    size_t span = len + POOL_SLAB_SIZE;
+    char *raw = (char *) mmap(NULL, span, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    char *out = (char *) (((uintptr_t) raw + POOL_SLAB_SIZE - 1) &
+                          ~(uintptr_t) (POOL_SLAB_SIZE - 1));
+    if (out > raw) munmap(raw, out - raw);
+    if (raw + span > out + len) munmap(out + len, raw + span - (out + len));
+    if (!slab_place(pool, out, len)) pool->unplaced++;
+    slab = (pool_slab_t *) out;
+    slab->mapped = len;
+    pool->bytes += len;
+  }
+  slab->arena = pool->arena;
+  slab->cls = cls;
+  slab->size = 0;
+  return slab;
+}
+
+/* Bytes slab accounts for in pool->bytes, given what was asked for */
+static size_t slab_bytes(const pool_slab_t *slab, size_t bytes)
+{
+  return slab->mapped ? slab->mapped : bytes;
+}
+
+static void slab_put(pool_slab_t *slab)
+{
+  if (slab->mapped) munmap(slab, slab->mapped);
+  else free(slab);
+}
+
+static void slab_free_all(pool_slab_t *slab)
+{
+  while (slab != NULL)
+  {
+    pool_slab_t *next = slab->next;
+    slab_put(slab);
+    slab = next;
+  }
+}
+
+void pool_init(pool_t *pool)
+{
+  memset(pool, 0, sizeof(pool_t));
+}
+
+/* Empty pool, keeping what it is rather than what it holds */
+static void pool_reset(pool_t *pool)
+{
+  unsigned refs = pool->refs;
+  int numa = pool->numa, node = pool->node;
+  pool_arena_t *arena = pool->arena;
+  pool_init(pool);
+  pool->refs = refs;
+  pool->numa = numa;
+  pool->node = node;
+  pool->arena = arena;
+}
+
+void pool_destroy(pool_t *pool)
+{
+  if (pool==NULL) return;
+  slab_free_all(pool->slabs);
+  slab_free_all(pool->big);
+  pool_reset(pool);
+  pool->refs = 0;
+}
+
+pool_t *pool_new()
+{
+  pool_t *out = (pool_t *) malloc(sizeof(pool_t));
+  if (out==NULL) return NULL;
+  pool_init(out);
+  out->refs = 1;
+  return out;
+}
+
+void pool_free(pool_t *pool)
+{
+  if (pool==NULL) return;
+  if (pool->refs > 1)
+  {
+    pool->refs--;
+    return;
+  }
+  pool_destroy(pool);
+  free(pool);
+}
+
+pool_t *pool_share(pool_t *pool)
+{
+  if (pool!=NULL) pool->refs++;
+  return pool;
+}
+
+/*
+ * Append list src to list dst, both threaded through next.
+ */
+static void slab_splice(pool_slab_t **dst, pool_slab_t *src)
+{
+  if (src == NULL) return;
+  pool_slab_t *last = src;
+  while (last->next != NULL) last = last->next;
+  last->next = *dst;
+  if (*dst != NULL) (*dst)->prev = last;
+  *dst = src;
+}
+
+/*
+ * The uncarved tail of a class' slab in src survives only if dst has none
+ * of its own left; otherwise it stays unused until dst is destroyed. Arena
+ * slabs name their arena, so arena pools never merge.
+ */
+bool pool_merge(pool_t *dst, pool_t *src)
+{
+  if (dst==NULL || src==NULL) return dst == src;
+  if (dst==src) return true;
+  if (src->refs > 1 || src->arena != NULL || dst->arena != NULL) return false;
+  slab_splice(&dst->slabs, src->slabs);
+  slab_splice(&dst->big, src->big);
+  for (int c = 0; c < POOL_NUM_CLASSES; c++)
+  {
+    pool_block_t *blk = src->free[c];
+    if (blk != NULL)
+    {
+      while (blk->next != NULL) blk = blk->next;
+      blk->next = dst->free[c];
+      dst->free[c] = src->free[c];
+    }
+    if (dst->bump[c] == dst->bump_end[c])
+    {
+      dst->bump[c] = src->bump[c];
+      dst->bump_end[c] = src->bump_end[c];
+    }
+  }
+  dst->bytes += src->bytes;
+  dst->used += src->used;
+  dst->allocs += src->allocs;
+  dst->releases += src->releases;
+  dst->unplaced += src->unplaced;
+  pool_reset(src);
+  return true;
+}
+
+/*
+ * Serve from the class' free list first, then from the uncarved tail of
+ * its newest slab, and only then go to the system for a fresh slab.
+ */
+void *pool_alloc(pool_t *pool, size_t size)
+{
+  if (pool==NULL) return malloc(size);
+  int c = pool_class(size);
+  if (c < 0)
+  {
+    if (size > SIZE_MAX / 2) return NULL;  // slab header would wrap it
+    pool_slab_t *big = slab_get(pool, sizeof(pool_slab_t) + size, -1);
+    if (big==NULL) return NULL;
+    big->size = size;
+    slab_link(&pool->big, big);
+    pool->used += size;
+    pool->allocs++;
+    return big + 1;
+  }
+  size_t block_size = (size_t) 1 << (c + POOL_MIN_SHIFT);
+  void *out = pool->free[c];
+  if (out != NULL)
+  {
+    pool->free[c] = pool->free[c]->next;
+  }
+  else
+  {
+    if (pool->bump[c]==NULL || pool->bump[c] + block_size > pool->bump_end[c])
+    {
+      pool_slab_t *slab = slab_get(pool, POOL_SLAB_SIZE, c);
+      if (slab==NULL) return NULL;
+      slab_link(&pool->slabs, slab);
+      pool->bump[c] = (char *) (slab + 1);
+      pool->bump_end[c] = (char *) slab + POOL_SLAB_SIZE;
+    }
+    out = pool->bump[c];
+    pool->bump[c] += block_size;
+  }
+  pool->used += block_size;
+  pool->allocs++;
+  return out;
+}
+
+void pool_release(pool_t *pool, void *ptr, size_t size)
+{
+  if (ptr==NULL) return;
+  if (pool==NULL)
+  {
+    free(ptr);
+    return;
+  }
+  pool->releases++;
+  int c = pool_class(size);
+  if (c < 0)
+  {
+    pool_slab_t *big = (pool_slab_t *) ptr - 1;
+    slab_unlink(&pool->big, big);
+    pool->bytes -= slab_bytes(big, sizeof(pool_slab_t) + size);
+    pool->used -= size;
+    slab_put(big);
+    return;
+  }
+  pool->used -= (size_t) 1 << (c + POOL_MIN_SHIFT);
+  pool_block_t *blk = (pool_block_t *) ptr;
+  blk->next = pool->free[c];
+  pool->free[c] = blk;
+}
+
+void pool_set_numa(pool_t *pool, int policy, int node)
+{
+  if (pool==NULL) return;
+  pool->numa = policy;
+  pool->node = (policy == POOL_NUMA_LOCAL) ? pool_numa_node() : node;
+}
+
+int pool_numa_node()
+{
+#ifdef __linux__
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) return (int) node;
+#endif
+  return 0;
+}
+
+void pool_usage(const pool_t *pool, pool_usage_t *out)
+{
+  memset(out, 0, sizeof(pool_usage_t));
+  out->node = -1;
+  if (pool==NULL) return;
+  out->bytes = pool->bytes;
+  out->used = pool->used;
+  out->allocs = pool->allocs;
+  out->releases = pool->releases;
+  if ((pool->numa == POOL_NUMA_LOCAL || pool->numa == POOL_NUMA_BIND) &&
+      pool->unplaced == 0)
+    out->node = pool->node;
+}
+
+/************** Arenas *************************************/
+
+/*
+ * Threads are numbered on first use and mapped onto arenas round-robin,
+ * so up to POOL_ARENAS threads never share one.
+ */
+int pool_arena_self()
+{
+  static std::atomic<unsigned> threads(0);
+  static thread_local int self = -1;
+  if (self < 0) self = (int) (threads.fetch_add(1) % POOL_ARENAS);
+  return self;
+}
+
+pool_arenas_t *pool_arenas_new(int policy, int node)
+{
+  pool_arenas_t *a = (pool_arenas_t *) malloc(sizeof(pool_arenas_t));
+  if (a==NULL) return NULL;
+  for (int i = 0; i < POOL_ARENAS; i++)
+  {
+    pool_arena_t *ar = &a->arenas[i];
+    pool_init(&ar->pool);
+    ar->pool.arena = ar;
+    pthread_mutex_init(&ar->lock, NULL);
+    ar->placed = false;
+    ar->remote = 0;
+    ar->index = i;
+  }
+  a->numa = policy;
+  a->node = node;
+  return a;
+}
+
+void pool_arenas_free(pool_arenas_t *a)
+{
+  if (a==NULL) return;
+  for (int i = 0; i < POOL_ARENAS; i++)
+  {
+    pool_destroy(&a->arenas[i].pool);
+    pthread_mutex_destroy(&a->arenas[i].lock);
+  }
+  free(a);
+}
+
+/*
+ * The policy is applied by the first allocating thread, so that
+ * POOL_NUMA_LOCAL picks that thread's node.
+ */
+void *pool_arena_alloc(pool_arenas_t *a, size_t size)
+{
+  if (a==NULL) return malloc(size);
+  pool_arena_t *ar = &a->arenas[pool_arena_self()];
+  pthread_mutex_lock(&ar->lock);
+  if (!ar->placed)
+  {
+    pool_set_numa(&ar->pool, a->numa, a->node);
+    ar->placed = true;
+  }
+  void *out = pool_alloc(&ar->pool, size);
+  pthread_mutex_unlock(&ar->lock);
+  return out;
+}
+
+void pool_arena_free(void *ptr)
+{
+  if (ptr==NULL) return;
+  pool_slab_t *slab = (pool_slab_t *) ((uintptr_t) ptr &
+                                       ~(uintptr_t) (POOL_SLAB_SIZE - 1));
+  pool_arena_t *ar = slab->arena;
+  size_t size = (slab->cls < 0) ? slab->size
+                                : (size_t) 1 << (slab->cls + POOL_MIN_SHIFT);
+  pthread_mutex_lock(&ar->lock);
+  if (ar->index != pool_arena_self()) ar->remote++;
+  pool_release(&ar->pool, ptr, size);
+  pthread_mutex_unlock(&ar->lock);
+}
+
+void pool_arena_usage(pool_arenas_t *a, int i, pool_usage_t *out)
+{
+  pool_arena_t *ar = &a->arenas[i];
+  pthread_mutex_lock(&ar->lock);
+  pool_usage(&ar->pool, out);
+  out->remote = ar->remote;
+  pthread_mutex_unlock(&ar->lock);
+}
+
+#define ARENA_THREADS 4
+#define ARENA_BLOCKS 5000
+
+typedef struct {
+    pool_arenas_t *a;
+    void **blocks;
+    int self;
+} arena_arg_t;
+
+/* Fill this thread's share of blocks, every tenth one oversized */
+static void *arena_fill(void *p)
+{
+  arena_arg_t *arg = (arena_arg_t *) p;
+  arg->self = pool_arena_self();
+  for (int i = 0; i < ARENA_BLOCKS; i++)
+  {
+    size_t size = (i % 10 == 9) ? POOL_MAX_SIZE + 100 : 16 + i % 200;
+    arg->blocks[i] = pool_arena_alloc(arg->a, size);
+    assert(arg->blocks[i] != NULL);
+    memset(arg->blocks[i], 0xab, size);
+  }
+  return NULL;
+}
+
+void test_pool() {
+  pool_t pool;
+  pool_init(&pool);
+  void *a = pool_alloc(&pool, 24);
+  void *b = pool_alloc(&pool, 24);
+  assert(a && b && a != b);
+  assert(((size_t) a & 15) == 0);
+  assert(pool.bytes == POOL_SLAB_SIZE);
+  pool_release(&pool, a, 24);
+  assert(pool_alloc(&pool, 32) == a);
+  void *big = pool_alloc(&pool, POOL_MAX_SIZE + 1);
+  assert(big != NULL);
+  assert(pool.bytes > POOL_SLAB_SIZE);
+  pool_release(&pool, big, POOL_MAX_SIZE + 1);
+  assert(pool.bytes == POOL_SLAB_SIZE);
+  for (int i = 0; i < 10000; i++) assert(pool_alloc(&pool, 100));
+  pool_destroy(&pool);
+  assert(pool.slabs == NULL && pool.bytes == 0);
+
+  // Merged pools take over each other's blocks and free lists
+  pool_t *p1 = pool_new(), *p2 = pool_new();
+  void *x = pool_alloc(p1, 24), *y = pool_alloc(p2, 24);
+  void *z = pool_alloc(p2, 24), *w = pool_alloc(p2, POOL_MAX_SIZE + 1);
+  pool_release(p2, z, 24);
+  assert(pool_share(p2) == p2 && !pool_merge(p1, p2));
+  pool_free(p2);
+  assert(pool_merge(p1, p2) && p2->bytes == 0 && p2->slabs == NULL);
+  assert(p1->bytes == 2 * POOL_SLAB_SIZE + sizeof(pool_slab_t) +
+                      POOL_MAX_SIZE + 1);
+  assert(pool_alloc(p1, 24) == z);
+  pool_release(p1, y, 24);
+  pool_release(p1, w, POOL_MAX_SIZE + 1);
+  pool_release(p1, x, 24);
+  assert(pool_alloc(p2, 24) != NULL && pool_merge(p2, p2));
+  pool_free(p2);
+  pool_free(p1);
+
+  // Usage counts blocks by class size; merging adds it up
+  pool_usage_t u;
+  p1 = pool_new();
+  p2 = pool_new();
+  x = pool_alloc(p1, 24);
+  pool_usage(p1, &u);
+  assert(u.used == 32 && u.allocs == 1 && u.releases == 0 && u.node == -1);
+  pool_release(p1, x, 24);
+  y = pool_alloc(p2, POOL_MAX_SIZE + 1);
+  pool_usage(p2, &u);
+  assert(u.used == POOL_MAX_SIZE + 1 && u.bytes > u.used);
+  assert(pool_merge(p1, p2));
+  pool_usage(p1, &u);
+  assert(u.used == POOL_MAX_SIZE + 1 && u.allocs == 2 && u.releases == 1);
+  pool_release(p1, y, POOL_MAX_SIZE + 1);
+  pool_free(p2);
+  pool_free(p1);
+
+  // Placed pools map aligned slabs and keep their policy when destroyed
+  pool_init(&pool);
+  pool_set_numa(&pool, POOL_NUMA_LOCAL, 0);
+  assert(pool.numa == POOL_NUMA_LOCAL && pool.node == pool_numa_node());
+  a = pool_alloc(&pool, 24);
+  big = pool_alloc(&pool, POOL_MAX_SIZE + 1);
+  assert(a && big && pool.slabs->mapped == POOL_SLAB_SIZE);
+  assert(((uintptr_t) pool.slabs & (POOL_SLAB_SIZE - 1)) == 0);
+  assert(pool.big->mapped >= POOL_MAX_SIZE + 1 + sizeof(pool_slab_t));
+  memset(a, 1, 24);
+  memset(big, 2, POOL_MAX_SIZE + 1);
+  pool_usage(&pool, &u);
+  // Placement is best effort: where mbind() is refused no node is reported
+  assert(u.node == (pool.unplaced == 0 ? pool_numa_node() : -1));
+  assert(u.bytes == POOL_SLAB_SIZE + pool.big->mapped);
+  pool_release(&pool, big, POOL_MAX_SIZE + 1);
+  assert(pool.bytes == POOL_SLAB_SIZE && pool.big == NULL);
+  pool_destroy(&pool);
+  assert(pool.numa == POOL_NUMA_LOCAL && pool.bytes == 0);
+  pool_set_numa(&pool, POOL_NUMA_INTERLEAVE, 0);
+  for (int i = 0; i < 2000; i++) assert(pool_alloc(&pool, 100));
+  pool_usage(&pool, &u);
+  assert(u.node == -1 && u.used == 2000 * 128);
+  pool_destroy(&pool);
+  // A node that cannot be bound to is not reported as bound
+  pool_set_numa(&pool, POOL_NUMA_BIND, pool_numa_node());
+  assert(pool_alloc(&pool, 100));
+  pool_usage(&pool, &u);
+  assert(u.node == (pool.unplaced == 0 ? pool_numa_node() : -1));
+  pool_destroy(&pool);
+  pool_set_numa(&pool, POOL_NUMA_BIND, 1000);
+  assert(pool_alloc(&pool, 100));
+  pool_usage(&pool, &u);
+  assert(u.node == -1 && pool.unplaced == 1);
+  pool_destroy(&pool);
+
+  // Arenas: threads fill their own, the main thread frees everything
+  pool_arenas_t *arenas = pool_arenas_new(POOL_NUMA_LOCAL, 0);
+  void *plain = pool_arena_alloc(NULL, 8);   // no family: plain malloc()
+  assert(arenas && plain);
+  free(plain);
+  pthread_t threads[ARENA_THREADS];
+  arena_arg_t args[ARENA_THREADS];
+  void **blocks = (void **) malloc(ARENA_THREADS * ARENA_BLOCKS * sizeof(void *));
+  for (int t = 0; t < ARENA_THREADS; t++)
+  {
+    args[t].a = arenas;
+    args[t].blocks = blocks + t * ARENA_BLOCKS;
+    assert(0 == pthread_create(&threads[t], NULL, arena_fill, &args[t]));
+  }
+  for (int t = 0; t < ARENA_THREADS; t++) pthread_join(threads[t], NULL);
+  uint64_t allocs = 0;
+  for (int i = 0; i < POOL_ARENAS; i++)
+  {
+    pool_arena_usage(arenas, i, &u);
+    allocs += u.allocs;
+    bool placed = arenas->arenas[i].pool.unplaced == 0;
+    if (u.allocs > 0) assert((placed ? u.node >= 0 : u.node == -1) && u.used > 0);
+  }
+  assert(allocs == ARENA_THREADS * ARENA_BLOCKS);
+  for (int t = 0; t < ARENA_THREADS; t++)
+  {
+    pool_arena_usage(arenas, args[t].self, &u);
+    assert(u.allocs >= ARENA_BLOCKS);
+  }
+  for (int i = 0; i < ARENA_THREADS * ARENA_BLOCKS; i++) pool_arena_free(blocks[i]);
+  pool_arena_free(NULL);
+  for (int t = 0; t < ARENA_THREADS; t++)
+  {
+    pool_arena_usage(arenas, args[t].self, &u);
+    assert(u.used == 0 && u.releases == u.allocs);
+    if (args[t].self != pool_arena_self()) assert(u.remote == u.releases);
+  }
+  free(blocks);
+  pool_arenas_free(arenas);
+  pool_arenas_free(NULL);
+}
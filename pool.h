@@ -0,0 +1,219 @@
+/*
+ * This program implements a slab allocator for the nodes and payloads
+ * handed out by pack().
+ *
+ * Requests are rounded up to one of POOL_NUM_CLASSES power-of-two size
+ * classes. Each class carves blocks out of POOL_SLAB_SIZE slabs and keeps
+ * released blocks on a free list, so once a container has reached its
+ * working size, insert/remove cycles never call into malloc()/free().
+ * Requests larger than POOL_MAX_SIZE get a block of their own, but are
+ * still tracked so that they are released along with the pool.
+ *
+ * A NULL pool is valid everywhere and means "use malloc()/free()".
+ *
+ * Heap pools can be shared by several owners (pool_share()); the last
+ * pool_free() releases it. Pools are not thread-safe, shared or not.
+ *
+ * NUMA placement:
+ * -pool_set_numa() makes a pool obtain its slabs from mmap() and mbind()
+ *   them to the creating thread's node, to a given node, or interleaved
+ *   over the online nodes, so that a container's nodes sit close to the
+ *   threads chasing its pointers. Placement is best effort: where the
+ *   kernel has no NUMA support or refuses the node the slabs are simply
+ *   mapped, and pool_usage() reports no node.
+ * -A pool_arenas_t is a family of POOL_ARENAS pools, each behind its own
+ *   lock, for containers used by many threads at once. Every thread
+ *   allocates from the arena its thread number maps onto, and any thread
+ *   may release a block: arena slabs are POOL_SLAB_SIZE-aligned and their
+ *   header names the arena, so pool_arena_free() needs only the pointer.
+ *   With POOL_NUMA_LOCAL, each arena is bound to the node of the first
+ *   thread that allocates from it.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define POOL_MIN_SHIFT 4 // smallest size class is 1 << POOL_MIN_SHIFT bytes
+#define POOL_NUM_CLASSES 9 // 16, 32, ..., 4096 bytes
+#define POOL_MAX_SIZE ((size_t) 1 << (POOL_MIN_SHIFT + POOL_NUM_CLASSES - 1))
+#define POOL_SLAB_SIZE ((size_t) 64 * 1024)
+#define POOL_ARENAS 16 // arenas in a pool_arenas_t
+
+/* Slab placement, for pool_set_numa() */
+#define POOL_NUMA_NONE 0       /* malloc() slabs, wherever it puts them */
+#define POOL_NUMA_LOCAL 1      /* Bind to the node of the calling thread */
+#define POOL_NUMA_INTERLEAVE 2 /* Spread pages round-robin over all nodes */
+#define POOL_NUMA_BIND 3       /* Bind to a given node */
+
+/************** Data structure declarations ****************/
+
+/* Header at the start of every slab, and of every oversized block */
+typedef struct alignas(16) SLAB {
+    struct SLAB *next;
+    struct SLAB *prev;
+    struct POOL_ARENA *arena;  /* Arena owning the slab, NULL for none */
+    size_t mapped;             /* Bytes mmap()ed, 0 if malloc()ed */
+    int cls;                   /* Size class carved from it, -1 if oversized */
+    size_t size;               /* Request size of an oversized block */
+} pool_slab_t;
+
+/* A released block, threaded onto its size class' free list */
+typedef struct FREE {
+    struct FREE *next;
+} pool_block_t;
+
+typedef struct {
+    pool_block_t *free[POOL_NUM_CLASSES]; /* Released blocks per class */
+    char *bump[POOL_NUM_CLASSES];         /* Uncarved space in newest slab */
+    char *bump_end[POOL_NUM_CLASSES];
+    pool_slab_t *slabs;                   /* Every slab owned by the pool */
+    pool_slab_t *big;                     /* Oversized blocks */
+    size_t bytes;                         /* Bytes obtained from the system */
+    unsigned refs;                        /* Owners of a pool_new() pool */
+    int numa;                             /* POOL_NUMA_* slab placement */
+    int node;                             /* Node for LOCAL and BIND */
+    struct POOL_ARENA *arena;             /* Set for the pools of arenas */
+    size_t used;                          /* Bytes handed out, by class size */
+    uint64_t allocs;
+    uint64_t releases;
+    uint64_t unplaced;                    /* Slabs the policy failed for */
+} pool_t;
+
+/* One member of a pool_arenas_t */
+typedef struct POOL_ARENA {
+    pool_t pool;
+    pthread_mutex_t lock;
+    bool placed;         /* NUMA policy applied, on first allocation */
+    uint64_t remote;     /* Releases by threads mapped onto other arenas */
+    int index;
+} pool_arena_t;
+
+typedef struct {
+    pool_arena_t arenas[POOL_ARENAS];
+    int numa;            /* Placement of every arena's slabs */
+    int node;
+} pool_arenas_t;
+
+/* A snapshot of one pool's or arena's usage */
+typedef struct {
+    size_t bytes;        /* Obtained from the system */
+    size_t used;         /* Handed out and not released, by class size */
+    uint64_t allocs;
+    uint64_t releases;
+    uint64_t remote;     /* Arenas only: releases from other threads */
+    int node;            /* Node slabs are bound to, -1 for none or if
+                            any slab could not be placed */
+} pool_usage_t;
+
+/************** Operations on pool *************************/
+
+/*
+  Initialize an empty pool in caller-provided storage.
+  Never allocates; slabs are obtained on first use.
+*/
+void pool_init(pool_t *pool);
+
+/*
+  Release every slab and oversized block back to the system, leaving
+  pool empty and reusable. All blocks handed out are invalidated.
+*/
+void pool_destroy(pool_t *pool);
+
+/*
+  Create an empty pool on the heap.
+  Return NULL if could not allocate space.
+*/
+pool_t *pool_new();
+
+/*
+  Drop one owner of a pool_new() pool; the last one pool_destroy()s and
+  frees the pool itself.
+  No effect if pool is NULL
+*/
+void pool_free(pool_t *pool);
+
+/*
+  Add an owner to a pool_new() pool, to be dropped by pool_free().
+  Return pool.
+*/
+pool_t *pool_share(pool_t *pool);
+
+/*
+  Move every slab, oversized block and free block of src into dst, so
+  that blocks obtained from either may be released to dst. src is left
+  empty. Costs time proportional to src's slabs and free blocks, not to
+  the blocks in use.
+  Return false, changing nothing, if src is shared.
+*/
+bool pool_merge(pool_t *dst, pool_t *src);
+
+/*
+  Return a block of at least size bytes, aligned to 16 bytes.
+  Return NULL if could not allocate space.
+*/
+void *pool_alloc(pool_t *pool, size_t size);
+
+/*
+  Return ptr, obtained from pool_alloc(pool, size), to the pool.
+  size must match the original request. No effect if ptr is NULL
+*/
+void pool_release(pool_t *pool, void *ptr, size_t size);
+
+/*
+  Place slabs obtained from now on with policy, one of POOL_NUMA_*; node
+  is only read for POOL_NUMA_BIND. Slabs already obtained stay where they
+  are. No effect if pool is NULL
+*/
+void pool_set_numa(pool_t *pool, int policy, int node);
+
+/*
+  Return the NUMA node of the CPU the calling thread runs on, 0 if it
+  cannot be told.
+*/
+int pool_numa_node();
+
+void pool_usage(const pool_t *pool, pool_usage_t *out);
+
+/************** Operations on arenas ***********************/
+
+/*
+  Create a family of arenas whose slabs are placed with policy and node,
+  as for pool_set_numa().
+  Return NULL if could not allocate space.
+*/
+pool_arenas_t *pool_arenas_new(int policy, int node);
+
+/*
+  Release every arena and all blocks in them. No thread may be using any.
+  No effect if a is NULL
+*/
+void pool_arenas_free(pool_arenas_t *a);
+
+/*
+  Return a block of at least size bytes, aligned to 16 bytes, from the
+  calling thread's arena, or from malloc() if a is NULL.
+  Return NULL if could not allocate space.
+*/
+void *pool_arena_alloc(pool_arenas_t *a, size_t size);
+
+/*
+  Return a block obtained from pool_arena_alloc() with a non-NULL family
+  to its arena, from any thread. No effect if ptr is NULL
+*/
+void pool_arena_free(void *ptr);
+
+/*
+  Index of the arena the calling thread allocates from.
+*/
+int pool_arena_self();
+
+/*
+  Read arena i's usage under its lock.
+*/
+void pool_arena_usage(pool_arenas_t *a, int i, pool_usage_t *out);
+
+#endif
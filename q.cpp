@@ -2,7 +2,9 @@
  * This program implements a queue supporting both FIFO and LIFO
  * operations.
  *
- * It uses a singly-linked list to represent the set of queue elements
+ * It uses a singly-linked list to represent the set of queue elements.
+ * Queues created with Q_DOUBLY additionally keep a prev pointer in every
+ * element.
  */
 
 #include <stdlib.h>
@@ -12,18 +14,264 @@
 #include <assert.h>
 #include "q.h"
 
-list_ele_t *pack(void *val, size_t size, void *hash) {
-  list_ele_t *out = (list_ele_t *) malloc(sizeof(list_ele_t));
-  if (out==NULL) return NULL;
-  out->value = malloc(size);
-  if (out->value==NULL) return NULL;
+/*
+ * Build an element whose header is hdr bytes long (sizeof(list_ele_t) or
+ * sizeof(dlist_ele_t)), with small payloads placed right behind it.
+ */
+static list_ele_t *pack_hdr(pool_t *pool, size_t hdr, void *val, size_t size,
+                            void *hash) {
+  if (size > ELE_SIZE_MAX) return NULL;
+  list_ele_t *out;
+  if (size <= Q_INLINE_MAX) {
+    out = (list_ele_t *) pool_alloc(pool, hdr + size);
+    if (out==NULL) return NULL;
+    out->value = (char *) out + hdr;
+  }
+  else {
+    out = (list_ele_t *) pool_alloc(pool, hdr);
+    if (out==NULL) return NULL;
+    out->value = pool_alloc(pool, size);
+    if (out->value==NULL) {
+      pool_release(pool, out, hdr);
+      return NULL;
+    }
+  }
   out->hash = hash;
   out->payload_size = size;
+  out->owner = ELE_COPY;
   memcpy(out->value, val, size);
   out->next = NULL;
   return out;
 }
 
+/* Kept right behind the header of an ELE_ADOPTED element */
+typedef struct {
+    ele_deleter_fn fn;
+    void *arg;
+} ele_deleter_t;
+
+static ele_deleter_t *ele_deleter(list_ele_t *ele, size_t hdr) {
+  return (ele_deleter_t *) ((char *) ele + hdr);
+}
+
+/*
+ * Build an element around the caller's buffer. Only the header (and, for
+ * adopted payloads, the deleter) is allocated; val is never touched.
+ */
+static list_ele_t *wrap_hdr(pool_t *pool, size_t hdr, void *val, size_t size,
+                            void *hash, ele_deleter_fn del, void *arg) {
+  if (size > ELE_SIZE_MAX) return NULL;
+  size_t bytes = hdr + (del ? sizeof(ele_deleter_t) : 0);
+  list_ele_t *out = (list_ele_t *) pool_alloc(pool, bytes);
+  if (out==NULL) return NULL;
+  out->value = val;
+  out->payload_size = size;
+  out->owner = del ? ELE_ADOPTED : ELE_BORROWED;
+  out->hash = hash;
+  out->next = NULL;
+  if (del) {
+    ele_deleter(out, hdr)->fn = del;
+    ele_deleter(out, hdr)->arg = arg;
+  }
+  return out;
+}
+
+static void unpack_hdr(pool_t *pool, size_t hdr, list_ele_t *ele) {
+  if (ele==NULL) return;
+  if (ele->owner == ELE_ADOPTED) {
+    ele_deleter_t *del = ele_deleter(ele, hdr);
+    del->fn(del->arg, ele->value, ele->payload_size);
+    pool_release(pool, ele, hdr + sizeof(ele_deleter_t));
+    return;
+  }
+  if (ele->owner == ELE_BORROWED) {
+    pool_release(pool, ele, hdr);
+    return;
+  }
+  if (ele->value == (char *) ele + hdr) {
+    pool_release(pool, ele, hdr + ele->payload_size);
+    return;
+  }
+  pool_release(pool, ele->value, ele->payload_size);
+  pool_release(pool, ele, hdr);
+}
+
+static size_t q_hdr(const queue_t *q) {
+  return (q->flags & Q_DOUBLY) ? sizeof(dlist_ele_t) : sizeof(list_ele_t);
+}
+
+/*
+ * Place ele in the first free slot at or after its home slot. The table
+ * must have a free slot.
+ */
+static void idx_place(q_index_t *idx, list_ele_t *ele) {
+  size_t mask = idx->cap - 1;
+  uint64_t h = idx->hash_fn(ele->hash);
+  size_t i = h & mask;
+  while (idx->slots[i] != NULL) i = (i + 1) & mask;
+  idx->slots[i] = ele;
+  idx->tags[i] = Q_TAG(h);
+  idx->used++;
+}
+
+/*
+ * Allocate cleared slots and tags for cap entries.
+ */
+static bool idx_alloc(q_index_t *idx, size_t cap) {
+  idx->slots = (list_ele_t **) calloc(cap, sizeof(list_ele_t *));
+  idx->tags = (uint8_t *) malloc(cap);
+  if (idx->slots==NULL || idx->tags==NULL) {
+    free(idx->slots);
+    free(idx->tags);
+    return false;
+  }
+  idx->cap = cap;
+  idx->used = 0;
+  return true;
+}
+
+static bool idx_resize(q_index_t *idx, size_t cap) {
+  list_ele_t **old = idx->slots;
+  uint8_t *old_tags = idx->tags;
+  size_t old_cap = idx->cap;
+  if (!idx_alloc(idx, cap)) {
+    idx->slots = old;
+    idx->tags = old_tags;
+    return false;
+  }
+  for (size_t i = 0; i < old_cap; i++)
+    if (old[i] != NULL) idx_place(idx, old[i]);
+  free(old);
+  free(old_tags);
+  return true;
+}
+
+static bool idx_insert(q_index_t *idx, list_ele_t *ele) {
+  if (2 * (idx->used + 1) > idx->cap && !idx_resize(idx, 2 * idx->cap))
+    return false;
+  idx_place(idx, ele);
+  return true;
+}
+
+/*
+ * Remove ele by identity, then shift later members of its probe run back
+ * so that no tombstones are needed.
+ */
+static void idx_remove(q_index_t *idx, list_ele_t *ele) {
+  size_t mask = idx->cap - 1;
+  size_t i = idx->hash_fn(ele->hash) & mask;
+  while (idx->slots[i] != ele) {
+    if (idx->slots[i] == NULL) return;
+    i = (i + 1) & mask;
+  }
+  size_t j = i;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (idx->slots[j] == NULL) break;
+    size_t k = idx->hash_fn(idx->slots[j]->hash) & mask;
+    // slots[j] may fill the hole at i unless its home lies in (i, j]
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) continue;
+    idx->slots[i] = idx->slots[j];
+    idx->tags[i] = idx->tags[j];
+    i = j;
+  }
+  idx->slots[i] = NULL;
+  idx->used--;
+}
+
+/*
+ * Whether ele itself, not just an element with its hash, is indexed.
+ */
+static bool idx_has(const q_index_t *idx, const list_ele_t *ele) {
+  size_t mask = idx->cap - 1;
+  for (size_t i = idx->hash_fn(ele->hash) & mask; idx->slots[i] != NULL;
+       i = (i + 1) & mask)
+    if (idx->slots[i] == ele) return true;
+  return false;
+}
+
+static void idx_free(q_index_t *idx) {
+  if (idx==NULL) return;
+  free(idx->slots);
+  free(idx->tags);
+  free(idx);
+}
+
+uint64_t q_hash_int(void *hash) {
+  uint64_t h = (uint64_t) (uintptr_t) hash;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/*
+ * FNV-1a over the bytes, finished with the q_hash_int() mixer so that the
+ * fingerprint bits are as well spread as the slot bits.
+ */
+uint64_t q_hash_str(void *hash) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const unsigned char *s = (const unsigned char *) hash; *s; s++) {
+    h ^= *s;
+    h *= 0x100000001b3ULL;
+  }
+  return q_hash_int((void *) (uintptr_t) h);
+}
+
+bool q_str_equal(void *h1, void *h2) {
+  return h1 == h2 || 0 == strcmp((const char *) h1, (const char *) h2);
+}
+
+bool q_index(queue_t *q, uint64_t (*hash_fn)(void *hash)) {
+  if (q==NULL) return false;
+  q_index_t *idx = (q_index_t *) malloc(sizeof(q_index_t));
+  if (idx==NULL) return false;
+  idx->hash_fn = hash_fn ? hash_fn : q_hash_int;
+  size_t cap = 16;
+  while (cap < 2 * (size_t) q->nodes + 2) cap *= 2;
+  if (!idx_alloc(idx, cap)) {
+    free(idx);
+    return false;
+  }
+  for (list_ele_t *pt = q->head; pt != NULL; pt = pt->next)
+    idx_place(idx, pt);
+  idx_free(q->index);
+  q->index = idx;
+  return true;
+}
+
+list_ele_t *pack(void *val, size_t size, void *hash) {
+  return pack_in(NULL, val, size, hash);
+}
+
+list_ele_t *pack_in(pool_t *pool, void *val, size_t size, void *hash) {
+  return pack_hdr(pool, sizeof(list_ele_t), val, size, hash);
+}
+
+list_ele_t *pack_adopt(void *val, size_t size, void *hash,
+                       ele_deleter_fn del, void *arg) {
+  if (del==NULL) return NULL;
+  return wrap_hdr(NULL, sizeof(list_ele_t), val, size, hash, del, arg);
+}
+
+list_ele_t *pack_borrow(void *val, size_t size, void *hash) {
+  return wrap_hdr(NULL, sizeof(list_ele_t), val, size, hash, NULL, NULL);
+}
+
+void unpack(pool_t *pool, list_ele_t *ele) {
+  unpack_hdr(pool, sizeof(list_ele_t), ele);
+}
+
+void unpack_as(pool_t *pool, size_t hdr, list_ele_t *ele) {
+  unpack_hdr(pool, hdr, ele);
+}
+
+void ele_free(void *, void *val, size_t) {
+  free(val);
+}
+
 /*
   Create empty queue.
   Return NULL if could not allocate space.
@@ -37,21 +285,103 @@ queue_t *q_new()
     out->nodes = 0;
     out->tail = NULL;
     out->head = NULL;
+    out->pool = NULL;
+    out->flags = 0;
+    out->index = NULL;
+    out->adopted = 0;
+    stats_reset(&out->search_stats);
     return out;
 }
 
-/* Free all storage used by queue */
+queue_t *q_new_pooled()
+{
+    return q_new_flags(Q_POOLED);
+}
+
+queue_t *q_new_flags(unsigned flags)
+{
+    queue_t *out = q_new();
+    if (out==NULL) return NULL;
+    out->flags = flags;
+    if (flags & Q_POOLED)
+    {
+      out->pool = pool_new();
+      if (out->pool==NULL)
+      {
+        free(out);
+        return NULL;
+      }
+    }
+    return out;
+}
+
+list_ele_t *q_pack(queue_t *q, void *val, size_t size, void *hash)
+{
+  if (q==NULL) return NULL;
+  list_ele_t *out = pack_hdr(q->pool, q_hdr(q), val, size, hash);
+  if (out!=NULL && (q->flags & Q_DOUBLY)) *ele_prev(out) = NULL;
+  return out;
+}
+
+list_ele_t *q_adopt(queue_t *q, void *val, size_t size, void *hash,
+                    ele_deleter_fn del, void *arg)
+{
+  if (q==NULL || del==NULL) return NULL;
+  list_ele_t *out = wrap_hdr(q->pool, q_hdr(q), val, size, hash, del, arg);
+  if (out==NULL) return NULL;
+  if (q->flags & Q_DOUBLY) *ele_prev(out) = NULL;
+  q->adopted++;
+  return out;
+}
+
+list_ele_t *q_borrow(queue_t *q, void *val, size_t size, void *hash)
+{
+  if (q==NULL) return NULL;
+  list_ele_t *out = wrap_hdr(q->pool, q_hdr(q), val, size, hash, NULL, NULL);
+  if (out!=NULL && (q->flags & Q_DOUBLY)) *ele_prev(out) = NULL;
+  return out;
+}
+
+size_t q_ele_hdr(const queue_t *q)
+{
+  return q_hdr(q);
+}
+
+void q_release(queue_t *q, list_ele_t *ele)
+{
+  if (q==NULL || ele==NULL) return;
+  if (ele->owner == ELE_ADOPTED && q->adopted > 0) q->adopted--;
+  unpack_hdr(q->pool, q_hdr(q), ele);
+}
+
+/*
+ * Free all storage used by queue. A pooled queue hands its slabs back
+ * wholesale instead of walking the list, unless adopted payloads are
+ * waiting for their deleters.
+ */
 void q_free(queue_t *q)
 {
   /* Remember to free the queue structue and list elements */
   if (q==NULL) return;
+  idx_free(q->index);
+  if (q->pool!=NULL)
+  {
+    for (list_ele_t *pt = q->head; q->adopted > 0 && pt!=NULL; pt = pt->next)
+    {
+      if (pt->owner != ELE_ADOPTED) continue;
+      ele_deleter_t *del = ele_deleter(pt, q_hdr(q));
+      del->fn(del->arg, pt->value, pt->payload_size);
+    }
+    pool_free(q->pool);
+    free(q);
+    return;
+  }
   list_ele_t *pt = q->head;
   list_ele_t *next = pt;
   while(next!=NULL)
   {
     next = pt->next;
-    free(pt->value);
-    free(pt);
+    unpack_hdr(NULL, q_hdr(q), pt);
     pt = next;
   }
   free(q);
@@ -66,8 +396,14 @@ bool q_insert_head(queue_t *q, list_ele_t *newHead)
 {
     if (q==NULL) return false;
     if (newHead==NULL) return false;
+    if (q->index!=NULL && !idx_insert(q->index, newHead)) return false;
     list_ele_t *oldHead = q->head;
     newHead->next = oldHead;
+    if (q->flags & Q_DOUBLY)
+    {
+      *ele_prev(newHead) = NULL;
+      if (oldHead!=NULL) *ele_prev(oldHead) = newHead;
+    }
     q->head = newHead;
     if (q->tail==NULL) q->tail = newHead;
     q->nodes++;
@@ -85,7 +421,9 @@ bool q_insert_tail(queue_t *q, list_ele_t *newTail)
 {
     if (q==NULL) return false;
     if (newTail==NULL) return false;
+    if (q->index!=NULL && !idx_insert(q->index, newTail)) return false;
     newTail->next = NULL;
+    if (q->flags & Q_DOUBLY) *ele_prev(newTail) = q->tail;
     if (q->tail!=NULL) q->tail->next = newTail;
     if (q->head==NULL) q->head = newTail;
     q->tail = newTail;
@@ -93,6 +431,7 @@ bool q_insert_tail(queue_t *q, list_ele_t *newTail)
     q->size+=newTail->payload_size;
     return true;
 }
+
 /*
   Attempt to remove element from head of queue.
   Return true if successful.
@@ -111,13 +450,80 @@ bool q_remove_head(queue_t *q, bool free_after)
       q->head = NULL;
       q->tail=NULL;
     }
+    else if (q->flags & Q_DOUBLY) *ele_prev(q->head) = NULL;
+    if (q->index!=NULL) idx_remove(q->index, oldHead);
     q->nodes--;
     q->size-=oldHead->payload_size;
-    if (free_after)
+    if (free_after) q_release(q, oldHead);
+    return true;
+}
+
+int q_remove_batch(queue_t *q, int max, list_ele_t **out)
+{
+    if (q==NULL || out==NULL || max <= 0) return 0;
+    int n = 0;
+    size_t bytes = 0;
+    list_ele_t *pt = q->head;
+    for (; n < max && pt != NULL; pt = pt->next)
+    {
+      if (q->index!=NULL) idx_remove(q->index, pt);
+      bytes += pt->payload_size;
+      out[n++] = pt;
+    }
+    q->head = pt;
+    if (pt==NULL) q->tail = NULL;
+    else if (q->flags & Q_DOUBLY) *ele_prev(pt) = NULL;
+    q->nodes -= n;
+    q->size -= bytes;
+    return n;
+}
+
+/*
+  Attempt to remove element from tail of queue.
+  Return true if successful.
+  Return false if queue is NULL or empty.
+*/
+bool q_remove_tail(queue_t *q, bool free_after)
+{
+    if (q==NULL) return false;
+    if (q->head==NULL || q->tail==NULL) return false;
+    list_ele_t *oldTail = q->tail;
+    if (!q_unlink(q, oldTail)) return false;
+    if (free_after) q_release(q, oldTail);
+    return true;
+}
+
+/*
+  Detach node from anywhere in q. Singly-linked queues have to find the
+  node's predecessor first.
+  Return false if q is NULL or node is not in q.
+*/
+bool q_unlink(queue_t *q, list_ele_t *node)
+{
+    if (q==NULL || node==NULL) return false;
+    if (q->head==NULL || q->tail==NULL) return false;
+    if (node==q->head) return q_remove_head(q, false);
+    list_ele_t *prev;
+    if (q->flags & Q_DOUBLY)
     {
-      free(oldHead->value);
-      free(oldHead);
+      prev = *ele_prev(node);
+      if (prev==NULL) return false;
+      if (q->index!=NULL && !idx_has(q->index, node)) return false;
+      if (node->next!=NULL) *ele_prev(node->next) = prev;
     }
+    else
+    {
+      prev = q->head;
+      while (prev->next!=NULL && prev->next!=node) prev = prev->next;
+      if (prev->next!=node) return false;
+    }
+    prev->next = node->next;
+    if (q->tail==node) q->tail = prev;
+    node->next = NULL;
+    if (q->flags & Q_DOUBLY) *ele_prev(node) = NULL;
+    if (q->index!=NULL) idx_remove(q->index, node);
+    q->nodes--;
+    q->size-=node->payload_size;
     return true;
 }
 
@@ -159,11 +565,13 @@ void q_reverse(queue_t *q)
       pt=next;
       next = next->next;
       pt->next = prev;
+      if (q->flags & Q_DOUBLY) *ele_prev(prev) = pt;
       prev = pt;
     }
     q->tail = q->head;
     q->head = oldTail;
     q->tail->next = NULL;
+    if (q->flags & Q_DOUBLY) *ele_prev(q->head) = NULL;
 
 }
 
@@ -177,32 +585,170 @@ list_ele_t *q_search(queue_t *q, void *hash,
   if (q==NULL) return NULL;
   if (hash==NULL) return NULL;
   if (q->head==NULL || q->tail==NULL) return NULL;
-  list_ele_t *pt = q->head;
-  do 
-  { 
-    if (hash_compare(hash, pt->hash)) return pt;
-    pt = pt->next;
-    if (pt==NULL) return NULL;
-  } while (pt->next != NULL);
-  if (hash_compare(hash, pt->hash)) return pt;
-  return NULL;
+  return q_search_t(q, hash, q_fn_equal(hash_compare));
+}
+
+size_t q_search_batch(queue_t *q, void *const *hashes, size_t n,
+  list_ele_t **out, bool (*hash_compare)(void *h1, void *h2))
+{
+  size_t found = q_search_batch_t(q, hashes, n, out, q_fn_equal(hash_compare));
+  for (size_t j = 0; j < n; j++)
+  {
+    // q_search() never matches a NULL hash
+    if (hashes[j]==NULL && out[j]!=NULL)
+    {
+      out[j] = NULL;
+      found--;
+    }
+  }
+  return found;
 }
 
 /*
- * Scan through q for node's prev pointer, changing its next to circumvent node.
- * Then, reinsert node into the tail
+ * Unlink node, circumventing it from its prev pointer, then reinsert node
+ * into the tail. Finding prev is a scan unless q is Q_DOUBLY. node stays
+ * in the queue throughout, so the index is left alone.
  */
 void q_shuffle(queue_t *q, list_ele_t *node)
 {
-  if (q==NULL) return;
-  if (node==q->head) q_remove_head(q, false);
+  if (q==NULL || node==NULL) return;
+  if (node==q->tail) return;
+  q_index_t *idx = q->index;
+  if ((q->flags & Q_DOUBLY) && idx!=NULL && !idx_has(idx, node)) return;
+  q->index = NULL;
+  if (q_unlink(q, node)) q_insert_tail(q, node);
+  q->index = idx;
+}
+
+/*
+ * Grow dst's index up front so that placing src's elements cannot fail,
+ * and check src's pool can be merged, before anything is moved.
+ */
+bool q_splice(queue_t *dst, queue_t *src)
+{
+  if (dst==NULL || src==NULL || dst==src) return false;
+  if ((dst->flags ^ src->flags) & (Q_POOLED | Q_DOUBLY)) return false;
+  if (src->head==NULL) return true;
+  if (src->pool!=dst->pool && src->pool->refs > 1) return false;
+  q_index_t *idx = dst->index;
+  if (idx!=NULL)
+  {
+    size_t cap = idx->cap;
+    while (cap < 2 * (idx->used + (size_t) src->nodes)) cap *= 2;
+    if (cap > idx->cap && !idx_resize(idx, cap)) return false;
+    for (list_ele_t *pt = src->head; pt != NULL; pt = pt->next)
+      idx_place(idx, pt);
+  }
+  pool_merge(dst->pool, src->pool);
+  if (src->index!=NULL)
+  {
+    memset(src->index->slots, 0, src->index->cap * sizeof(list_ele_t *));
+    src->index->used = 0;
+  }
+  if (dst->tail!=NULL) dst->tail->next = src->head;
+  else dst->head = src->head;
+  if (dst->flags & Q_DOUBLY) *ele_prev(src->head) = dst->tail;
+  dst->tail = src->tail;
+  dst->nodes += src->nodes;
+  dst->size += src->size;
+  dst->adopted += src->adopted;
+  src->head = NULL;
+  src->tail = NULL;
+  src->nodes = 0;
+  src->size = 0;
+  src->adopted = 0;
+  return true;
+}
+
+/*
+ * Cut the list after its n-th element. The new queue's index is built
+ * before q's entries for the moved elements are dropped, so that running
+ * out of memory can still put everything back.
+ */
+queue_t *q_split(queue_t *q, int n)
+{
+  if (q==NULL || n < 0) return NULL;
+  queue_t *rest = q_new();
+  if (rest==NULL) return NULL;
+  rest->flags = q->flags;
+  rest->pool = pool_share(q->pool);
+  list_ele_t *last = NULL;
   list_ele_t *pt = q->head;
-  while (pt != NULL)
+  size_t bytes = 0;
+  for (int i = 0; i < n && pt != NULL; i++)
   {
-    if (pt->next==node) pt->next = node->next;
+    bytes += pt->payload_size;
+    last = pt;
     pt = pt->next;
   }
-  q_insert_tail(q, node);
+  if (pt==NULL) return rest;
+  rest->head = pt;
+  rest->tail = q->tail;
+  rest->nodes = q->nodes - n;
+  rest->size = q->size - bytes;
+  rest->adopted = q->adopted;
+  if (q->index!=NULL && !q_index(rest, q->index->hash_fn))
+  {
+    rest->head = NULL;
+    q_free(rest);
+    return NULL;
+  }
+  if (q->flags & Q_DOUBLY) *ele_prev(pt) = NULL;
+  if (last!=NULL) last->next = NULL;
+  else q->head = NULL;
+  q->tail = last;
+  q->nodes = n;
+  q->size = bytes;
+  if (q->index!=NULL)
+    for (; pt != NULL; pt = pt->next) idx_remove(q->index, pt);
+  return rest;
+}
+
+void q_sort(queue_t *q, int (*cmp)(void *h1, void *h2))
+{
+  q_sort_t<void *>(q, q_fn_three_way(cmp));
+}
+
+/*
+ * Without a pool every element is one allocation of header and payload,
+ * or two adding up to the same, so the footprint follows from the counts.
+ */
+bool q_stats(queue_t *q, q_stats_t *out)
+{
+  if (q==NULL) return false;
+  out->counted = STATS_ENABLED;
+  out->nodes = q->nodes;
+  out->payload_bytes = q->size;
+  if (q->pool!=NULL) out->alloc_bytes = q->pool->bytes;
+  else out->alloc_bytes = (size_t) q->nodes * q_hdr(q) + q->size;
+  out->index_slots = 0;
+  if (q->index!=NULL)
+  {
+    out->index_slots = q->index->cap;
+    out->alloc_bytes += sizeof(q_index_t) +
+                        q->index->cap * (sizeof(list_ele_t *) + 1);
+  }
+  out->search = stats_read(&q->search_stats);
+  return true;
+}
+
+void q_stats_reset(queue_t *q)
+{
+  if (q==NULL) return;
+  stats_reset(&q->search_stats);
+}
+
+void q_stats_print(FILE *f, const char *name, const q_stats_t *st)
+{
+  fprintf(f, "{\"name\": \"%s\", \"counted\": %s, \"nodes\": %d, "
+          "\"payload_bytes\": %zu, \"alloc_bytes\": %zu, "
+          "\"index_slots\": %zu, \"search\": {\"calls\": %llu, "
+          "\"compares\": %llu, \"visited\": %llu}}\n",
+          name, st->counted ? "true" : "false", st->nodes, st->payload_bytes,
+          st->alloc_bytes, st->index_slots,
+          (unsigned long long) st->search.calls,
+          (unsigned long long) st->search.compares,
+          (unsigned long long) st->search.visited);
 }
 
 void q_print(queue_t *q) {
@@ -214,6 +760,22 @@ void q_print(queue_t *q) {
   }
 }
 
+static int int_order(void *h1, void *h2) {
+  intptr_t a = (intptr_t) h1, b = (intptr_t) h2;
+  return (a == b) ? 0 : ((a > b) ? 1 : -1);
+}
+
+struct desc_order {
+  int operator()(int64_t k1, int64_t k2) const {
+    return (k1 == k2) ? 0 : ((k1 < k2) ? 1 : -1);
+  }
+};
+
+static void count_free(void *arg, void *val, size_t) {
+  (*(int *) arg)++;
+  free(val);
+}
+
 void test_q() {
   char val[25] = "Corruption check";
   size_t size = 1 + (size_t) strlen(val);
@@ -243,6 +805,318 @@ void test_q() {
   q_remove_head(q, 0);
   assert(q_nodes(q) == 0);
   assert(q_size(q) == 0 * size);
+  q_insert_tail(q, node1);
+  q_insert_tail(q, node2);
+  q_free(q);
+
+  q = q_new_pooled();
+  assert(q->pool != NULL);
+  for (int i = 0; i < 64; i++)
+    assert(q_insert_tail(q, q_pack(q, val, size, (void *) (intptr_t) i)));
+  size_t bytes = q->pool->bytes;
+  for (int i = 0; i < 1000; i++) {
+    assert(q_remove_head(q, true));
+    assert(q_insert_tail(q, q_pack(q, val, size, (void *) (intptr_t) i)));
+  }
+  assert(q->pool->bytes == bytes);
+  assert(q_nodes(q) == 64);
+  q_free(q);
+
+  char big[Q_INLINE_MAX + 1] = "Out of line";
+  list_ele_t *small = pack(val, size, (void *) 1);
+  list_ele_t *large = pack(big, sizeof(big), (void *) 2);
+  assert(ele_inline(small) && !ele_inline(large));
+  assert(0 == strcmp((char *) small->value, val));
+  assert(0 == strcmp((char *) large->value, big));
+  unpack(NULL, small);
+  unpack(NULL, large);
+
+  list_ele_t *d[4];
+  for (int flags = 0; flags <= (Q_POOLED | Q_DOUBLY); flags++) {
+    q = q_new_flags(flags);
+    for (int i = 0; i < 4; i++) {
+      d[i] = q_pack(q, val, size, (void *) (intptr_t) (i + 1));
+      assert(q_insert_tail(q, d[i]));
+    }
+    q_shuffle(q, d[1]);     // 1 3 4 2
+    assert(q->head == d[0] && q->tail == d[1]);
+    assert(q_nodes(q) == 4 && q_size(q) == 4 * size);
+    q_shuffle(q, d[1]);     // tail shuffles in place
+    assert(q->tail == d[1] && q_nodes(q) == 4);
+    assert(q_unlink(q, d[2]));  // 1 4 2
+    assert(!q_unlink(q, d[2]));
+    assert(d[0]->next == d[3] && q_nodes(q) == 3);
+    q_release(q, d[2]);
+    q_reverse(q);           // 2 4 1
+    assert(q->head == d[1] && q->tail == d[0]);
+    assert(q_remove_tail(q, true));
+    assert(q->tail == d[3] && d[3]->next == NULL);
+    if (flags & Q_DOUBLY) {
+      assert(*ele_prev(d[3]) == d[1]);
+      assert(*ele_prev(d[1]) == NULL);
+    }
+    assert(q_remove_tail(q, true) && q_remove_tail(q, true));
+    assert(!q_remove_tail(q, true));
+    assert(q_nodes(q) == 0 && q->head == NULL && q->tail == NULL);
+    q_free(q);
+  }
+
+  q = q_new_flags(Q_POOLED | Q_DOUBLY);
+  for (int i = 1; i <= 8; i++)
+    q_insert_tail(q, q_pack(q, val, size, (void *) (intptr_t) i));
+  assert(q_index(q, NULL));
+  for (int i = 9; i <= 1000; i++)
+    assert(q_insert_head(q, q_pack(q, val, size, (void *) (intptr_t) i)));
+  assert(q->index->used == 1000 && q->index->cap >= 2000);
+  for (int i = 1; i <= 1000; i++) {
+    list_ele_t *hit = q_search(q, (void *) (intptr_t) i, &hash_compare);
+    assert(hit && hit->hash == (void *) (intptr_t) i);
+    if (i % 3 == 0) q_shuffle(q, hit);
+    if (i % 2 == 0) {
+      assert(q_unlink(q, hit));
+      q_release(q, hit);
+    }
+  }
+  assert(q->index->used == 500 && q_nodes(q) == 500);
+  assert(!q_search(q, (void *) 2000, &hash_compare));
+  // An indexed Q_DOUBLY queue refuses another queue's elements
+  queue_t *other = q_new_flags(Q_POOLED | Q_DOUBLY);
+  assert(q_index(other, NULL));
+  for (intptr_t i = 1; i <= 3; i++)
+    assert(q_insert_tail(other, q_pack(other, val, size, (void *) i)));
+  list_ele_t *alien = other->head->next;
+  assert(!q_unlink(q, alien) && q_nodes(q) == 500 && q_nodes(other) == 3);
+  q_shuffle(q, alien);
+  assert(other->head->next == alien && other->tail != alien);
+  assert(q->index->used == 500 && q_nodes(q) == 500);
+  q_free(other);
+  void *keys[1001];
+  list_ele_t *hits[1001];
+  for (int i = 0; i <= 1000; i++) keys[i] = (void *) (intptr_t) (1000 - i);
+  assert(q_search_batch(q, keys, 1001, hits, &hash_compare) == 500);
+  for (int i = 0; i <= 1000; i++)
+    assert(hits[i] == q_search(q, keys[i], &hash_compare));
+  q_index_t *idx = q->index;
+  q->index = NULL;  // same answers from the linear scan
+  assert(q_search_batch(q, keys, 1001, hits, &hash_compare) == 500);
+  for (int i = 0; i <= 1000; i++)
+    assert((hits[i] != NULL) == (i != 1000 && i % 2 == 1));
+  q->index = idx;
+  while (q_remove_head(q, true))
+    ;
+  assert(q->index->used == 0);
+  for (int i = 1; i <= 1000; i++)
+    assert(!q_search(q, (void *) (intptr_t) i, &hash_compare));
+  q_free(q);
+
+  queue<int64_t, int64_t> tq(Q_POOLED | Q_DOUBLY);
+  assert(tq.q != NULL && tq.index());
+  for (int64_t k = -50; k < 50; k++) assert(tq.insert_tail(k, k * k));
+  list_ele_t *thit = tq.search(-7);
+  assert(thit && tq.key(thit) == -7 && *tq.value(thit) == 49);
+  tq.shuffle(thit);
+  assert(tq.q->tail == thit && tq.nodes() == 100);
+  assert(!tq.search(50));
+  int64_t tkeys[4] = {-50, 50, 49, 0};
+  list_ele_t *thits[4];
+  assert(tq.search_batch(tkeys, 4, thits) == 3 && thits[1] == NULL);
+  assert(*tq.value(thits[0]) == 2500 && tq.key(thits[3]) == 0);
+
+  q_stats_t st;
+  assert(!q_stats(NULL, &st) && tq.stats(&st));
+  assert(st.nodes == 100 && st.payload_bytes == 100 * sizeof(int64_t));
+  assert(st.index_slots == tq.q->index->cap && st.alloc_bytes > 0);
+  if (st.counted) {
+    assert(st.search.calls == 6 && st.search.compares >= 4);
+    assert(st.search.visited >= st.search.compares);  // tags filter
+  }
+  else {
+    assert(st.search.calls == 0 && st.search.visited == 0);
+  }
+  q_stats_print(stdout, "test_q", &st);
+  q_stats_reset(tq.q);
+
+  q = q_new();  // unpooled: footprint is headers plus payloads
+  assert(q_insert_tail(q, pack(val, size, (void *) 1)));
+  assert(q_insert_tail(q, pack(big, sizeof(big), (void *) 2)));
+  assert(q_search(q, (void *) 2, &hash_compare));
+  assert(q_stats(q, &st) && st.index_slots == 0);
+  assert(st.alloc_bytes == 2 * sizeof(list_ele_t) + size + sizeof(big));
+  if (st.counted) {
+    assert(st.search.calls == 1 && st.search.visited == 2);
+  }
+  q_free(q);
+
+  // Batched removal keeps the index and both ends consistent
+  for (int flags = 0; flags <= (Q_POOLED | Q_DOUBLY); flags++) {
+    q = q_new_flags(flags);
+    assert(q_index(q, NULL) && q_remove_batch(q, 4, NULL) == 0);
+    for (intptr_t i = 1; i <= 10; i++) {
+      assert(q_insert_tail(q, q_pack(q, val, size, (void *) i)));
+    }
+    list_ele_t *taken[10];
+    assert(q_remove_batch(q, 4, taken) == 4 && q_nodes(q) == 6);
+    assert(taken[0]->hash == (void *) 1 && taken[3]->hash == (void *) 4);
+    assert(q_size(q) == 6 * size && q->head->hash == (void *) 5);
+    assert(!q_search(q, (void *) 4, &hash_compare) && q->index->used == 6);
+    assert(!(flags & Q_DOUBLY) || *ele_prev(q->head) == NULL);
+    for (int j = 0; j < 4; j++) q_release(q, taken[j]);
+    assert(q_remove_batch(q, 10, taken) == 6 && !q->head && !q->tail);
+    for (int j = 0; j < 6; j++) q_release(q, taken[j]);
+    assert(q_insert_tail(q, q_pack(q, val, size, (void *) 11)));
+    assert(q->head == q->tail && q_remove_batch(q, 0, taken) == 0);
+    assert(q_remove_batch(q, 4, NULL) == 0 && q_nodes(q) == 1);
+    q_free(q);
+  }
+
+  // String hashes: probes only follow slots whose fingerprint matches
+  q = q_new_flags(Q_POOLED);
+  assert(q_index(q, q_hash_str));
+  char words[500][16];
+  for (int i = 0; i < 500; i++) {
+    snprintf(words[i], sizeof(words[i]), "key-%d", i);
+    assert(q_insert_tail(q, q_pack(q, val, size, words[i])));
+  }
+  for (int i = 0; i < 500; i++) {
+    char probe[16];
+    snprintf(probe, sizeof(probe), "key-%d", i);
+    list_ele_t *shit = q_search(q, probe, q_str_equal);
+    assert(shit && shit->hash == words[i]);
+  }
+  assert(!q_search(q, (void *) "key-500", q_str_equal));
+  assert(q_stats(q, &st) && st.alloc_bytes > 0);
+  if (st.counted) {
+    assert(st.search.calls == 501 && st.search.compares < 520);
+    assert(st.search.visited > st.search.compares);
+  }
+  assert(q_remove_head(q, true) && !q_search(q, (void *) "key-0", q_str_equal));
+  assert(q_search(q, (void *) "key-499", q_str_equal));
+  q_free(q);
+
+  // Stable sort: keys repeat, payloads record the original position
+  for (int flags = 0; flags <= (Q_POOLED | Q_DOUBLY); flags++) {
+    q = q_new_flags(flags);
+    q_sort(q, &int_order);
+    for (intptr_t i = 0; i < 1000; i++) {
+      intptr_t k = (i * 37) % 101 - 50;
+      assert(q_insert_tail(q, q_pack(q, &i, sizeof(i), (void *) k)));
+    }
+    q_sort(q, &int_order);
+    assert(q_nodes(q) == 1000 && q->tail->next == NULL);
+    list_ele_t *prev = NULL;
+    for (list_ele_t *pt = q->head; pt != NULL; pt = pt->next) {
+      if (prev != NULL) {
+        assert(int_order(prev->hash, pt->hash) <= 0);
+        if (prev->hash == pt->hash)
+          assert(*(intptr_t *) prev->value < *(intptr_t *) pt->value);
+      }
+      if (flags & Q_DOUBLY) assert(*ele_prev(pt) == prev);
+      prev = pt;
+    }
+    assert(q->tail == prev && q->head->hash == (void *) -50);
+    q_free(q);
+  }
+  queue<int64_t, int64_t> sq(Q_DOUBLY);
+  for (int64_t k = 0; k < 100; k++) assert(sq.insert_head(k % 10, k));
+  sq.sort(desc_order());
+  assert(sq.key(sq.q->head) == 9 && *sq.value(sq.q->head) == 99);
+  assert(sq.key(sq.q->tail) == 0 && *sq.value(sq.q->tail) == 0);
+
+  // Splice pooled queues, then free the source before the merged queue
+  queue_t *a = q_new_flags(Q_POOLED | Q_DOUBLY);
+  queue_t *b = q_new_flags(Q_POOLED | Q_DOUBLY);
+  queue_t *c = q_new_flags(Q_POOLED);
+  assert(q_index(a, NULL));
+  for (intptr_t i = 0; i < 300; i++) {
+    queue_t *to = (i < 100) ? a : b;
+    assert(q_insert_tail(to, q_pack(to, big, (i & 1) ? sizeof(big) : size,
+                                    (void *) i)));
+  }
+  assert(!q_splice(a, c) && !q_splice(a, a) && !q_splice(NULL, b));
+  size_t total = q_size(a) + q_size(b);
+  assert(q_splice(a, b) && q_splice(a, b));
+  assert(q_nodes(a) == 300 && q_size(a) == total && q_nodes(b) == 0);
+  assert(b->head == NULL && b->tail == NULL && b->pool->bytes == 0);
+  q_free(b);
+  intptr_t expect = 0;
+  for (list_ele_t *pt = a->head; pt != NULL; pt = pt->next, expect++) {
+    assert(pt->hash == (void *) expect);
+    assert(!expect || q_search(a, (void *) expect, &hash_compare) == pt);
+    assert(expect == 0 || (*ele_prev(pt))->hash == (void *) (expect - 1));
+  }
+  assert(expect == 300 && a->index->used == 300);
+
+  // Split it again; the halves share the pool and keep their indexes
+  assert(q_split(a, -1) == NULL);
+  queue_t *rest = q_split(a, 120);
+  assert(rest && q_nodes(a) == 120 && q_nodes(rest) == 180);
+  assert(q_size(a) + q_size(rest) == total && a->tail->next == NULL);
+  assert(rest->pool == a->pool && *ele_prev(rest->head) == NULL);
+  assert(a->index->used == 120 && rest->index->used == 180);
+  assert(!q_search(a, (void *) 120, &hash_compare));
+  assert(q_search(rest, (void *) 120, &hash_compare) == rest->head);
+  queue_t *none = q_split(rest, 500);
+  assert(none && q_nodes(none) == 0 && q_nodes(rest) == 180);
+  q_free(none);
+  assert(!q_splice(c, rest));  // flags differ
+  q_free(a);
+  assert(q_remove_head(rest, true) && q_nodes(rest) == 179);
+  assert(q_insert_tail(rest, q_pack(rest, val, size, (void *) 1)));
+  queue_t *all = q_split(rest, 0);
+  assert(all && q_nodes(rest) == 0 && rest->head == NULL);
+  assert(q_nodes(all) == 180 && q_search(all, (void *) 1, &hash_compare));
+  assert(q_splice(rest, all) && q_nodes(rest) == 180);  // shared pool
+  q_free(all);
+  q_free(rest);
+  q_free(c);
+
+  // Adopted and borrowed payloads are never copied
+  int freed = 0;
+  char *buf = (char *) malloc(4096);
+  memset(buf, 'a', 4096);
+  list_ele_t *own = pack_adopt(buf, 4096, (void *) 1, count_free, &freed);
+  list_ele_t *ref = pack_borrow(big, sizeof(big), (void *) 2);
+  assert(own->value == buf && own->owner == ELE_ADOPTED && !ele_inline(own));
+  assert(ref->value == big && ref->owner == ELE_BORROWED);
+  assert(!pack_adopt(buf, 1, NULL, NULL, NULL));
+  assert(!pack_borrow(big, ELE_SIZE_MAX + 1, NULL));
+  assert(!pack_adopt(buf, (size_t) 1 << 63, NULL, count_free, &freed));
+  unpack(NULL, ref);
+  unpack(NULL, own);
+  assert(freed == 1);
+  for (int flags = 0; flags <= (Q_POOLED | Q_DOUBLY); flags++) {
+    queue_t *aq = q_new_flags(flags);
+    for (intptr_t i = 0; i < 4; i++) {
+      void *mem = malloc(64);
+      assert(q_insert_tail(aq, q_adopt(aq, mem, 64, (void *) i, count_free,
+                                       &freed)));
+      assert(q_insert_tail(aq, q_borrow(aq, big, sizeof(big), (void *) i)));
+    }
+    assert(aq->adopted == 4 && q_size(aq) == 4 * (64 + sizeof(big)));
+    assert(q_remove_head(aq, true) && freed == 2 && aq->adopted == 3);
+    // A handle keeps a pooled element valid past its queue
+    ele_ptr h = q_take_head(aq);
+    assert(h && h->value == big && q_nodes(aq) == 6);
+    ele_ptr h2 = q_take_head(aq);
+    if (flags & Q_POOLED) {
+      queue_t *other = q_new_flags(flags);
+      assert(!q_insert_tail(other, std::move(h2)) && h2);
+      q_free(other);
+    }
+    assert(aq->adopted == 2);
+    assert(q_insert_tail(aq, std::move(h2)) && !h2 && q_nodes(aq) == 6);
+    assert(aq->tail->owner == ELE_ADOPTED && aq->adopted == 3);
+    // Round trips through a handle leave the count where it was
+    for (int i = 0; i < 6; i++) {
+      assert(q_insert_tail(aq, q_take_head(aq)));
+    }
+    assert(aq->adopted == 3 && q_nodes(aq) == 6);
+    q_free(aq);
+    assert(freed == 5 && h->value == big && h->payload_size == sizeof(big));
+    h.reset();
+    assert(!h);
+    freed = 1;
+  }
 }
 
 bool hash_compare(void *h1, void *h2) {
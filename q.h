@@ -2,22 +2,112 @@
  * This program implements a queue supporting both FIFO and LIFO
  * operations.
  *
- * It uses a singly-linked list to represent the set of queue elements
+ * It uses a singly-linked list to represent the set of queue elements.
+ * Queues created with Q_DOUBLY additionally keep a prev pointer in every
+ * element, making q_remove_tail, q_unlink and q_shuffle constant time.
  */
+#ifndef Q_H
+#define Q_H
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+#include "pool.h"
+#include "stats.h"
+
+/*
+ * Payloads of at most Q_INLINE_MAX bytes are stored inline, directly after
+ * the element header in the same allocation, so that a small element costs
+ * one allocation and (at the default) a single 64-byte cache line. value
+ * always points at the payload, wherever it lives.
+ */
+#ifndef Q_INLINE_MAX
+#define Q_INLINE_MAX 32
+#endif
 
 /************** Data structure declarations ****************/
 
+/* Who owns an element's payload, see pack_adopt() and pack_borrow() */
+#define ELE_COPY 0     /* A copy made by pack(), inline or alongside */
+#define ELE_ADOPTED 1  /* The caller's buffer, handed to a deleter on unpack */
+#define ELE_BORROWED 2 /* The caller's buffer, left alone on unpack */
+
+/* Largest payload an element can describe; pack*() refuse larger ones */
+#define ELE_SIZE_MAX (((size_t) 1 << 62) - 1)
+
 typedef struct ELE {
     void *value;
-    size_t payload_size;
+    size_t payload_size : 62;  /* At most ELE_SIZE_MAX */
+    size_t owner : 2;  /* ELE_* */
     void *hash;
     struct ELE *next;
 } list_ele_t;
 
+/*
+ * The owner tag borrows the top two bits of a 64-bit size_t; a 32-bit
+ * size_t would leave payload_size only 30 bits.
+ */
+static_assert(sizeof(size_t) == 8, "the element layout assumes 64-bit size_t");
+static_assert(sizeof(list_ele_t) == 4 * sizeof(void *),
+              "the owner tag must not widen the element header");
+
+/*
+ * Releases an adopted payload. Called with the arg given to pack_adopt().
+ */
+typedef void (*ele_deleter_fn)(void *arg, void *val, size_t size);
+
+/* ele_deleter_fn for payloads obtained from malloc() */
+void ele_free(void *arg, void *val, size_t size);
+
+/*
+ * True if ele's payload lives inline behind its header rather than in a
+ * separate allocation.
+ */
+static inline bool ele_inline(const list_ele_t *ele)
+{
+    return ele->value == (const void *) (ele + 1);
+}
+
+/*
+ * Element of a Q_DOUBLY queue. The queue operations still take and return
+ * list_ele_t pointers; prev is reached through ele_prev().
+ */
+typedef struct DELE {
+    list_ele_t ele;    /* Must come first */
+    list_ele_t *prev;
+} dlist_ele_t;
+
+static inline list_ele_t **ele_prev(list_ele_t *ele)
+{
+    return &((dlist_ele_t *) ele)->prev;
+}
+
+/* Flags for q_new_flags() */
+#define Q_POOLED 0x1 /* Allocate elements from a pool owned by the queue */
+#define Q_DOUBLY 0x2 /* Doubly-linked elements, see dlist_ele_t */
+
+/*
+ * Optional open-addressing (linear probing) index from hash to element,
+ * kept at most half full. Duplicate hashes are all indexed.
+ * Every slot also keeps a one-byte fingerprint of its element's hash, so
+ * that a probe only follows (and compares) elements whose fingerprint
+ * matches; keys behind pointers, such as strings, are then rarely
+ * dereferenced for a mismatch.
+ */
+typedef struct {
+    list_ele_t **slots;
+    uint8_t *tags;                       /* Q_TAG() of slots[i]'s hash */
+    size_t cap;                          /* Power of two */
+    size_t used;
+    uint64_t (*hash_fn)(void *hash);
+} q_index_t;
+
+/* Fingerprint of a 64-bit hash, from the bits the slot number does not use */
+#define Q_TAG(h) ((uint8_t) ((h) >> 56))
+
 /* Queue structure */
 typedef struct {
     list_ele_t *head;  /* Linked list of elements */
@@ -28,18 +118,113 @@ typedef struct {
     list_ele_t *tail;
     int nodes;
     size_t size;
+    pool_t *pool;      /* Owned node/payload allocator, NULL for malloc */
+    unsigned flags;    /* Q_* flags the queue was created with */
+    q_index_t *index;  /* Set by q_index(), NULL for linear q_search */
+    int adopted;       /* Upper bound on ELE_ADOPTED elements in q */
+    stats_counter_t search_stats;  /* q_search() costs, if DL_STATS */
 } queue_t;
 
+/* Snapshot filled in by q_stats() */
+typedef struct {
+    bool counted;          /* Built with DL_STATS; else search is all 0 */
+    int nodes;
+    size_t payload_bytes;  /* As q_size() */
+    size_t alloc_bytes;    /* Elements (or pool slabs) plus the index */
+    size_t index_slots;    /* 0 if not indexed */
+    stats_counts_t search; /* q_search() and q_search_batch() lookups */
+} q_stats_t;
+
 /************** Operations on queue ************************/
 
+/*
+  Copy size bytes of val into a new element with the given hash.
+  Payloads of at most Q_INLINE_MAX bytes share the element's allocation.
+  Return NULL if size exceeds ELE_SIZE_MAX or could not allocate space.
+ */
 list_ele_t *pack(void *val, size_t size, void *hash);
 
+/*
+  As pack(), but allocate the element and its payload from pool.
+  A NULL pool is equivalent to pack().
+ */
+list_ele_t *pack_in(pool_t *pool, void *val, size_t size, void *hash);
+
+/*
+  Wrap size bytes at val, without copying them, in a new element that
+  owns them from now on: unpacking the element calls del(arg, val, size).
+  Return NULL, leaving val to the caller, if size exceeds ELE_SIZE_MAX or
+  could not allocate space.
+ */
+list_ele_t *pack_adopt(void *val, size_t size, void *hash,
+                       ele_deleter_fn del, void *arg);
+
+/*
+  Wrap size bytes at val, without copying them, in a new element that only
+  references them. val must outlive the element.
+  Return NULL if size exceeds ELE_SIZE_MAX or could not allocate space.
+ */
+list_ele_t *pack_borrow(void *val, size_t size, void *hash);
+
+/*
+  Free an element and its payload, obtained from pack_in(pool, ...).
+  No effect if ele is NULL
+ */
+void unpack(pool_t *pool, list_ele_t *ele);
+
+/*
+  unpack() an element whose header is hdr bytes long, as q_ele_hdr()
+  reports for the queue that packed it.
+ */
+void unpack_as(pool_t *pool, size_t hdr, list_ele_t *ele);
+
 /*
   Create empty queue.
   Return NULL if could not allocate space.
 */
 queue_t *q_new();
 
+/*
+  Create empty queue owning a node pool. Elements inserted into it must
+  come from q_pack(), and are all released in bulk by q_free().
+  Return NULL if could not allocate space.
+*/
+queue_t *q_new_pooled();
+
+/*
+  Create empty queue with any combination of Q_* flags.
+  Elements inserted into a Q_POOLED or Q_DOUBLY queue must come from
+  q_pack() on that queue.
+  Return NULL if could not allocate space.
+*/
+queue_t *q_new_flags(unsigned flags);
+
+/*
+  pack() an element shaped for q, from q's pool if it has one.
+  Return NULL if q is NULL or could not allocate space.
+ */
+list_ele_t *q_pack(queue_t *q, void *val, size_t size, void *hash);
+
+/*
+  pack_adopt() and pack_borrow() for elements shaped for q. A pooled q
+  takes only the header from its pool.
+ */
+list_ele_t *q_adopt(queue_t *q, void *val, size_t size, void *hash,
+                    ele_deleter_fn del, void *arg);
+list_ele_t *q_borrow(queue_t *q, void *val, size_t size, void *hash);
+
+/*
+  Header size of q's elements: sizeof(dlist_ele_t) for Q_DOUBLY queues,
+  else sizeof(list_ele_t).
+ */
+size_t q_ele_hdr(const queue_t *q);
+
+/*
+  Free an element previously detached from q, e.g. with
+  q_remove_head(q, false).
+ */
+void q_release(queue_t *q, list_ele_t *ele);
+
 /*
   Free all storage used by queue.
   No effect if q is NULL
@@ -68,33 +253,495 @@ bool q_insert_tail(queue_t *q, list_ele_t *newTail);
 */
 bool q_remove_head(queue_t *q, bool free_after);
 
+/*
+  Attempt to remove element from tail of queue.
+  Constant time for Q_DOUBLY queues, linear otherwise.
+  Return true if successful.
+  Return false if queue is NULL or empty.
+*/
+bool q_remove_tail(queue_t *q, bool free_after);
+
+/*
+  Detach up to max elements from the head of q into out, in queue order,
+  updating head, tail and the counts once for the whole batch. The next
+  pointers of detached elements are stale; release them with q_release().
+  Return the number detached, 0 if q or out is NULL or q is empty.
+*/
+int q_remove_batch(queue_t *q, int max, list_ele_t **out);
+
+/*
+  Detach node from anywhere in q without freeing it.
+  Constant time for Q_DOUBLY queues, linear otherwise.
+  Return false if q is NULL or node is not in q. Unindexed Q_DOUBLY queues
+  cannot tell without a scan, so there the caller must ensure node is in
+  q; indexed ones check with one probe of the index.
+*/
+bool q_unlink(queue_t *q, list_ele_t *node);
+
 /*
   Return number of elements in queue.
   Return 0 if q is NULL or empty
  */
 int q_nodes(queue_t *q);
 
+/*
+  Return total payload bytes in queue.
+  Return 0 if q is NULL or empty
+ */
+size_t q_size(queue_t *q);
+
 /*
   Reverse elements in queue
   No effect if q is NULL or empty
  */
 void q_reverse(queue_t *q);
 
+/*
+  Build a hash index over q, using hash_fn (q_hash_int if NULL) to map
+  hash fields to 64-bit hashes. From then on every insert and remove keeps
+  the index up to date, and q_search is expected constant time.
+  Return false if q is NULL or could not allocate space.
+ */
+bool q_index(queue_t *q, uint64_t (*hash_fn)(void *hash));
+
+/*
+  Default q_index() hash function, for hash fields holding integers.
+ */
+uint64_t q_hash_int(void *hash);
+
+/*
+  q_index() hash function and q_search() comparison for hash fields
+  pointing at NUL-terminated strings.
+ */
+uint64_t q_hash_str(void *hash);
+bool q_str_equal(void *h1, void *h2);
+
 /*
  * Search the queue for a node with a hash field that matches hash,
- * using hash_compare(). 
+ * using hash_compare(). Unindexed queues return the match closest to the
+ * head; indexed queues return any match.
  */
 list_ele_t *q_search(queue_t *q, void *hash, 
   bool (*hash_compare)(void *h1, void *h2));
 
 
 /*
- * Scan through q for node's prev pointer, changing its next pointer 
- * to circumvent node. Then, reinsert node into the tail.
+ * Move node to the tail of q. Singly-linked queues scan for node's prev
+ * pointer, changing its next pointer to circumvent node; Q_DOUBLY queues
+ * do this in constant time, and node must then be in q as for q_unlink().
  */
 void q_shuffle(queue_t *q, list_ele_t *node);
 
+/*
+ * q_search() for n hashes at once, storing each result (or NULL) in out.
+ * Indexed queues overlap the probes of Q_BATCH_GROUP lookups so that their
+ * cache misses are serviced in parallel. Returns the number found.
+ */
+size_t q_search_batch(queue_t *q, void *const *hashes, size_t n,
+  list_ele_t **out, bool (*hash_compare)(void *h1, void *h2));
+
+/*
+  Move every element of src to the tail of dst, leaving src empty. The
+  queues must agree on Q_POOLED and Q_DOUBLY; a pooled src hands its
+  pool's memory over to dst (pool_merge()). Constant time, plus the
+  slabs and free blocks of a pooled src, plus one index insert per moved
+  element if dst is indexed.
+  Return false, changing nothing, if either queue is NULL, they are the
+  same queue, their flags differ, dst's index could not grow, or src's
+  pool is shared with a third queue.
+ */
+bool q_splice(queue_t *dst, queue_t *src);
+
+/*
+  Keep the first n elements in q and move the rest, in order, into a new
+  queue with q's flags. A pooled q shares its pool with the new queue,
+  so the two must not be used concurrently; an indexed q indexes both.
+  Linear in n.
+  Return NULL if q is NULL, n is negative or could not allocate space.
+ */
+queue_t *q_split(queue_t *q, int n);
+
+/*
+  Sort q by hash with the three-way comparator cmp (as for sl_compare()),
+  keeping equal elements in their original order. Elements are relinked,
+  never allocated or copied. O(n log n).
+  No effect if q is NULL or empty
+ */
+void q_sort(queue_t *q, int (*cmp)(void *h1, void *h2));
+
 bool hash_compare(void *h1, void *h2);
 
+/*
+  Fill out with q's current footprint and, with DL_STATS, its search
+  counters since creation or the last q_stats_reset().
+  Return false if q is NULL.
+ */
+bool q_stats(queue_t *q, q_stats_t *out);
+
+void q_stats_reset(queue_t *q);
+
+/*
+  Write a q_stats() snapshot to f as one JSON object per line.
+ */
+void q_stats_print(FILE *f, const char *name, const q_stats_t *st);
+
 void q_print(queue_t *q);
 
+/************** Typed interface ****************************/
+
+/*
+ * Keys live in the hash field of an element, so a key type K is any integer
+ * or pointer type no wider than a pointer.
+ */
+template <typename K>
+static inline K key_from_hash(void *hash)
+{
+    static_assert(sizeof(K) <= sizeof(void *), "key must fit in hash");
+    return (K) (uintptr_t) hash;
+}
+
+template <typename K>
+static inline void *key_to_hash(K key)
+{
+    static_assert(sizeof(K) <= sizeof(void *), "key must fit in hash");
+    return (void *) (uintptr_t) key;
+}
+
+/* Default queue comparator: plain equality on K */
+template <typename K>
+struct q_key_equal {
+    bool operator()(K k1, K k2) const { return k1 == k2; }
+};
+
+/* Adapts a C-style hash_compare callback to the comparator interface */
+struct q_fn_equal {
+    bool (*fn)(void *h1, void *h2);
+    explicit q_fn_equal(bool (*f)(void *h1, void *h2)) : fn(f) {}
+    bool operator()(void *h1, void *h2) const { return fn(h1, h2); }
+};
+
+/* Adapts a C-style three-way callback to the comparator interface */
+struct q_fn_three_way {
+    int (*fn)(void *h1, void *h2);
+    explicit q_fn_three_way(int (*f)(void *h1, void *h2)) : fn(f) {}
+    int operator()(void *h1, void *h2) const { return fn(h1, h2); }
+};
+
+/*
+ * q_search() with the comparator as a template parameter, so that it can be
+ * inlined into the scan. q_search() itself is the q_fn_equal instantiation.
+ */
+template <typename K, typename Compare>
+list_ele_t *q_search_t(queue_t *q, K key, Compare cmp)
+{
+    if (q==NULL) return NULL;
+    stats_counter_t *st = &q->search_stats;
+    STAT_ADD(st, calls, 1);
+    if (q->index!=NULL)
+    {
+      q_index_t *idx = q->index;
+      size_t mask = idx->cap - 1;
+      uint64_t h = idx->hash_fn(key_to_hash(key));
+      uint8_t tag = Q_TAG(h);
+      for (size_t i = h & mask; idx->slots[i] != NULL; i = (i + 1) & mask)
+      {
+        STAT_ADD(st, visited, 1);
+        if (idx->tags[i] != tag) continue;
+        STAT_ADD(st, compares, 1);
+        if (cmp(key, key_from_hash<K>(idx->slots[i]->hash)))
+          return idx->slots[i];
+      }
+      return NULL;
+    }
+    for (list_ele_t *pt = q->head; pt != NULL; pt = pt->next)
+    {
+      STAT_ADD(st, compares, 1);
+      STAT_ADD(st, visited, 1);
+      if (cmp(key, key_from_hash<K>(pt->hash))) return pt;
+    }
+    return NULL;
+}
+
+#define Q_BATCH_GROUP 16 // lookups in flight in q_search_batch_t()
+
+/*
+ * q_search_batch() with the comparator as a template parameter. For each
+ * group of keys, first prefetch every home slot, then every element those
+ * slots point at, and only then probe, by which time most of the lines
+ * should have arrived. Probe runs are short at the index's load factor,
+ * so prefetching the home slot and its element covers most of the misses.
+ * Unindexed queues gain nothing from this and are scanned key by key.
+ */
+template <typename K, typename Compare>
+size_t q_search_batch_t(queue_t *q, const K *keys, size_t n,
+                        list_ele_t **out, Compare cmp)
+{
+    size_t found = 0;
+    if (q==NULL || q->index==NULL)
+    {
+      for (size_t j = 0; j < n; j++)
+        found += (out[j] = q_search_t(q, keys[j], cmp)) != NULL;
+      return found;
+    }
+    q_index_t *idx = q->index;
+    size_t mask = idx->cap - 1;
+    size_t home[Q_BATCH_GROUP];
+    uint8_t tags[Q_BATCH_GROUP];
+    stats_counter_t *st = &q->search_stats;
+    STAT_ADD(st, calls, n);
+    for (size_t base = 0; base < n; base += Q_BATCH_GROUP)
+    {
+      size_t m = (n - base < Q_BATCH_GROUP) ? n - base : Q_BATCH_GROUP;
+      for (size_t j = 0; j < m; j++)
+      {
+        uint64_t h = idx->hash_fn(key_to_hash(keys[base + j]));
+        home[j] = h & mask;
+        tags[j] = Q_TAG(h);
+        __builtin_prefetch(&idx->slots[home[j]]);
+        __builtin_prefetch(&idx->tags[home[j]]);
+      }
+      for (size_t j = 0; j < m; j++)
+        if (idx->slots[home[j]] != NULL && idx->tags[home[j]] == tags[j])
+          __builtin_prefetch(idx->slots[home[j]]);
+      for (size_t j = 0; j < m; j++)
+      {
+        list_ele_t *hit = NULL;
+        for (size_t i = home[j]; idx->slots[i] != NULL; i = (i + 1) & mask)
+        {
+          STAT_ADD(st, visited, 1);
+          if (idx->tags[i] != tags[j]) continue;
+          STAT_ADD(st, compares, 1);
+          if (cmp(keys[base + j], key_from_hash<K>(idx->slots[i]->hash)))
+          {
+            hit = idx->slots[i];
+            break;
+          }
+        }
+        out[base + j] = hit;
+        found += hit != NULL;
+      }
+    }
+    return found;
+}
+
+/*
+ * Merge sorted lists a and b, taking from a on ties.
+ */
+template <typename K, typename Compare>
+list_ele_t *q_merge_t(list_ele_t *a, list_ele_t *b, Compare &cmp)
+{
+    list_ele_t *head = NULL;
+    list_ele_t **link = &head;
+    while (a != NULL && b != NULL)
+    {
+      if (0 >= cmp(key_from_hash<K>(a->hash), key_from_hash<K>(b->hash)))
+      {
+        *link = a;
+        a = a->next;
+      }
+      else
+      {
+        *link = b;
+        b = b->next;
+      }
+      link = &(*link)->next;
+    }
+    *link = (a != NULL) ? a : b;
+    return head;
+}
+
+#define Q_SORT_BINS 64 // sorts up to 2^64 elements
+
+/*
+ * q_sort() with a three-way comparator on K as a template parameter.
+ * Bottom-up merge sort in one pass over the list: bins[i] holds a sorted
+ * run of 2^i elements, and each element taken off the list is carried
+ * up through the occupied bins like a binary counter. Runs in lower bins
+ * are always the more recent, so merging bins[i] in as the left-hand run
+ * keeps the sort stable.
+ */
+template <typename K, typename Compare>
+void q_sort_t(queue_t *q, Compare cmp)
+{
+    if (q==NULL || q->head==NULL) return;
+    list_ele_t *bins[Q_SORT_BINS] = {NULL};
+    list_ele_t *pt = q->head;
+    while (pt != NULL)
+    {
+      list_ele_t *run = pt;
+      pt = pt->next;
+      run->next = NULL;
+      int i = 0;
+      for (; i < Q_SORT_BINS - 1 && bins[i] != NULL; i++)
+      {
+        run = q_merge_t<K>(bins[i], run, cmp);
+        bins[i] = NULL;
+      }
+      bins[i] = (bins[i] != NULL) ? q_merge_t<K>(bins[i], run, cmp) : run;
+    }
+    list_ele_t *sorted = NULL;
+    for (int i = 0; i < Q_SORT_BINS; i++)
+      if (bins[i] != NULL)
+        sorted = (sorted != NULL) ? q_merge_t<K>(bins[i], sorted, cmp)
+                                  : bins[i];
+    q->head = sorted;
+    list_ele_t *prev = NULL;
+    for (pt = sorted; pt != NULL; pt = pt->next)
+    {
+      if (q->flags & Q_DOUBLY) *ele_prev(pt) = prev;
+      prev = pt;
+    }
+    q->tail = prev;
+}
+
+/*
+ * Move-only owner of one detached element. An element taken from a pooled
+ * queue holds a reference to that queue's pool (pool_share()), so that it
+ * outlives the queue; the element is released when the handle is reset or
+ * destroyed. Handles move into queues of the same shape and pool with
+ * q_insert_tail() and into skip lists with sl_insert() without the
+ * element being repacked.
+ */
+class ele_ptr {
+  public:
+    ele_ptr() : ele(NULL), pool(NULL), hdr(sizeof(list_ele_t)) {}
+    /* Own an element from pack(), pack_adopt() or pack_borrow() */
+    explicit ele_ptr(list_ele_t *ele)
+      : ele(ele), pool(NULL), hdr(sizeof(list_ele_t)) {}
+    /* Own an element packed for q and no longer in it */
+    ele_ptr(queue_t *q, list_ele_t *ele)
+      : ele(ele), pool(ele ? pool_share(q->pool) : NULL), hdr(q_ele_hdr(q)) {}
+    ~ele_ptr() { reset(); }
+    ele_ptr(ele_ptr &&o) : ele(o.ele), pool(o.pool), hdr(o.hdr) {
+      o.ele = NULL;
+      o.pool = NULL;
+    }
+    ele_ptr &operator=(ele_ptr &&o) {
+      if (this != &o) {
+        reset();
+        ele = o.ele;
+        pool = o.pool;
+        hdr = o.hdr;
+        o.ele = NULL;
+        o.pool = NULL;
+      }
+      return *this;
+    }
+    ele_ptr(const ele_ptr &) = delete;
+    ele_ptr &operator=(const ele_ptr &) = delete;
+
+    list_ele_t *get() const { return ele; }
+    list_ele_t *operator->() const { return ele; }
+    explicit operator bool() const { return ele != NULL; }
+    /* The pool the element came from (referenced), NULL for malloc */
+    pool_t *source() const { return pool; }
+    /* The element's header size, for unpack_as() */
+    size_t header() const { return hdr; }
+    void reset() {
+      unpack_as(pool, hdr, ele);
+      pool_free(pool);
+      ele = NULL;
+      pool = NULL;
+    }
+    /*
+     * Hand the element and the pool reference to the caller, who is to
+     * unpack_as(source(), header(), ele) and pool_free(source()) later.
+     */
+    list_ele_t *release() {
+      list_ele_t *out = ele;
+      ele = NULL;
+      pool = NULL;
+      return out;
+    }
+  private:
+    list_ele_t *ele;
+    pool_t *pool;
+    size_t hdr;
+};
+
+/*
+ * Detach the head of q into a handle; empty if q is NULL or empty.
+ */
+static inline ele_ptr q_take_head(queue_t *q)
+{
+    if (q==NULL || q->head==NULL) return ele_ptr();
+    list_ele_t *ele = q->head;
+    q_remove_head(q, false);
+    if (ele->owner == ELE_ADOPTED && q->adopted > 0) q->adopted--;
+    return ele_ptr(q, ele);
+}
+
+/*
+ * Insert the element held by ele at the tail of q, emptying ele.
+ * Return false, leaving ele as it was, if q is NULL, ele is empty or its
+ * element was not packed from q's pool in q's shape.
+ */
+static inline bool q_insert_tail(queue_t *q, ele_ptr &&ele)
+{
+    if (q==NULL || !ele || ele.source() != q->pool ||
+        ele.header() != q_ele_hdr(q))
+      return false;
+    if (!q_insert_tail(q, ele.get())) return false;
+    if (ele->owner == ELE_ADOPTED) q->adopted++;
+    pool_t *pool = ele.source();
+    ele.release();
+    pool_free(pool);
+    return true;
+}
+
+/*
+ * Owning, typed wrapper around a queue_t. Payloads are copies of a V, which
+ * must be trivially copyable; Compare is an equality functor on K.
+ */
+template <typename K, typename V, typename Compare = q_key_equal<K> >
+class queue {
+  public:
+    queue_t *q;  /* NULL if construction could not allocate space */
+    explicit queue(unsigned flags = Q_POOLED) : q(q_new_flags(flags)) {}
+    ~queue() { q_free(q); }
+    queue(const queue &) = delete;
+    queue &operator=(const queue &) = delete;
+
+    bool insert_head(K key, const V &val) {
+      list_ele_t *ele = pack_val(key, val);
+      if (q_insert_head(q, ele)) return true;
+      q_release(q, ele);
+      return false;
+    }
+    bool insert_tail(K key, const V &val) {
+      list_ele_t *ele = pack_val(key, val);
+      if (q_insert_tail(q, ele)) return true;
+      q_release(q, ele);
+      return false;
+    }
+    bool remove_head() { return q_remove_head(q, true); }
+    ele_ptr take_head() { return q_take_head(q); }
+    bool insert_tail(ele_ptr &&ele) { return q_insert_tail(q, std::move(ele)); }
+    list_ele_t *search(K key) { return q_search_t(q, key, Compare()); }
+    size_t search_batch(const K *keys, size_t n, list_ele_t **out) {
+      return q_search_batch_t(q, keys, n, out, Compare());
+    }
+    void shuffle(list_ele_t *ele) { q_shuffle(q, ele); }
+    void reverse() { q_reverse(q); }
+    /* Sort by key with a three-way comparator on K */
+    template <typename Order>
+    void sort(Order order) { q_sort_t<K>(q, order); }
+    bool splice(queue &src) { return q_splice(q, src.q); }
+    bool index(uint64_t (*hash_fn)(void *hash) = NULL) {
+      return q_index(q, hash_fn);
+    }
+    int nodes() { return q_nodes(q); }
+    bool stats(q_stats_t *out) { return q_stats(q, out); }
+
+    static K key(const list_ele_t *ele) { return key_from_hash<K>(ele->hash); }
+    static V *value(list_ele_t *ele) { return (V *) ele->value; }
+  private:
+    list_ele_t *pack_val(K key, const V &val) {
+      static_assert(std::is_trivially_copyable<V>::value,
+                    "payloads are copied bytewise");
+      return q_pack(q, (void *) &val, sizeof(V), key_to_hash(key));
+    }
+};
+
+#endif
+
@@ -0,0 +1,232 @@
+/*
+ * Implements the worker threads behind sharded_skip_list.
+ *
+ * The list itself is the sharded_skip_list template in shard.h.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "shard.h"
+
+static void *shard_main(void *arg) {
+  shard_worker_t *w = (shard_worker_t *) arg;
+  if (w->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->fn == NULL && !w->stop) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (w->fn == NULL) break;
+    void (*fn)(void *) = w->fn;
+    pthread_mutex_unlock(&w->lock);
+    fn(w->arg);
+    pthread_mutex_lock(&w->lock);
+    w->fn = NULL;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+bool shard_workers_start(shard_worker_t *w, int n, bool pin) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) cpus = 1;
+  for (int i = 0; i < n; i++) {
+    pthread_mutex_init(&w[i].lock, NULL);
+    pthread_cond_init(&w[i].cond, NULL);
+    w[i].fn = NULL;
+    w[i].arg = NULL;
+    w[i].stop = false;
+    w[i].cpu = pin ? (int) (i % cpus) : -1;
+    if (pthread_create(&w[i].thread, NULL, shard_main, &w[i]) != 0) {
+      pthread_cond_destroy(&w[i].cond);
+      pthread_mutex_destroy(&w[i].lock);
+      shard_workers_stop(w, i);
+      return false;
+    }
+  }
+  return true;
+}
+
+void shard_workers_stop(shard_worker_t *w, int n) {
+  for (int i = 0; i < n; i++) {
+    pthread_mutex_lock(&w[i].lock);
+    w[i].stop = true;
+    pthread_cond_broadcast(&w[i].cond);
+    pthread_mutex_unlock(&w[i].lock);
+  }
+  for (int i = 0; i < n; i++) {
+    pthread_join(w[i].thread, NULL);
+    pthread_cond_destroy(&w[i].cond);
+    pthread_mutex_destroy(&w[i].lock);
+  }
+}
+
+void shard_post(shard_worker_t *w, void (*fn)(void *arg), void *arg) {
+  pthread_mutex_lock(&w->lock);
+  assert(w->fn == NULL);
+  w->arg = arg;
+  w->fn = fn;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+void shard_wait(shard_worker_t *w) {
+  pthread_mutex_lock(&w->lock);
+  while (w->fn != NULL) {
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+  pthread_mutex_unlock(&w->lock);
+}
+
+typedef basic_skip_list<int64_t, int64_t, sl_three_way<int64_t>, 32> isl_t;
+typedef sharded_skip_list<int64_t, int64_t, sl_three_way<int64_t>, 32> ssl_t;
+
+#define SHARD_THREADS 4
+#define SHARD_SCANNERS 2
+
+typedef struct {
+    ssl_t *sl;
+    int64_t base;
+    pthread_barrier_t *phase;   /* Scans end before any deletes start */
+} shard_arg_t;
+
+/* Insert 1000 keys of its own, then delete every third again */
+static void *shard_writer(void *p) {
+  shard_arg_t *arg = (shard_arg_t *) p;
+  for (int64_t k = arg->base; k < arg->base + 1000; k++) {
+    assert(arg->sl->insert(k, -k));
+  }
+  pthread_barrier_wait(arg->phase);
+  for (int64_t k = arg->base; k < arg->base + 1000; k += 3) {
+    assert(arg->sl->sl_delete_key(k));
+  }
+  return NULL;
+}
+
+/* Ranges stay sorted while the writers insert */
+static void *shard_scanner(void *p) {
+  shard_arg_t *arg = (shard_arg_t *) p;
+  sl_node<int64_t> *run[256];
+  for (int i = 0; i < 200; i++) {
+    size_t n = arg->sl->sl_range(0, 4000, run, 256);
+    for (size_t j = 1; j < n; j++) {
+      assert(run[j - 1]->hash < run[j]->hash);
+    }
+  }
+  pthread_barrier_wait(arg->phase);
+  return NULL;
+}
+
+void test_shard() {
+  // Range partitioned: shard i holds [250 i, 250 (i + 1))
+  int64_t splits[3] = {250, 500, 750};
+  ssl_t rsl(4, splits);
+  assert(rsl.shards() == 4 && rsl.shard_of(-1) == 0 && rsl.shard_of(250) == 1);
+  assert(rsl.shard_of(749) == 2 && rsl.shard_of(1 << 20) == 3);
+  for (int64_t i = 0; i < 1000; i++) {
+    int64_t k = (i * 389) % 1000;
+    assert(rsl.insert(k, 2 * k));
+  }
+  assert(rsl.sl_count() == 1000);
+  for (int i = 0; i < 4; i++) {
+    assert(rsl.shard(i)->sl_count() == 250);
+  }
+  for (int64_t k = 0; k < 1000; k++) {
+    sl_node<int64_t> *hit = rsl.sl_search(k);
+    assert(hit && *isl_t::value(hit) == 2 * k);
+  }
+  assert(!rsl.sl_search(1000));
+  sl_node<int64_t> *run[1000];
+  assert(rsl.sl_range(100, 900, run, 1000) == 800);
+  for (int64_t j = 0; j < 800; j++) {
+    assert(run[j]->hash == 100 + j);
+  }
+  assert(rsl.sl_range(240, 760, run, 10) == 10 && run[9]->hash == 249);
+  assert(rsl.sl_range(600, 600, run, 10) == 0);
+  for (int64_t k = 0; k < 1000; k += 2) {
+    assert(rsl.sl_delete_key(k) && !rsl.sl_delete_key(k));
+  }
+  assert(rsl.sl_range(-100, 2000, run, 1000) == 500);
+  for (int64_t j = 0; j < 500; j++) {
+    assert(run[j]->hash == 2 * j + 1);
+  }
+
+  // Hash partitioned and pinned: every shard contributes to a range
+  ssl_t hsl(3, NULL, true, 16, 0.5f);
+  for (int64_t k = 2999; k >= 0; k--) {
+    assert(hsl.insert(k, k));
+  }
+  for (int i = 0; i < 3; i++) {
+    assert(hsl.shard(i)->sl_count() > 800);
+    pool_t *pool = hsl.shard(i)->sl_pool();
+    assert(pool->numa == POOL_NUMA_LOCAL && pool->slabs->mapped > 0);
+    assert(rsl.shard(i)->sl_pool()->numa == POOL_NUMA_NONE);
+  }
+  sl_node<int64_t> *all[3000];
+  assert(hsl.sl_range(-5, 3005, all, 3000) == 3000);
+  for (int64_t j = 0; j < 3000; j++) {
+    assert(all[j]->hash == j);
+  }
+  assert(hsl.sl_range(1000, 2000, all, 7) == 7 && all[6]->hash == 1006);
+
+  // Compatibility keys and elements
+  sharded_skip_list<void *, char, sl_extern_compare, SL_DEFAULT_LEVELS> vsl(2);
+  char val[16] = "shard payload";
+  list_ele_t *ele = pack(val, sizeof(val), (void *) 42);
+  assert(vsl.sl_insert(ele) && vsl.sl_search((void *) 42));
+  assert(0 == strcmp((char *) vsl.sl_search((void *) 42)->value, val));
+  assert(vsl.sl_delete(ele) && !vsl.sl_search((void *) 42));
+  unpack(NULL, ele);
+
+  // String keys go to the shard of their content, not of their address
+  typedef sharded_skip_list<sl_str_key, char, sl_str_compare, 16> strsl_t;
+  strsl_t ssl(4);
+  const char *words[] = {"alpha", "bravo", "charlie, longer", "delta", "echo"};
+  for (int i = 0; i < 5; i++) {
+    assert(ssl.insert(sl_str(words[i]), (char) ('a' + i)));
+  }
+  char copy[32];
+  for (int i = 0; i < 5; i++) {
+    strcpy(copy, words[i]);
+    sl_node<sl_str_key> *hit = ssl.sl_search(sl_str(copy));
+    assert(hit && *strsl_t::list_t::value(hit) == 'a' + i);
+    assert(ssl.shard_of(sl_str(copy)) == ssl.shard_of(sl_str(words[i])));
+  }
+  strcpy(copy, "delta");
+  assert(ssl.sl_delete_key(sl_str(copy)) && !ssl.sl_search(sl_str(words[3])));
+
+  // Concurrent writers on disjoint keys, with scans running alongside
+  ssl_t csl(4, NULL, false, 16, 0.5f);
+  const int nthreads = SHARD_THREADS + SHARD_SCANNERS;
+  pthread_t threads[nthreads];
+  shard_arg_t args[nthreads];
+  pthread_barrier_t phase;
+  pthread_barrier_init(&phase, NULL, nthreads);
+  for (int t = 0; t < nthreads; t++) {
+    args[t].sl = &csl;
+    args[t].base = 1000 * t;
+    args[t].phase = &phase;
+    assert(0 == pthread_create(&threads[t], NULL,
+                               t < SHARD_THREADS ? shard_writer : shard_scanner,
+                               &args[t]));
+  }
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  pthread_barrier_destroy(&phase);
+  assert(csl.sl_count() == SHARD_THREADS * 666);
+  for (int64_t k = 0; k < 1000 * SHARD_THREADS; k++) {
+    assert(!csl.sl_search(k) == (k % 1000 % 3 == 0));
+  }
+}
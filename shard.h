@@ -0,0 +1,282 @@
+/*
+ * Implements a skip list partitioned over several independent shards.
+ *
+ * Interface notes:
+ * -sharded_skip_list takes the same parameters as basic_skip_list and
+ *   holds one basic_skip_list per shard, each behind its own mutex, so
+ *   that threads working on different shards never contend. Keys are
+ *   assigned to shards either by range, given shards - 1 ascending split
+ *   keys, or by sl_key_hash() of the key, which hashes string keys by
+ *   content.
+ * -Point operations (sl_insert, insert, sl_search, sl_delete(_key)) lock
+ *   and run on the owning shard in the calling thread.
+ * -Every shard has a worker thread, optionally pinned to its own CPU.
+ *   sl_range() hands each involved shard's part of the scan to its worker,
+ *   so that the shards are traversed in parallel, then merges the sorted
+ *   runs in key order. Range-partitioned lists only involve the shards
+ *   overlapping [lo, hi). If the workers could not be started, scans run
+ *   shard by shard in the calling thread instead.
+ * -Any number of threads may call sl_range() at once. Since each worker
+ *   runs one task at a time, scans that use the workers take turns on a
+ *   scan mutex while their parts are posted and collected; merging runs
+ *   outside it.
+ * -Pinned workers place their shard's node pool on their own NUMA node
+ *   (POOL_NUMA_LOCAL, set from the worker), so that scans run next to
+ *   the memory they walk.
+ * -Nodes returned by sl_search and sl_range stay valid until they are
+ *   deleted, as with basic_skip_list.
+ */
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "skip.h"
+
+#define SHARD_MAX 64 // at most this many shards
+
+/************** Worker threads *****************************/
+
+/* A thread running one posted task at a time */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    void (*fn)(void *arg);  /* Posted task, NULL once it has run */
+    void *arg;
+    bool stop;
+    int cpu;                /* CPU to pin to, -1 for none */
+} shard_worker_t;
+
+/*
+  Start n workers, pinning worker i to CPU i (modulo the CPU count) if pin
+  is set. Pinning is best effort.
+  Return false, with no workers running, if a thread could not be started.
+ */
+bool shard_workers_start(shard_worker_t *w, int n, bool pin);
+
+/*
+  Stop and join n workers started by shard_workers_start().
+ */
+void shard_workers_stop(shard_worker_t *w, int n);
+
+/*
+  Have w call fn(arg). w must be idle, i.e. waited for since the last post.
+ */
+void shard_post(shard_worker_t *w, void (*fn)(void *arg), void *arg);
+
+/*
+  Wait until the task last posted to w has run.
+ */
+void shard_wait(shard_worker_t *w);
+
+/************** Sharded skip list **************************/
+
+template <typename K, typename V, typename Compare, int MaxLevel>
+class sharded_skip_list {
+  public:
+    typedef basic_skip_list<K, V, Compare, MaxLevel> list_t;
+    typedef typename list_t::node_t node_t;
+
+    /*
+     * With splits, shard i holds splits[i - 1] <= key < splits[i]; without,
+     * keys are spread by hash. The remaining parameters are passed to every
+     * shard's list.
+     */
+    explicit sharded_skip_list(int shards, const K *splits = NULL,
+                               bool pin = false, int max_levels = MaxLevel,
+                               float p = SL_DEFAULT_P, bool grow = true)
+      : nshards(shards), by_range(splits != NULL) {
+      assert(1 <= shards && shards <= SHARD_MAX);
+      for (int i = 0; i < nshards; i++) {
+        lists[i] = new list_t(max_levels, p, grow);
+        pthread_mutex_init(&locks[i], NULL);
+        if (by_range && i + 1 < nshards) {
+          assert(i == 0 || 0 > Compare()(splits[i - 1], splits[i]));
+          this->splits[i] = splits[i];
+        }
+      }
+      pthread_mutex_init(&scan_lock, NULL);
+      workers_ok = shard_workers_start(workers, nshards, pin);
+      for (int i = 0; pin && workers_ok && i < nshards; i++) {
+        shard_post(&workers[i], place_pool, lists[i]->sl_pool());
+        shard_wait(&workers[i]);
+      }
+    }
+    ~sharded_skip_list() {
+      if (workers_ok) shard_workers_stop(workers, nshards);
+      pthread_mutex_destroy(&scan_lock);
+      for (int i = 0; i < nshards; i++) {
+        pthread_mutex_destroy(&locks[i]);
+        delete lists[i];
+      }
+    }
+    sharded_skip_list(const sharded_skip_list &) = delete;
+    sharded_skip_list &operator=(const sharded_skip_list &) = delete;
+
+    /* Index of the shard owning key */
+    int shard_of(K key) const {
+      if (!by_range) {
+        return (int) (sl_key_hash(key) % (uint64_t) nshards);
+      }
+      int lo = 0, hi = nshards - 1;  // first split above key, else the last
+      while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (0 > Compare()(key, splits[mid])) hi = mid;
+        else lo = mid + 1;
+      }
+      return lo;
+    }
+    int shards() const { return nshards; }
+    /* A shard's list; only safe to use while no other thread is */
+    list_t *shard(int i) { return lists[i]; }
+
+    bool sl_insert(list_ele_t *node) {
+      int s = shard_of(key_from_hash<K>(node->hash));
+      pthread_mutex_lock(&locks[s]);
+      bool ok = lists[s]->sl_insert(node);
+      pthread_mutex_unlock(&locks[s]);
+      return ok;
+    }
+    bool insert(K key, const V &val) {
+      int s = shard_of(key);
+      pthread_mutex_lock(&locks[s]);
+      bool ok = lists[s]->insert(key, val);
+      pthread_mutex_unlock(&locks[s]);
+      return ok;
+    }
+    node_t *sl_search(K key) {
+      int s = shard_of(key);
+      pthread_mutex_lock(&locks[s]);
+      node_t *hit = lists[s]->sl_search(key);
+      pthread_mutex_unlock(&locks[s]);
+      return hit;
+    }
+    bool sl_delete(list_ele_t *node) {
+      if (node == NULL) return false;
+      return sl_delete_key(key_from_hash<K>(node->hash));
+    }
+    bool sl_delete_key(K key) {
+      int s = shard_of(key);
+      pthread_mutex_lock(&locks[s]);
+      bool ok = lists[s]->sl_delete_key(key);
+      pthread_mutex_unlock(&locks[s]);
+      return ok;
+    }
+    size_t sl_count() {
+      size_t n = 0;
+      for (int i = 0; i < nshards; i++) {
+        pthread_mutex_lock(&locks[i]);
+        n += lists[i]->sl_count();
+        pthread_mutex_unlock(&locks[i]);
+      }
+      return n;
+    }
+    size_t sl_range(K lo, K hi, node_t **out, size_t max);
+  private:
+    int nshards;
+    bool by_range;
+    bool workers_ok;
+    K splits[SHARD_MAX - 1];
+    list_t *lists[SHARD_MAX];
+    pthread_mutex_t locks[SHARD_MAX];
+    pthread_mutex_t scan_lock;  // held while a scan owns the workers
+    shard_worker_t workers[SHARD_MAX];
+
+    /* One shard's part of an sl_range() */
+    struct scan_t {
+      sharded_skip_list *owner;
+      int shard;
+      K lo, hi;
+      node_t **run;
+      size_t max;
+      size_t n;  // nodes stored in run
+      size_t at; // merge position
+    };
+    static void scan_shard(void *arg) {
+      scan_t *sc = (scan_t *) arg;
+      pthread_mutex_t *lock = &sc->owner->locks[sc->shard];
+      pthread_mutex_lock(lock);
+      sc->n = sc->owner->lists[sc->shard]->sl_range(sc->lo, sc->hi, sc->run,
+                                                      sc->max);
+      pthread_mutex_unlock(lock);
+      sc->at = 0;
+    }
+    static void place_pool(void *pool) {
+      pool_set_numa((pool_t *) pool, POOL_NUMA_LOCAL, 0);
+    }
+    static bool scan_less(const scan_t *a, const scan_t *b) {
+      return 0 > Compare()(a->run[a->at]->hash, b->run[b->at]->hash);
+    }
+    static void heap_down(scan_t **heap, size_t n, size_t i);
+};
+
+template <typename K, typename V, typename C, int L>
+void sharded_skip_list<K, V, C, L>::heap_down(scan_t **heap, size_t n,
+                                              size_t i) {
+  for (;;) {
+    size_t least = i, l = 2 * i + 1, r = l + 1;
+    if (l < n && scan_less(heap[l], heap[least])) least = l;
+    if (r < n && scan_less(heap[r], heap[least])) least = r;
+    if (least == i) return;
+    scan_t *tmp = heap[i];
+    heap[i] = heap[least];
+    heap[least] = tmp;
+    i = least;
+  }
+}
+
+/*
+ * Store up to max nodes with lo <= hash < hi in out, in key order, and
+ * return how many were stored. Each involved shard collects up to max
+ * nodes of its own on its worker; the runs are then merged through a
+ * min-heap of their heads. Returns 0 if the scratch runs could not be
+ * allocated. Concurrent callers queue on scan_lock for the workers.
+ */
+template <typename K, typename V, typename C, int L>
+size_t sharded_skip_list<K, V, C, L>::sl_range(K lo, K hi, node_t **out,
+                                               size_t max) {
+  if (max == 0 || 0 <= C()(lo, hi)) return 0;
+  int first = by_range ? shard_of(lo) : 0;
+  int last = by_range ? shard_of(hi) : nshards - 1;
+  int k = last - first + 1;
+  if (max > SIZE_MAX / sizeof(node_t *) / k) return 0;
+  scan_t scans[SHARD_MAX];
+  node_t **runs = (node_t **) malloc(k * max * sizeof(node_t *));
+  if (runs == NULL) return 0;
+  if (workers_ok) pthread_mutex_lock(&scan_lock);
+  for (int j = 0; j < k; j++) {
+    scan_t *sc = &scans[j];
+    sc->owner = this;
+    sc->shard = first + j;
+    sc->lo = lo;
+    sc->hi = hi;
+    sc->run = runs + j * max;
+    sc->max = max;
+    if (workers_ok) shard_post(&workers[sc->shard], scan_shard, sc);
+    else scan_shard(sc);
+  }
+  scan_t *heap[SHARD_MAX];
+  size_t live = 0;
+  for (int j = 0; j < k; j++) {
+    if (workers_ok) shard_wait(&workers[scans[j].shard]);
+    if (scans[j].n > 0) heap[live++] = &scans[j];
+  }
+  if (workers_ok) pthread_mutex_unlock(&scan_lock);
+  for (size_t i = live / 2; i-- > 0; ) {
+    heap_down(heap, live, i);
+  }
+  size_t n = 0;
+  while (n < max && live > 0) {
+    scan_t *top = heap[0];
+    out[n++] = top->run[top->at++];
+    if (top->at == top->n) heap[0] = heap[--live];
+    heap_down(heap, live, 0);
+  }
+  free(runs);
+  return n;
+}
+
+#endif
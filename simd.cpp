@@ -0,0 +1,198 @@
+/*
+ * This program implements vectorized scans over arrays of 64-bit keys.
+ *
+ * See simd.h for the dispatch scheme.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "simd.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Keys are read with memcpy() so that callers may pass arrays of other
+ * 64-bit types, such as the void * hashes of a chunk.
+ */
+static inline uint64_t load_u64(const void *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static size_t find_eq_scalar(const uint64_t *keys, size_t n, uint64_t key)
+{
+  for (size_t i = 0; i < n; i++)
+    if (load_u64(keys + i) == key) return i;
+  return n;
+}
+
+static size_t find_ge_scalar(const int64_t *keys, size_t n, int64_t key)
+{
+  for (size_t i = 0; i < n; i++)
+    if ((int64_t) load_u64(keys + i) >= key) return i;
+  return n;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * Two 4-lane compares per iteration; movemask turns each into 4 bits, one
+ * per key, and the lowest set bit is the first match.
+ */
+__attribute__((target("avx2")))
+static size_t find_eq_avx2(const uint64_t *keys, size_t n, uint64_t key)
+{
+  __m256i k = _mm256_set1_epi64x((long long) key);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (keys + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (keys + i + 4));
+    int ma = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a, k)));
+    int mb = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(b, k)));
+    int m = ma | (mb << 4);
+    if (m) return i + __builtin_ctz(m);
+  }
+  return i + find_eq_scalar(keys + i, n - i, key);
+}
+
+/*
+ * keys[i] >= key is !(key > keys[i]); the first lane where the greater-than
+ * mask is clear is the answer.
+ */
+__attribute__((target("avx2")))
+static size_t find_ge_avx2(const int64_t *keys, size_t n, int64_t key)
+{
+  __m256i k = _mm256_set1_epi64x((long long) key);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (keys + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (keys + i + 4));
+    int ma = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, a)));
+    int mb = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, b)));
+    int m = ~(ma | (mb << 4)) & 0xff;
+    if (m) return i + __builtin_ctz(m);
+  }
+  return i + find_ge_scalar(keys + i, n - i, key);
+}
+
+static bool use_avx2()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+#elif defined(__aarch64__)
+
+/*
+ * Two 2-lane compares per iteration, narrowed to one 32-bit lane per key
+ * so that a single 128-bit value says whether any of the 4 matched.
+ */
+static inline size_t neon_first(uint64x2_t a, uint64x2_t b)
+{
+  uint32x4_t m = vcombine_u32(vmovn_u64(a), vmovn_u64(b));
+  if (vmaxvq_u32(m) == 0) return 4;
+  uint32_t lanes[4];
+  vst1q_u32(lanes, m);
+  size_t j = 0;
+  while (lanes[j] == 0) j++;
+  return j;
+}
+
+static size_t find_eq_neon(const uint64_t *keys, size_t n, uint64_t key)
+{
+  uint64x2_t k = vdupq_n_u64(key);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    size_t j = neon_first(vceqq_u64(vld1q_u64(keys + i), k),
+                          vceqq_u64(vld1q_u64(keys + i + 2), k));
+    if (j < 4) return i + j;
+  }
+  return i + find_eq_scalar(keys + i, n - i, key);
+}
+
+static size_t find_ge_neon(const int64_t *keys, size_t n, int64_t key)
+{
+  int64x2_t k = vdupq_n_s64(key);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    size_t j = neon_first(vcgeq_s64(vld1q_s64(keys + i), k),
+                          vcgeq_s64(vld1q_s64(keys + i + 2), k));
+    if (j < 4) return i + j;
+  }
+  return i + find_ge_scalar(keys + i, n - i, key);
+}
+
+#endif
+
+static simd_find_eq_fn pick_find_eq()
+{
+#if defined(__x86_64__)
+  if (use_avx2()) return find_eq_avx2;
+#elif defined(__aarch64__)
+  return find_eq_neon;
+#endif
+  return find_eq_scalar;
+}
+
+static simd_find_ge_fn pick_find_ge()
+{
+#if defined(__x86_64__)
+  if (use_avx2()) return find_ge_avx2;
+#elif defined(__aarch64__)
+  return find_ge_neon;
+#endif
+  return find_ge_scalar;
+}
+
+simd_find_eq_fn simd_find_eq_impl = pick_find_eq();
+simd_find_ge_fn simd_find_ge_impl = pick_find_ge();
+
+const char *simd_isa()
+{
+  if (simd_find_eq_impl == find_eq_scalar) return "scalar";
+#if defined(__aarch64__)
+  return "neon";
+#else
+  return "avx2";
+#endif
+}
+
+void test_simd() {
+  uint64_t keys[100];
+  int64_t sorted[100];
+  for (int i = 0; i < 100; i++) {
+    keys[i] = (uint64_t) i * 0x9e3779b97f4a7c15ULL;
+    sorted[i] = 3 * (int64_t) i - 150;
+  }
+  keys[70] = keys[30];
+  printf("Key scans use %s\n", simd_isa());
+  for (size_t n = 0; n <= 100; n++) {
+    for (int i = 0; i < 100; i++) {
+      size_t first = (i == 70) ? 30 : i;  // keys[70] repeats keys[30]
+      assert(simd_find_eq(keys, n, keys[i]) == (first < n ? first : n));
+    }
+    assert(simd_find_eq(keys, n, 1) == n);
+    for (int64_t k = -160; k < 160; k++) {
+      size_t expect = find_ge_scalar(sorted, n, k);
+      assert(simd_find_ge(sorted, n, k) == expect);
+      assert(expect == n || sorted[expect] >= k);
+      assert(expect == 0 || sorted[expect - 1] < k);
+    }
+  }
+  int64_t extremes[9] = {INT64_MIN, -1, -1, 0, 0, 1, 1, INT64_MAX, INT64_MAX};
+  assert(simd_find_ge(extremes, 9, INT64_MIN) == 0);
+  assert(simd_find_ge(extremes, 9, 0) == 3);
+  assert(simd_find_ge(extremes, 9, INT64_MAX) == 7);
+}
@@ -0,0 +1,47 @@
+/*
+ * This program implements vectorized scans over contiguous arrays of
+ * 64-bit keys, as kept by the chunked queue (cq.h).
+ *
+ * Each kernel has an AVX2 version comparing 8 keys per iteration, a NEON
+ * version comparing 4, and a scalar fallback. The x86 versions are picked
+ * once at startup from what the CPU supports, so the build itself needs no
+ * -mavx2.
+ */
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/************** Operations on key arrays *******************/
+
+typedef size_t (*simd_find_eq_fn)(const uint64_t *keys, size_t n,
+                                  uint64_t key);
+typedef size_t (*simd_find_ge_fn)(const int64_t *keys, size_t n, int64_t key);
+
+extern simd_find_eq_fn simd_find_eq_impl;
+extern simd_find_ge_fn simd_find_ge_impl;
+
+/*
+  Index of the first of keys[0..n) equal to key, or n if there is none.
+*/
+static inline size_t simd_find_eq(const uint64_t *keys, size_t n, uint64_t key)
+{
+    return simd_find_eq_impl(keys, n, key);
+}
+
+/*
+  Index of the first of keys[0..n) that is not less than key (signed), or n
+  if there is none. On sorted keys, the position key would be inserted at.
+*/
+static inline size_t simd_find_ge(const int64_t *keys, size_t n, int64_t key)
+{
+    return simd_find_ge_impl(keys, n, key);
+}
+
+/*
+  Name of the kernels in use: "avx2", "neon" or "scalar".
+*/
+const char *simd_isa();
+
+#endif
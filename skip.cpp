@@ -1,236 +1,71 @@
 /*
- * Implments a generic skip-list, with n sublists. Each sublist has a 
- * head, initialized on list creation. Each sublist shares the payloads/hashes/sizes
- * of its nodes with those of the list below it. 
- * See: https://en.wikipedia.org/wiki/Skip_list
+ * Implments a generic skip-list, with n sublists.
  *
- * Interface notes: 
- * -Relies on the (external) definition of a comparison, called
- *   sl_compare().
- * -Caller's responsibilty to seed the random.h state machine. Easily done
- *   with a single srand(time(NULL)) call before first insert.
+ * The implementation is the basic_skip_list template in skip.h; this file
+ * holds the skip_list instantiation used by the C-style callers.
  */
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
-#include <time.h>
-#define P 0.75f // Roll successively to see if node should be promoted [0,1)
-#define NUM_LISTS 4 // at least 1
+#include "skip.h"
 
-typedef struct ELE {
-    void *value;
-    size_t payload_size;
-    void *hash;
-    struct ELE *next;
-} list_ele_t;
+template class basic_skip_list<void *, char, sl_extern_compare, SL_MAX_LEVELS>;
 
-/*
- * Should return 0 for equality, > 0 for v1 > v2, and < 0 for v1 < v2
- */
-extern int sl_compare(void *h1, void *h2);
-extern list_ele_t *pack(void *val, size_t size, void *hash);
-
-class skip_list {
-  public:
-    list_ele_t *heads[NUM_LISTS];
-    skip_list() {
-      for(int i = 0; i < NUM_LISTS; i++) {
-          heads[i] = NULL;
-        }
-    }
-
-    bool sl_insert(list_ele_t *node);
-    bool sl_delete(list_ele_t *node);
-    list_ele_t *sl_search(void *payload);
-    void sl_print(list_ele_t *start);
-  private:
-    bool sl_roll();
-    void sl_promote(list_ele_t *node, list_ele_t **prev_pts, int list_num);
-    list_ele_t *ll_insert(list_ele_t *node, list_ele_t *start);
-};
-
-/*
- * Insert immediately at head if list is empty or data will be the smallest
- * node in the list. Else traverse from top left to bottom right, keeping
- * track of the most recently visited node in each list to later do
- * a constant time insert if list splice(s) need to be performed. Try and
- * promote new node after insertion to speed up future accesses.
- */
-bool skip_list::sl_insert(list_ele_t *data) {
-  list_ele_t *node = (list_ele_t *) malloc(NUM_LISTS * sizeof(list_ele_t));
-  if (!node) return false;
-  memcpy(node, data, NUM_LISTS * sizeof(list_ele_t));
-  if (heads[0]==NULL) { //Empty, init case
-    list_ele_t *pt = (list_ele_t *) malloc(NUM_LISTS * sizeof(list_ele_t));
-    if (!pt) return false;
-
-    for (int i = 0; i < NUM_LISTS; i++) {
-      heads[i] = &pt[i];
-      memcpy(&pt[i], node, sizeof(list_ele_t));
-      pt[i].next = NULL;
-    }
-    return true;
-  }
-  int cmp = sl_compare(node->hash, heads[0]->hash);
-  if (0 >= cmp) { //insert at start
-    list_ele_t *pt = (list_ele_t *) malloc(NUM_LISTS * sizeof(list_ele_t));
-    if (!pt) return false;
-    list_ele_t *old_head = heads[0];
-    for (int i = 0; i < NUM_LISTS; i++) {
-      heads[i] = &pt[i];
-      memcpy(&pt[i], node, sizeof(list_ele_t));
-      pt[i].next = old_head[i].next;
-    }
-    heads[0]->next = old_head;
-    return true;  
-  }
-  /*
-   * Do a traversal, if a node is found s.t. it compares to strictly less than
-   * node, insert node in the bottom list, then roll to potentially promote
-   * node into higher list(s).
-   */
-  int i = NUM_LISTS - 1;
-  list_ele_t *prev_pts[NUM_LISTS] = {NULL};
-  list_ele_t *pt = heads[i];
-  prev_pts[i] = pt;
-  for (; i >= 0 ; i--) {
-    prev_pts[i] = pt;
-    while (pt->next != NULL) {
-      if (1 == sl_compare(node->hash, pt->next->hash)) {
-        prev_pts[i] = pt;
-        pt = pt->next;
-      } 
-      // found start point for linear search within list 0
-      else { 
-        prev_pts[0] = prev_pts[i] - i;
-        prev_pts[0] = ll_insert(node, prev_pts[0]);
-        sl_promote(node, prev_pts, i);
-        return true;
-      }
-    }
-    prev_pts[i] = pt;
-    pt -= 1;
-  }
-  prev_pts[0]->next = node;
-  node->next = NULL;
-  sl_promote(node, prev_pts, 0);
-  return true;
-}
-
-bool skip_list::sl_delete(list_ele_t *node) {
-  return node==NULL;
+static void counts_print(FILE *f, const char *key, const stats_counts_t *c) {
+  fprintf(f, ", \"%s\": {\"calls\": %llu, \"compares\": %llu, "
+          "\"visited\": %llu}", key, (unsigned long long) c->calls,
+          (unsigned long long) c->compares, (unsigned long long) c->visited);
 }
 
-/*
- * Traverse list from top left to bottom right, returning first node found
- * this way on a hash match. Returns NULL if no node is found in this way.
- */
-list_ele_t *skip_list::sl_search(void *hash) {
-  int i = NUM_LISTS - 1;
-  list_ele_t *pt = heads[i];
-  if (pt == NULL) {
-    return NULL;
-  }
-  for (; i >= 0 ; i--) {
-    int cmp;
-    if (0 == (cmp = sl_compare(hash, pt->hash))) {
-      return pt;
-    }
-    else if (0 > cmp) {
-      return NULL;
-    }
-    while (pt->next != NULL) {
-      if (1 == (cmp = sl_compare(hash, pt->next->hash))) {
-        pt = pt->next;
-      } 
-      else if (0 == cmp){ 
-        return pt->next;
-      }
-      else {
-        break;
-      }
-    }
-    pt -= 1;
+void sl_stats_print(FILE *f, const char *name, const sl_stats_t *st) {
+  fprintf(f, "{\"name\": \"%s\", \"counted\": %s, \"levels\": %d, "
+          "\"nodes\": %zu, \"payload_bytes\": %zu, \"alloc_bytes\": %zu, "
+          "\"level_nodes\": [", name, st->counted ? "true" : "false",
+          st->levels, st->nodes, st->payload_bytes, st->alloc_bytes);
+  for (int i = 0; i < st->levels && i < SL_STATS_LEVELS; i++) {
+    fprintf(f, "%s%zu", i ? ", " : "", st->level_nodes[i]);
   }
-  return NULL;
+  fprintf(f, "]");
+  counts_print(f, "search", &st->search);
+  counts_print(f, "insert", &st->insert);
+  counts_print(f, "remove", &st->remove);
+  fprintf(f, "}\n");
 }
 
 /*
- * Print out the skip list. If start is non-NULL, print that sublist first.
+ * Check that every sublist of sl is sorted and only holds nodes tall enough
+ * to be in it, that the bottom list holds sl_count() nodes, and that
+ * sl_select() and sl_rank() agree with positions along the bottom list.
  */
-void skip_list::sl_print(list_ele_t *start) {
-  if (start != NULL) {
-    while (start->next != NULL) {
-      printf("|%ld|  -->  ", (long) start->hash);
-      start = start->next;
+template <typename SL>
+static void sl_check(SL &sl) {
+  size_t n = 0;
+  for (int i = 0; i < sl.sl_levels(); i++) {
+    for (typename SL::node_t *pt = sl.heads[i]; pt != NULL; pt = pt->next[i]) {
+      assert(pt->height > i);
+      assert(pt->next[i] == NULL || sl.key(pt) <= sl.key(pt->next[i]));
+      if (i == 0) n++;
     }
-    printf("|%ld|  --X\n", (long) start->hash);
-
   }
-  for (int i = NUM_LISTS - 1; i >=0; i--) {
-    printf("List %d:\t", i);
-    list_ele_t *pt = heads[i];
-    if (pt==NULL) {
-      printf("  --X\n");
-      continue;
-    }
-    while (pt->next != NULL) {
-      printf("|%ld|  -->  ", (long) pt->hash);
-      pt = pt->next;
-    }
-    printf("|%ld|  --X\n", (long) pt->hash);
+  assert(n == sl.sl_count());
+  size_t pos = 0;
+  for (typename SL::node_t *pt = sl.heads[0]; pt != NULL; pt = pt->next[0]) {
+    assert(sl.sl_select(pos) == pt);
+    size_t rank = sl.sl_rank(sl.key(pt));  // first of any duplicates
+    assert(rank <= pos && sl.key(sl.sl_select(rank)) == sl.key(pt));
+    pos++;
   }
-}
-/*
- * Gives the output of a coin flip with probability 'P.'
- */
-bool skip_list::sl_roll() {
-  long r = random() % 1000;
-  bool out = ((float) r) < (P * (float) 1000);
-  return out;
+  assert(sl.sl_select(pos) == NULL);
 }
 
-void skip_list::sl_promote(list_ele_t *node, list_ele_t **prev_pts, int list_num) {
-  int i = 0;
-  for (; i <= list_num; i++) {
-    prev_pts[i] = prev_pts[0] + i;
-  }
-  i = 1;
-  while (sl_roll() && i < NUM_LISTS) {
-    memcpy(&node[i], node, sizeof(list_ele_t));
-    (&node[i])->next = prev_pts[i]->next;
-    prev_pts[i]->next = &node[i];
-    i++;
-  }
-}
-
-list_ele_t *skip_list::ll_insert(list_ele_t *node, list_ele_t *start) {
-  assert (0 <= sl_compare(node->hash, start->hash));
-  if (0 == sl_compare(node->hash, start->hash)) {
-    node->next = start->next;
-    start->next = node;
-    return start;
-  }
-  list_ele_t *pt = start;
-  list_ele_t *prev = pt;
-  while (prev->next != NULL) {
-    pt = pt->next;
-    if (0 < sl_compare(pt->hash, node->hash)) {
-      node->next = pt;
-      prev->next = node;
-      return prev;
-    }
-    prev = pt; 
-  } 
-  prev->next = node;
-  node->next = NULL;
-  return prev;
+static void count_free(void *arg, void *val, size_t) {
+  (*(int *) arg)++;
+  free(val);
 }
 
-
 void test_sl() {
-  srand(time(NULL));
   char val[25] = "Corruption check";
   size_t size = 1 + (size_t) strlen(val);
   list_ele_t *node1 = pack(val, size, (void *) 1);
@@ -244,16 +79,382 @@ void test_sl() {
   
   sl.sl_insert(node5);
   sl.sl_insert(node2);
-  sl.sl_delete(node3);
+  assert(sl.sl_delete(node3));
   sl.sl_insert(node4);
   sl.sl_insert(node3);
-  sl.sl_delete(node1); 
-  sl.sl_delete(node5);
+  assert(sl.sl_delete(node1));
+  assert(sl.sl_delete(node5));
+  assert(!sl.sl_delete(node5));
+  assert(!sl.sl_search((void *) 15));
+  sl.sl_insert(node5);
   sl.sl_insert(node1);
   sl.sl_insert(node3);
-  sl.sl_print(sl.sl_search((void *) 10));
+  skip_list::node_t *hit = sl.sl_search((void *) 10);
+  assert(hit && hit->value != node4->value);
+  assert(0 == strcmp((char *) hit->value, val));
+  sl.sl_print(hit);
   printf("\n");
   sl.sl_print(sl.sl_search((void *) 15));
+  list_ele_t *nodes[] = {node1, node2, node3, node4, node5};
+  for (int i = 0; i < 5; i++) {
+    unpack(NULL, nodes[i]);
+  }
+
+  // Four sublists by default, as ever, but room to grow past them
+  assert(sl.sl_levels() == SL_DEFAULT_LEVELS);
+  skip_list tall(SL_MAX_LEVELS, 0.5f, true);
+  for (intptr_t k = 1; k <= 4096; k++) {
+    assert(tall.insert((void *) k, 'x'));
+  }
+  assert(tall.sl_levels() == 12);  // 2^11 < 4096 <= 2^12
+
+  basic_skip_list<int64_t, int64_t, sl_three_way<int64_t>, 8> isl;
+  for (int64_t i = 0; i < 200; i++) {  // keys -200, -198, .. 198 shuffled
+    int64_t k = 2 * ((i * 37) % 200) - 200;
+    assert(isl.insert(k, 2 * k));
+  }
+  for (int64_t k = -200; k < 200; k += 2) {
+    sl_node<int64_t> *ihit = isl.sl_search(k);
+    assert(ihit && isl.key(ihit) == k && *isl.value(ihit) == 2 * k);
+    assert(!isl.sl_search(k + 1));
+  }
+
+  basic_skip_list<int64_t, int64_t, sl_three_way<int64_t>, 32> gsl(20, 0.5f,
+                                                                    true);
+  assert(gsl.sl_levels() == 1);
+  for (int64_t i = 0; i < 5000; i++) {
+    assert(gsl.insert((i * 7919) % 5000, i));
+  }
+  assert(gsl.sl_count() == 5000);
+  assert(gsl.sl_levels() == 13);  // 2^12 < 5000 <= 2^13
+  for (int64_t k = 0; k < 5000; k++) {
+    assert(gsl.sl_search(k));
+  }
+  int64_t probe[6000];
+  sl_node<int64_t> *found[6000];
+  for (int64_t i = 0; i < 6000; i++) {
+    probe[i] = (i * 4099) % 6000 - 500;  // 5000 hits, 1000 misses
+  }
+  assert(gsl.sl_search_batch(probe, 6000, found) == 5000);
+  for (int64_t i = 0; i < 6000; i++) {
+    assert(found[i] == gsl.sl_search(probe[i]));
+  }
+  assert(gsl.sl_search_batch(probe, 3, found) == 2 && found[0] == NULL);
+  assert(!gsl.sl_search(5000) && !gsl.sl_search(-1));
+  for (int i = 0; i < gsl.sl_levels(); i++) {
+    for (sl_node<int64_t> *pt = gsl.heads[i]; pt && pt->next[i];
+         pt = pt->next[i]) {
+      assert(gsl.key(pt) < gsl.key(pt->next[i]));
+      assert(pt->height > i);
+    }
+  }
+
+  for (int64_t k = 0; k < 5000; k += 2) {
+    assert(gsl.sl_delete_key(k));
+    assert(!gsl.sl_delete_key(k));
+  }
+  assert(gsl.sl_count() == 2500);
+  assert(gsl.sl_erase_range(1000, 2001) == 500);
+  assert(gsl.sl_erase_range(2001, 1000) == 0);
+  assert(gsl.sl_count() == 2000);
+  for (int64_t k = 0; k < 5000; k++) {
+    bool present = (k & 1) && (k < 1000 || k > 2000);
+    assert(!gsl.sl_search(k) == !present);
+  }
+  typedef basic_skip_list<int64_t, int64_t, sl_three_way<int64_t>, 32> isl_t;
+  assert(gsl.key(gsl.sl_lower_bound(1000)) == 2001);
+  assert(gsl.key(gsl.sl_lower_bound(999)) == 999);
+  assert(gsl.key(gsl.sl_upper_bound(999)) == 2001);
+  assert(gsl.sl_lower_bound(5000) == NULL && gsl.sl_upper_bound(4999) == NULL);
+  assert(gsl.key(gsl.sl_upper_bound(-7)) == 1);
+  int64_t expect = 1;
+  for (isl_t::iterator it = gsl.begin(); it != gsl.end(); ++it) {
+    assert(gsl.key(*it) == expect);
+    expect += (expect == 999) ? 1002 : 2;
+  }
+  assert(expect == 5001);
+  sl_node<int64_t> *run[64];
+  assert(gsl.sl_range(990, 2010, run, 64) == 10);
+  assert(gsl.key(run[0]) == 991 && gsl.key(run[4]) == 999);
+  assert(gsl.key(run[5]) == 2001 && gsl.key(run[9]) == 2009);
+  assert(gsl.sl_range(990, 2010, run, 3) == 3);
+  assert(gsl.sl_range(10, 10, run, 64) == 0);
+  assert(gsl.sl_erase_range(-1, 5000) == 2000);
+  assert(gsl.begin() == gsl.end());
+  for (int i = 0; i < gsl.sl_levels(); i++) {
+    assert(gsl.heads[i] == NULL);
+  }
+  assert(gsl.insert(7, 7) && gsl.sl_search(7));
+  sl_check(gsl);
+
+  // Finger inserts: ascending runs with occasional steps backwards
+  isl_t fsl(16, 0.5f, true);
+  for (int64_t i = 0; i < 3000; i++) {
+    int64_t k = (i % 100 == 99) ? i - 50 : i;
+    assert(fsl.insert(k, k, true));
+  }
+  sl_check(fsl);
+  assert(fsl.sl_delete_key(10) && fsl.insert(10, 10, true));
+  assert(fsl.insert(5000, 0, true) && fsl.insert(4000, 0, true));
+  sl_check(fsl);
+  for (int64_t i = 0; i < 3000; i++) {
+    assert((fsl.sl_search(i) != NULL) == (i % 100 != 99));
+  }
+
+  // Bulk load, then a second sorted batch that overlaps the first
+  char pay[8] = "payload";
+  list_ele_t *batch[2000];
+  for (int i = 0; i < 2000; i++) {
+    batch[i] = pack(pay, sizeof(pay), (void *) (intptr_t) (2 * i));
+  }
+  for (int even = 0; even <= 1; even++) {
+    isl_t bsl(16, 0.5f, true);
+    assert(bsl.sl_insert_batch(batch, 1000, even) == 1000);
+    assert(bsl.sl_levels() == 10);  // 2^9 < 1000 <= 2^10
+    sl_check(bsl);
+    if (even) {
+      int tall = 0;
+      for (isl_t::iterator it = bsl.begin(); it != bsl.end(); ++it) {
+        tall += it->height > 1;
+      }
+      assert(tall == 499);  // each even position but 2, added on one level
+    }
+    assert(bsl.sl_insert_batch(batch + 500, 1500, even) == 1500);
+    sl_check(bsl);
+    assert(bsl.sl_count() == 2500);
+    for (int i = 0; i < 4000; i++) {
+      assert((bsl.sl_search(i) != NULL) == !(i & 1));
+    }
+  }
+  for (int i = 0; i < 2000; i++) {
+    unpack(NULL, batch[i]);
+  }
+
+  // Seeded lists roll the same towers; heights follow p
+  float ps[] = {0.5f, 0.25f, 0.75f};
+  for (int j = 0; j < 3; j++) {
+    isl_t s1(16, ps[j], false, 42), s2(16, ps[j], false, 42);
+    for (int64_t i = 0; i < 20000; i++) {
+      assert(s1.insert(i, i, true) && s2.insert(i, i, true));
+    }
+    sl_check(s1);
+    size_t tall = 0;
+    isl_t::iterator it2 = s2.begin();
+    for (isl_t::iterator it = s1.begin(); it != s1.end(); ++it, ++it2) {
+      assert(it->height == it2->height);
+      tall += it->height > 1;
+    }
+    double frac = (double) tall / 20000.0;
+    assert(frac > ps[j] - 0.02 && frac < ps[j] + 0.02);
+  }
+
+  // Snapshots: occupancy always, traversal costs with DL_STATS
+  isl_t ssl(16, 0.5f, true, 7);
+  for (int64_t i = 0; i < 1000; i++) {
+    assert(ssl.insert(i, i));
+  }
+  assert(ssl.sl_search(500) && !ssl.sl_search(-1) && ssl.sl_delete_key(3));
+  sl_stats_t st;
+  ssl.sl_stats(&st);
+  assert(st.nodes == 999 && st.levels == ssl.sl_levels());
+  assert(st.level_nodes[0] == 999 && st.level_nodes[st.levels] == 0);
+  assert(st.payload_bytes == 999 * sizeof(int64_t) && st.alloc_bytes > 0);
+  size_t in_lists = 0;
+  for (int i = 0; i < st.levels; i++) {
+    size_t n = 0;
+    for (sl_node<int64_t> *pt = ssl.heads[i]; pt != NULL; pt = pt->next[i]) {
+      n++;
+    }
+    assert(st.level_nodes[i] == n);
+    in_lists += n;
+  }
+  assert(in_lists > 1800 && in_lists < 2200);  // 1 / (1 - p) lists a node
+  sl_stats_print(stdout, "test_sl", &st);
+  if (st.counted) {
+    assert(st.search.calls == 2 && st.search.compares > 0);
+    assert(st.insert.calls == 1000 && st.remove.calls == 1);
+    assert(st.insert.compares >= st.insert.visited);
+    ssl.sl_stats_reset();
+    ssl.sl_stats(&st);
+    assert(st.search.calls == 0 && st.search.compares == 0);
+  }
+  else {
+    assert(st.search.calls == 0 && st.insert.compares == 0);
+  }
+
+  // Elements move from a queue into a list without being copied
+  int freed = 0;
+  char big[4096];
+  memset(big, 'b', sizeof(big));
+  isl_t msl(16, 0.5f, true, 3);
+  {
+    queue_t *q = q_new_flags(Q_POOLED);
+    for (intptr_t k = 0; k < 30; k++) {
+      list_ele_t *ele;
+      if (k % 3 == 0) ele = q_pack(q, val, size, (void *) k);
+      else if (k % 3 == 1) ele = q_pack(q, big, sizeof(big), (void *) k);
+      else ele = q_adopt(q, malloc(100), 100, (void *) k, count_free, &freed);
+      assert(q_insert_tail(q, ele));
+    }
+    void *moved = ((list_ele_t *) q->head->next)->value;
+    while (q->head != NULL) {
+      ele_ptr h = q_take_head(q);
+      assert(msl.sl_insert(std::move(h), true) && !h);
+    }
+    q_free(q);
+    sl_node<int64_t> *pt = msl.sl_search(1);
+    assert(pt && pt->owner == SL_ADOPTED && pt->value == moved);
+    assert(0 == memcmp(pt->value, big, sizeof(big)));
+    assert(msl.sl_search(0)->owner == SL_OWNED);
+    assert(0 == strcmp((char *) msl.sl_search(0)->value, val));
+  }
+  assert(msl.sl_count() == 30 && msl.sl_delete_key(2) && freed == 1);
+  assert(!msl.sl_insert(ele_ptr()));
+  list_ele_t *lent = pack_borrow(big, sizeof(big), (void *) 100);
+  assert(msl.sl_insert(ele_ptr(lent)) && msl.sl_search(100)->value == big);
+  msl.sl_erase_range(0, 10);
+  assert(freed == 3 && msl.sl_count() == 21);
+
+  // String keys: ordered by bytes, prefix ties settled by the full key
+  const char *words[] = {"prefix__two", "b", "abcdefgh1", "", "abcdefgi",
+                         "prefix__", "a", "abcdefgh", "z", "ab",
+                         "prefix__one", "abcdefgh0"};
+  const int nwords = sizeof(words) / sizeof(words[0]);
+  basic_skip_list<sl_str_key, int64_t, sl_str_compare, 16> wsl(16, 0.5f);
+  for (int i = 0; i < nwords; i++) {
+    assert(wsl.insert(sl_str(words[i]), i));
+  }
+  const char *last = NULL;
+  int seen = 0;
+  for (auto it = wsl.begin(); it != wsl.end(); ++it, seen++) {
+    assert(it->hash.len == strlen(it->hash.str));
+    assert(last == NULL || strcmp(last, it->hash.str) < 0);
+    last = it->hash.str;
+  }
+  assert(seen == nwords);
+  for (int i = 0; i < nwords; i++) {
+    char copy[32];
+    strcpy(copy, words[i]);
+    sl_node<sl_str_key> *hit = wsl.sl_search(sl_str(copy));
+    assert(hit && hit->hash.str == words[i] && *wsl.value(hit) == i);
+  }
+  assert(!wsl.sl_search(sl_str("prefix_")) && !wsl.sl_search(sl_str("abcdefgh2")));
+  assert(sl_str_compare()(sl_str("ab", 2), sl_str("ab\0", 3)) < 0);
+  assert(sl_str_compare()(sl_str("abcdefgh\0", 9), sl_str("abcdefgh", 8)) > 0);
+  sl_node<sl_str_key> *lo = wsl.sl_lower_bound(sl_str("abcdefgh00"));
+  assert(lo && 0 == strcmp(lo->hash.str, "abcdefgh1"));
+  assert(wsl.sl_delete_key(sl_str("prefix__")) && !wsl.sl_search(sl_str("prefix__")));
+  assert(wsl.sl_search(sl_str("prefix__one")));
+
+  // Elements whose hash is a string
+  str_skip_list esl(SL_DEFAULT_LEVELS, 0.5f);
+  list_ele_t *sele = pack(val, size, (void *) "element key");
+  assert(esl.sl_insert(sele) && esl.sl_search(sl_str("element key")));
+  assert(esl.sl_delete(sele) && esl.sl_count() == 0);
+  unpack(NULL, sele);
+
+  // Timers: pops come out in deadline order and leave every level intact
+  isl_t tsl(16, 0.5f, true, 11);
+  int64_t due, fired;
+  assert(!tsl.sl_peek_min() && !tsl.pop_min(&due, &fired));
+  for (int64_t i = 0; i < 1000; i++) {
+    int64_t at = (i * 617) % 500;  // every deadline twice
+    assert(tsl.insert(at, i));
+  }
+  assert(tsl.sl_peek_min()->hash == 0 && tsl.pop_min(&due, &fired));
+  assert(due == 0 && (fired == 0 || fired == 500) && tsl.sl_count() == 999);
+  sl_node<int64_t> *due_nodes[1000];
+  assert(tsl.sl_pop_until(-1, due_nodes, 1000) == 0);
+  size_t got = tsl.sl_pop_until(99, due_nodes, 50);
+  assert(got == 50 && due_nodes[0]->hash == 0 && due_nodes[49]->hash == 25);
+  for (size_t j = 0; j < got; j++) {
+    assert(j == 0 || due_nodes[j - 1]->hash <= due_nodes[j]->hash);
+    tsl.sl_recycle(due_nodes[j]);
+  }
+  got = tsl.sl_pop_until(99, due_nodes, 1000);
+  assert(got == 149 && due_nodes[got - 1]->hash == 99 && tsl.sl_count() == 800);
+  assert((*isl_t::value(due_nodes[0]) * 617) % 500 == due_nodes[0]->hash);
+  for (size_t j = 0; j < got; j++) {
+    tsl.sl_recycle(due_nodes[j]);
+  }
+  for (int i = 0; i < tsl.sl_levels(); i++) {
+    int64_t prev = 100;
+    for (sl_node<int64_t> *pt = tsl.heads[i]; pt != NULL; pt = pt->next[i]) {
+      assert(pt->hash >= prev && pt->height > i);
+      prev = pt->hash;
+    }
+  }
+  assert(tsl.insert(5, 5) && tsl.sl_peek_min()->hash == 5 && tsl.sl_search(100));
+  sl_node<int64_t> *first = tsl.sl_pop_min();
+  assert(first->hash == 5 && tsl.sl_peek_min()->hash == 100);
+  tsl.sl_recycle(first);
+  tsl.sl_recycle(NULL);
+  assert(tsl.sl_pop_until(1000, due_nodes, 1000) == 800 && !tsl.sl_peek_min());
+  assert(tsl.sl_count() == 0 && tsl.insert(1, 1) && tsl.sl_search(1));
+
+  // Rank and select follow every kind of insert and delete, duplicates too
+  isl_t rsl(16, 0.5f, true, 5);
+  int copies[512] = {0};
+  char wide[Q_INLINE_MAX + 40] = "adopted";
+  uint64_t r = 12345;
+  for (int round = 1; round <= 6000; round++) {
+    r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+    int64_t k = (int64_t) ((r >> 33) % 512);
+    int op = (int) ((r >> 20) % 16);
+    if (op < 6) {
+      assert(rsl.insert(k, k, op & 1));
+      copies[k]++;
+    }
+    else if (op < 8) {
+      assert(rsl.sl_insert(ele_ptr(pack(wide, sizeof(wide), (void *) k)), op & 1));
+      copies[k]++;
+    }
+    else if (op < 12) {
+      assert(rsl.sl_delete_key(k) == (copies[k] > 0));
+      if (copies[k] > 0) copies[k]--;
+    }
+    else if (op == 12) {
+      sl_node<int64_t> *min = rsl.sl_pop_min();
+      if (min != NULL) copies[min->hash]--;
+      rsl.sl_recycle(min);
+    }
+    else if (op == 13) {
+      size_t n = rsl.sl_pop_until(k / 8, due_nodes, 4);
+      for (size_t j = 0; j < n; j++) {
+        copies[due_nodes[j]->hash]--;
+        rsl.sl_recycle(due_nodes[j]);
+      }
+    }
+    else if (op == 14 && round % 7 == 0) {
+      size_t n = 0;
+      for (int64_t j = k; j < k + 5 && j < 512; j++) {
+        n += copies[j];
+        copies[j] = 0;
+      }
+      assert(rsl.sl_erase_range(k, k + 5) == n);
+    }
+    if (round % 1000 == 0) {
+      sl_check(rsl);
+    }
+  }
+  list_ele_t *sorted[100];
+  for (int i = 0; i < 100; i++) {
+    sorted[i] = pack(pay, sizeof(pay), (void *) (intptr_t) (450 + i));
+    if (450 + i < 512) copies[450 + i]++;
+  }
+  assert(rsl.sl_insert_batch(sorted, 100) == 100);
+  for (int i = 0; i < 100; i++) {
+    unpack(NULL, sorted[i]);
+  }
+  sl_check(rsl);
+  size_t below = 0;
+  for (int64_t k = 0; k < 512; k++) {
+    assert(rsl.sl_rank(k) == below);
+    if (copies[k] > 0) assert(rsl.key(rsl.sl_select(below)) == k);
+    below += copies[k];
+  }
+  assert(rsl.sl_rank(512) == below && rsl.sl_count() == below + 38);
+  assert(rsl.key(rsl.sl_select(rsl.sl_count() - 1)) == 549);
   return;
 }
 
@@ -0,0 +1,1199 @@
+/*
+ * Implments a generic skip-list, with n sublists. Each sublist has a
+ * head, initialized on list creation. A node appears in the bottom sublist
+ * and in as many of the ones above it as it was promoted into, and keeps a
+ * single copy of its payload/hash/size for all of them.
+ * See: https://en.wikipedia.org/wiki/Skip_list
+ *
+ * Interface notes:
+ * -basic_skip_list takes the key type K, payload type V, a three-way
+ *   comparator on K and the number of sublists as template parameters, so
+ *   that comparisons can be inlined into the traversals. skip_list is the
+ *   instantiation over void * keys using the (external) definition of a
+ *   comparison, called sl_compare(). str_skip_list orders string keys,
+ *   kept in the nodes as sl_str_key length plus prefix. Both keep four
+ *   sublists by default and take up to SL_MAX_LEVELS on request.
+ * -MaxLevel only bounds the height. The number of sublists in use and the
+ *   promotion probability are per-instance constructor parameters; with
+ *   grow set, a list starts with one sublist and adds another each time
+ *   its node count passes the next power of 1/p, up to max_levels, so
+ *   that searches stay logarithmic as the list fills up.
+ * -The list remembers where its last insert happened in every sublist.
+ *   sl_insert_finger() resumes from there when keys arrive in (mostly)
+ *   ascending order, and sl_insert_batch() appends a sorted run in one
+ *   linear pass without descending from the top at all.
+ * -Heights come from a per-list xorshift64* generator that rolls a whole
+ *   tower in one draw and takes no lock. It is seeded from the list's
+ *   address and the time unless a seed is given, for reproducible runs.
+ * -Built with DL_STATS, a list counts the comparisons made and nodes
+ *  stepped over by its searches, inserts and deletes. sl_stats() takes a
+ *  snapshot of those along with the per-level occupancy and footprint,
+ *  whether or not counting is compiled in.
+ * -Nodes are carved from a per-list pool, all of which is released when
+ *   the list is destroyed. Payloads of at most Q_INLINE_MAX bytes are
+ *   copied into the node; larger payloads stay shared with the inserted
+ *   element, which must outlive the list. An element handed over in an
+ *   ele_ptr is instead kept by the node, payload in place, and released
+ *   along with it, so that it moves out of a queue without a copy.
+ * -Every link also records its width, the number of bottom-list steps it
+ *   covers, so that sl_rank() and sl_select() convert between keys and
+ *   positions in O(log n) rather than by walking the bottom list. Every
+ *   insert and delete keeps the widths up to date, at one add per level.
+ */
+#ifndef SKIP_H
+#define SKIP_H
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "q.h"
+#include "pool.h"
+#include "stats.h"
+constexpr float SL_DEFAULT_P = 0.75f; // promotion probability by default, [0,1)
+constexpr int SL_DEFAULT_LEVELS = 4; // sublists of the compatibility types, >= 1
+constexpr int SL_MAX_LEVELS = 32; // height bound of the compatibility types
+#define SL_BATCH_GROUP 8 // lookups in flight in sl_search_batch()
+#define SL_STATS_LEVELS 64 // sublists reported on by sl_stats()
+
+/*
+ * Should return 0 for equality, > 0 for v1 > v2, and < 0 for v1 < v2
+ */
+extern int sl_compare(void *h1, void *h2);
+
+/* Default comparator: natural ordering of K */
+template <typename K>
+struct sl_three_way {
+  int operator()(K k1, K k2) const {
+    return (k1 == k2) ? 0 : ((k1 > k2) ? 1 : -1);
+  }
+};
+
+/* Forwards to the external sl_compare() */
+struct sl_extern_compare {
+  int operator()(void *h1, void *h2) const { return sl_compare(h1, h2); }
+};
+
+/*
+ * Variable-length key: the bytes stay where the caller keeps them (often
+ * in the payload, which then keeps them alive), while the node holds
+ * their length and first 8 bytes. The prefix is loaded big-endian and
+ * zero padded, so that comparing prefixes as integers orders keys as
+ * memcmp() would; sl_str_compare only reads the bytes behind str when
+ * two prefixes tie, which keeps most comparisons of a traversal inside
+ * the nodes themselves.
+ */
+struct sl_str_key {
+  uint64_t prefix;
+  size_t len;
+  const char *str;
+};
+
+static inline sl_str_key sl_str(const char *str, size_t len) {
+  unsigned char bytes[8] = {0};
+  memcpy(bytes, str, len < 8 ? len : 8);
+  uint64_t prefix;
+  memcpy(&prefix, bytes, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  prefix = __builtin_bswap64(prefix);
+#endif
+  sl_str_key key = {prefix, len, str};
+  return key;
+}
+
+static inline sl_str_key sl_str(const char *str) {
+  return sl_str(str, strlen(str));
+}
+
+/* Byte-wise order, shorter keys first among keys sharing their bytes */
+struct sl_str_compare {
+  int operator()(const sl_str_key &k1, const sl_str_key &k2) const {
+    if (k1.prefix != k2.prefix) return (k1.prefix > k2.prefix) ? 1 : -1;
+    size_t len = k1.len < k2.len ? k1.len : k2.len;
+    if (len > 8) {
+      int cmp = memcmp(k1.str + 8, k2.str + 8, len - 8);
+      if (cmp != 0) return cmp;
+    }
+    return (k1.len == k2.len) ? 0 : ((k1.len > k2.len) ? 1 : -1);
+  }
+};
+
+/* Elements with string keys carry a pointer to a NUL-terminated string */
+template <>
+inline sl_str_key key_from_hash<sl_str_key>(void *hash) {
+  return sl_str((const char *) hash);
+}
+
+template <>
+inline void *key_to_hash<sl_str_key>(sl_str_key key) {
+  return (void *) key.str;
+}
+
+/*
+ * Spread a key over 64 bits, as for partitioning, so that equal keys hash
+ * alike: by value for integer and pointer keys, by content for strings.
+ */
+template <typename K>
+inline uint64_t sl_key_hash(K key) {
+  return q_hash_int(key_to_hash(key));
+}
+
+template <>
+inline uint64_t sl_key_hash<sl_str_key>(sl_str_key key) {
+  return q_hash_str((void *) key.str);
+}
+
+/*
+ * Rolls tower heights, several levels per 64-bit xorshift64* draw. When p
+ * is 2^-k each level takes k bits and succeeds if they are all set (for
+ * p = 1/2, just count the trailing ones); otherwise each level takes 16
+ * bits and compares them against p scaled to 2^16. The generator state is
+ * kept by the caller, so that one roller can serve several threads.
+ */
+struct sl_rng {
+  int bits;      // bits consumed per level, 0 if p is 0
+  bool exact;    // p is 2^-bits
+  uint32_t bar;  // p * 2^16 otherwise
+  explicit sl_rng(float p) : bits(16), exact(false),
+                             bar((uint32_t) (p * 65536.0f)) {
+    if (p <= 0.0f) bits = 0;
+    for (int k = 1; k < 16 && bits == 16; k++) {
+      if (p == (float) (1.0 / (double) (1 << k))) {
+        bits = k;
+        exact = true;
+      }
+    }
+  }
+  /* Turn any seed, including 0, into a valid (non-zero) state */
+  static uint64_t seed(uint64_t s) {
+    s += 0x9e3779b97f4a7c15ULL;
+    s = (s ^ (s >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    s = (s ^ (s >> 27)) * 0x94d049bb133111ebULL;
+    s ^= s >> 31;
+    return s ? s : 1;
+  }
+  static uint64_t next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+  }
+  int height(uint64_t *state, int levels) const {
+    if (bits == 0 || levels <= 1) return 1;
+    uint64_t r = next(state);
+    if (exact && bits == 1) {
+      int height = (~r == 0) ? 65 : 1 + __builtin_ctzll(~r);
+      return height < levels ? height : levels;
+    }
+    uint64_t mask = ((uint64_t) 1 << bits) - 1;
+    int per_draw = 64 / bits;
+    int left = per_draw;
+    int height = 1;
+    while (height < levels) {
+      if (left-- == 0) {
+        r = next(state);
+        left = per_draw - 1;
+      }
+      uint64_t slice = r & mask;
+      r >>= bits;
+      if (exact ? slice != mask : slice >= bar) break;
+      height++;
+    }
+    return height;
+  }
+};
+
+/*
+ * A node is one header plus a tower of next pointers, one per sublist the
+ * node was promoted into; next[i] is the following node in sublist i. The
+ * tower is followed by as many link widths, then by any payload owned by
+ * the list. Widths of links to NULL are left undefined.
+ */
+template <typename K>
+struct sl_node {
+  void *value;
+  size_t payload_size;
+  K hash;
+  int height;
+  int owner;  // SL_* below
+  struct sl_node *next[];
+};
+
+#define SL_SHARED 0   // payload belongs to the inserted element
+#define SL_OWNED 1    // payload copied behind the tower
+#define SL_ADOPTED 2  // an sl_adopted_t behind the tower owns the payload
+
+/* An element taken over from an ele_ptr, see sl_insert(ele_ptr &&) */
+struct sl_adopted_t {
+  list_ele_t *ele;
+  pool_t *pool;  // referenced, as by the ele_ptr
+  size_t hdr;
+};
+
+/* Snapshot filled in by sl_stats() */
+struct sl_stats_t {
+  bool counted;          // built with DL_STATS; else the counts are all 0
+  int levels;            // sublists in use
+  size_t nodes;
+  size_t level_nodes[SL_STATS_LEVELS];  // nodes in sublist i
+  size_t payload_bytes;  // sum of payload sizes, owned or shared
+  size_t alloc_bytes;    // obtained by the node pool
+  stats_counts_t search;
+  stats_counts_t insert;
+  stats_counts_t remove;
+};
+
+/*
+ * Write an sl_stats() snapshot to f as one JSON object per line.
+ */
+void sl_stats_print(FILE *f, const char *name, const sl_stats_t *st);
+
+template <typename K, typename V, typename Compare, int MaxLevel>
+class basic_skip_list {
+  static_assert(MaxLevel >= 1, "at least one list");
+  public:
+    typedef sl_node<K> node_t;
+    typedef K key_type;
+    node_t *heads[MaxLevel];  // first node of each sublist
+    explicit basic_skip_list(int max_levels = MaxLevel, float p = SL_DEFAULT_P,
+                             bool grow = false, uint64_t seed = 0)
+      : max_levels(max_levels), p(p), grow(grow), count(0), adopted(0),
+        finger_ok(false), roll(p) {
+      assert(1 <= max_levels && max_levels <= MaxLevel);
+      assert(0.0f <= p && p < 1.0f);
+      for(int i = 0; i < MaxLevel; i++) {
+          heads[i] = NULL;
+          head_span[i] = 0;
+        }
+      levels = grow ? 1 : max_levels;
+      sl_stats_reset();
+      grow_at = (p > 0.0f) ? 1.0 / p : 0.0;
+      sl_seed(seed);
+      pool_init(&pool);
+    }
+    ~basic_skip_list() {
+      for (node_t *pt = heads[0]; adopted > 0 && pt != NULL; pt = pt->next[0]) {
+        if (pt->owner == SL_ADOPTED) sl_disown(pt);
+      }
+      pool_destroy(&pool);
+    }
+    basic_skip_list(const basic_skip_list &) = delete;
+    basic_skip_list &operator=(const basic_skip_list &) = delete;
+
+    bool sl_insert(list_ele_t *node);
+    bool sl_insert(ele_ptr &&ele, bool finger = false);
+    bool sl_insert_finger(list_ele_t *node);
+    size_t sl_insert_batch(list_ele_t *const *nodes, size_t n,
+                           bool even = false);
+    bool sl_delete(list_ele_t *node);
+    bool sl_delete_key(K key);
+    size_t sl_erase_range(K lo, K hi);
+    node_t *sl_peek_min() const { return heads[0]; }
+    node_t *sl_pop_min();
+    size_t sl_pop_until(K key, node_t **out, size_t max);
+    void sl_recycle(node_t *node);
+    node_t *sl_search(K key);
+    size_t sl_search_batch(const K *keys, size_t n, node_t **out);
+    node_t *sl_lower_bound(K key);
+    node_t *sl_upper_bound(K key);
+    size_t sl_range(K lo, K hi, node_t **out, size_t max);
+    void sl_print(node_t *start);
+    void sl_stats(sl_stats_t *out) const;
+    void sl_stats_reset() {
+      stats_reset(&st_search);
+      stats_reset(&st_insert);
+      stats_reset(&st_remove);
+    }
+    int sl_levels() const { return levels; }
+    /* The node allocator, e.g. to pool_set_numa() it before inserting */
+    pool_t *sl_pool() { return &pool; }
+    size_t sl_count() const { return count; }
+    size_t sl_rank(K key);
+    node_t *sl_select(size_t i);
+    /* Restart the height generator; 0 picks a seed from address and time */
+    void sl_seed(uint64_t seed) {
+      if (seed == 0) seed = (uint64_t) (uintptr_t) this ^ (uint64_t) time(NULL);
+      rng = sl_rng::seed(seed);
+    }
+
+    /* Insert a copy of val under key; the list owns the payload copy */
+    bool insert(K key, const V &val, bool finger = false) {
+      static_assert(std::is_trivially_copyable<V>::value,
+                    "payloads are copied bytewise");
+      return sl_insert_kv(key, (void *) &val, sizeof(V), SL_OWNED, finger);
+    }
+    /* Copy out and remove the smallest entry; false if the list is empty */
+    bool pop_min(K *key, V *val) {
+      node_t *node = sl_pop_min();
+      if (node == NULL) return false;
+      *key = node->hash;
+      memcpy(val, node->value, sizeof(V));
+      sl_recycle(node);
+      return true;
+    }
+    static K key(const node_t *node) { return node->hash; }
+    static V *value(node_t *node) { return (V *) node->value; }
+
+    /* Forward iterator along the bottom list, i.e. in key order */
+    class iterator {
+      public:
+        explicit iterator(node_t *node = NULL) : pt(node) {}
+        node_t *operator*() const { return pt; }
+        node_t *operator->() const { return pt; }
+        iterator &operator++() { pt = pt->next[0]; return *this; }
+        bool operator==(const iterator &o) const { return pt == o.pt; }
+        bool operator!=(const iterator &o) const { return pt != o.pt; }
+      private:
+        node_t *pt;
+    };
+    iterator begin() { return iterator(heads[0]); }
+    iterator end() { return iterator(); }
+    iterator lower_bound(K key) { return iterator(sl_lower_bound(key)); }
+    iterator upper_bound(K key) { return iterator(sl_upper_bound(key)); }
+  private:
+    pool_t pool;
+    int levels;      // sublists currently in use, <= max_levels
+    int max_levels;
+    float p;
+    bool grow;
+    size_t count;
+    size_t adopted;  // SL_ADOPTED nodes, released before the pool
+    double grow_at;  // node count at which another sublist is added
+    node_t *finger[MaxLevel];  // last insert's predecessor (or itself)
+    size_t finger_rank[MaxLevel];  // their 1-based positions
+    bool finger_ok;            // cleared whenever nodes are deleted
+    size_t head_span[MaxLevel];  // width of the link to heads[i]
+    sl_rng roll;
+    uint64_t rng;              // generator state
+    stats_counter_t st_search, st_insert, st_remove;
+    void sl_grow();
+    void sl_fit(size_t n);
+    /* The link leaving prev in sublist i, where NULL prev is the head */
+    node_t **sl_link(node_t *prev, int i) {
+      return prev ? &prev->next[i] : &heads[i];
+    }
+    /* The width of the same link */
+    size_t *sl_span(node_t *prev, int i) {
+      return prev ? &sl_widths(prev)[i] : &head_span[i];
+    }
+    static size_t *sl_widths(node_t *node) {
+      return (size_t *) &node->next[node->height];
+    }
+    /* compare(), counted against st */
+    static int sl_cmp(stats_counter_t *st, K k1, K k2) {
+      STAT_ADD(st, compares, 1);
+      return Compare()(k1, k2);
+    }
+    void sl_find(K key, node_t **prev_pts, stats_counter_t *st,
+                 size_t *ranks = NULL);
+    void sl_find_finger(K key, node_t **prev_pts, size_t *ranks);
+    node_t *sl_bound(K key, bool upper);
+    /* One sl_search() in flight in sl_search_batch() */
+    struct sl_probe {
+      size_t idx;     // position in keys, n once finished
+      node_t *prev;
+      node_t *pt;     // next node to compare, already prefetched
+      int level;
+    };
+    void sl_probe_start(sl_probe *s, size_t idx);
+    bool sl_probe_step(sl_probe *s, K key, node_t **out);
+    static void sl_prefetch(node_t *pt, int level) {
+      if (pt == NULL) return;
+      __builtin_prefetch(pt);
+      __builtin_prefetch(&pt->next[level]);
+    }
+    static size_t sl_tower(int height) {
+      return sizeof(node_t) + height * (sizeof(node_t *) + sizeof(size_t));
+    }
+    static sl_adopted_t *sl_adoption(node_t *node) {
+      return (sl_adopted_t *) ((char *) node + sl_tower(node->height));
+    }
+    void sl_disown(node_t *node);
+    void sl_release(node_t *node);
+    node_t *sl_new_node(K key, void *val, size_t size, int owner, int height);
+    node_t *sl_insert_kv(K key, void *val, size_t size, int owner,
+                         bool from_finger);
+    int sl_height() { return roll.height(&rng, levels); }
+    int sl_even_height(size_t pos);
+    void sl_promote(node_t *node, node_t **prev_pts, const size_t *ranks);
+    void sl_pop_heads(node_t *node, size_t rank);
+};
+
+/*
+ * Payloads of at most Q_INLINE_MAX bytes are copied into the node, larger
+ * ones are shared with data.
+ */
+template <typename K, typename V, typename C, int L>
+bool basic_skip_list<K, V, C, L>::sl_insert(list_ele_t *data) {
+  return sl_insert_kv(key_from_hash<K>(data->hash), data->value,
+                      data->payload_size,
+                      data->payload_size <= Q_INLINE_MAX ? SL_OWNED : SL_SHARED,
+                      false) != NULL;
+}
+
+/*
+ * Take over the element held by ele. Payloads that pack() placed inline
+ * are copied into the node as by sl_insert() and the element is freed;
+ * any other element is kept behind the node with its payload where it is,
+ * and released when the node is deleted or the list destroyed. ele is
+ * emptied on success and left as it was on failure.
+ */
+template <typename K, typename V, typename C, int L>
+bool basic_skip_list<K, V, C, L>::sl_insert(ele_ptr &&ele, bool finger) {
+  list_ele_t *data = ele.get();
+  if (data == NULL) return false;
+  K key = key_from_hash<K>(data->hash);
+  if (data->owner == ELE_COPY && data->payload_size <= Q_INLINE_MAX) {
+    if (!sl_insert_kv(key, data->value, data->payload_size, SL_OWNED, finger))
+      return false;
+    ele.reset();
+    return true;
+  }
+  node_t *node = sl_insert_kv(key, data->value, data->payload_size,
+                              SL_ADOPTED, finger);
+  if (node == NULL) return false;
+  sl_adopted_t *ad = sl_adoption(node);
+  ad->pool = ele.source();
+  ad->hdr = ele.header();
+  ad->ele = ele.release();
+  adopted++;
+  return true;
+}
+
+/*
+ * As sl_insert(), but search from the previous insertion point rather than
+ * from the top whenever data sorts after it. Cost is logarithmic
+ * in the distance from the previous insert instead of in the list size.
+ */
+template <typename K, typename V, typename C, int L>
+bool basic_skip_list<K, V, C, L>::sl_insert_finger(list_ele_t *data) {
+  return sl_insert_kv(key_from_hash<K>(data->hash), data->value,
+                      data->payload_size,
+                      data->payload_size <= Q_INLINE_MAX ? SL_OWNED : SL_SHARED,
+                      true) != NULL;
+}
+
+/*
+ * Count a successful insert, adding a sublist once the list has outgrown
+ * the current height. Its head starts out empty and fills as nodes are
+ * promoted into it.
+ */
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_grow() {
+  count++;
+  sl_fit(count);
+}
+
+/*
+ * Switch on as many sublists as a list of n nodes calls for.
+ */
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_fit(size_t n) {
+  while (grow && levels < max_levels && (double) n > grow_at) {
+    finger[levels] = NULL;
+    finger_rank[levels] = 0;
+    levels++;
+    grow_at /= p;
+  }
+}
+
+/*
+ * Traverse from top left to bottom right, advancing along each list while
+ * the next node compares strictly less than key, and record in prev_pts
+ * the last node visited in each list (NULL for its head), and in ranks,
+ * if given, its 1-based position (0 for the head).
+ */
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_find(K key, node_t **prev_pts,
+                                          stats_counter_t *st, size_t *ranks) {
+  assert(levels >= 1);  // so that prev_pts[0] is always set
+  node_t *prev = NULL;
+  size_t pos = 0;
+  for (int i = levels - 1; i >= 0; i--) {
+    node_t *pt = *sl_link(prev, i);
+    while (pt != NULL && 0 < sl_cmp(st, key, pt->hash)) {
+      STAT_ADD(st, visited, 1);
+      if (ranks != NULL) pos += *sl_span(prev, i);
+      prev = pt;
+      pt = pt->next[i];
+    }
+    prev_pts[i] = prev;
+    if (ranks != NULL) ranks[i] = pos;
+  }
+}
+
+/*
+ * Same result as sl_find(), for a key that does not sort before the last
+ * insert. Climb from the remembered bottom-list position while the next
+ * node in the current list is still below key, then descend from there.
+ * Above the level reached the remembered predecessors are still exact;
+ * below it each walk starts from whichever of the remembered node and the
+ * node found one level up lies further along.
+ */
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_find_finger(K key, node_t **prev_pts,
+                                                 size_t *ranks) {
+  stats_counter_t *st = &st_insert;
+  int top = 0;
+  while (top + 1 < levels) {
+    node_t *next = *sl_link(finger[top], top);
+    if (next == NULL || 0 >= sl_cmp(st, key, next->hash)) break;
+    top++;
+  }
+  for (int i = levels - 1; i > top; i--) {
+    prev_pts[i] = finger[i];
+    ranks[i] = finger_rank[i];
+  }
+  node_t *prev = finger[top];
+  size_t pos = finger_rank[top];
+  for (int i = top; i >= 0; i--) {
+    if (finger[i] != NULL &&
+        (prev == NULL || 0 > sl_cmp(st, prev->hash, finger[i]->hash))) {
+      prev = finger[i];
+      pos = finger_rank[i];
+    }
+    node_t *pt = *sl_link(prev, i);
+    while (pt != NULL && 0 < sl_cmp(st, key, pt->hash)) {
+      STAT_ADD(st, visited, 1);
+      pos += *sl_span(prev, i);
+      prev = pt;
+      pt = pt->next[i];
+    }
+    prev_pts[i] = prev;
+    ranks[i] = pos;
+  }
+}
+
+/* Bytes behind the tower of a node with the given owner */
+#define SL_EXTRA(owner, size) ((owner) == SL_OWNED ? (size) : \
+    (owner) == SL_ADOPTED ? sizeof(sl_adopted_t) : 0)
+
+/*
+ * Allocate a node with room for height next pointers, plus a copy of its
+ * payload for SL_OWNED or room for the adopted element for SL_ADOPTED.
+ */
+template <typename K, typename V, typename C, int L>
+typename basic_skip_list<K, V, C, L>::node_t *
+basic_skip_list<K, V, C, L>::sl_new_node(K key, void *val, size_t size,
+                                         int owner, int height) {
+  size_t tower = sl_tower(height);
+  node_t *node = (node_t *) pool_alloc(&pool, tower + SL_EXTRA(owner, size));
+  if (!node) return NULL;
+  node->hash = key;
+  node->payload_size = size;
+  node->height = height;
+  node->owner = owner;
+  node->value = val;
+  if (owner == SL_OWNED) {
+    node->value = (char *) node + tower;
+    memcpy(node->value, val, size);
+  }
+  return node;
+}
+
+/*
+ * Roll the node's height first so that exactly that many next pointers are
+ * allocated, then splice it in after the nodes found by sl_find() and
+ * promote it into the lists above. The finger is only resumed from for
+ * keys above the last one inserted, so that a duplicate lands before its
+ * equals in every sublist, as from sl_find(), and the sublists stay in
+ * the bottom list's order.
+ */
+template <typename K, typename V, typename C, int L>
+typename basic_skip_list<K, V, C, L>::node_t *
+basic_skip_list<K, V, C, L>::sl_insert_kv(K key, void *val, size_t size,
+                                          int owner, bool from_finger) {
+  node_t *node = sl_new_node(key, val, size, owner, sl_height());
+  if (!node) return NULL;
+  STAT_ADD(&st_insert, calls, 1);
+  node_t *prev_pts[L];
+  size_t ranks[L];
+  if (from_finger && finger_ok &&
+      0 < sl_cmp(&st_insert, key, finger[0]->hash)) {
+    sl_find_finger(key, prev_pts, ranks);
+  }
+  else {
+    sl_find(key, prev_pts, &st_insert, ranks);
+  }
+  node_t **link = sl_link(prev_pts[0], 0);
+  node->next[0] = *link;
+  *link = node;
+  sl_promote(node, prev_pts, ranks);
+  for (int i = 0; i < levels; i++) {
+    bool in = i < node->height;
+    finger[i] = in ? node : prev_pts[i];
+    finger_rank[i] = in ? ranks[0] + 1 : ranks[i];
+  }
+  finger_ok = true;
+  sl_grow();
+  return node;
+}
+
+/*
+ * Insert n elements sorted by hash. As long as they do not sort before the
+ * current last node they are appended in a single pass, keeping the tail of
+ * every list at hand, with heights rolled as usual or, if even is set,
+ * assigned deterministically; any that arrive out of order go through
+ * sl_insert_finger(). Sublists are switched on as the nodes already in
+ * call for them, so a batch that stops early leaves no extra height.
+ * Returns the number of elements inserted.
+ */
+template <typename K, typename V, typename C, int L>
+size_t basic_skip_list<K, V, C, L>::sl_insert_batch(list_ele_t *const *nodes,
+                                                    size_t n, bool even) {
+  stats_counter_t *st = &st_insert;
+  node_t *tails[L];
+  size_t tail_rank[L];
+  node_t *prev = NULL;
+  size_t pos = 0;
+  for (int i = levels - 1; i >= 0; i--) {
+    for (node_t *pt = *sl_link(prev, i); pt != NULL; pt = pt->next[i]) {
+      STAT_ADD(st, visited, 1);
+      pos += *sl_span(prev, i);
+      prev = pt;
+    }
+    tails[i] = prev;
+    tail_rank[i] = pos;
+  }
+  size_t done = 0;
+  for (; done < n; done++) {
+    list_ele_t *data = nodes[done];
+    K key = key_from_hash<K>(data->hash);
+    if (tails[0] != NULL && 0 > sl_cmp(st, key, tails[0]->hash)) break;
+    int height = even ? sl_even_height(count + 1) : sl_height();
+    node_t *node = sl_new_node(key, data->value, data->payload_size,
+                               data->payload_size <= Q_INLINE_MAX ?
+                               SL_OWNED : SL_SHARED, height);
+    if (!node) break;
+    for (int i = 0; i < height; i++) {
+      node->next[i] = NULL;
+      *sl_link(tails[i], i) = node;
+      *sl_span(tails[i], i) = count + 1 - tail_rank[i];
+      tails[i] = node;
+      tail_rank[i] = count + 1;
+    }
+    STAT_ADD(st, calls, 1);
+    count++;
+    int top = levels;
+    sl_fit(count);
+    for (; top < levels; top++) {
+      tails[top] = NULL;
+      tail_rank[top] = 0;
+    }
+  }
+  if (tails[0] != NULL) {
+    memcpy(finger, tails, levels * sizeof(node_t *));
+    memcpy(finger_rank, tail_rank, levels * sizeof(size_t));
+    finger_ok = true;
+  }
+  for (; done < n; done++) {
+    if (!sl_insert_finger(nodes[done])) break;
+  }
+  return done;
+}
+
+/*
+ * Release the element an SL_ADOPTED node took over, and its pool.
+ */
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_disown(node_t *node) {
+  sl_adopted_t *ad = sl_adoption(node);
+  unpack_as(ad->pool, ad->hdr, ad->ele);
+  pool_free(ad->pool);
+  adopted--;
+}
+
+/*
+ * Hand a detached node back to the pool, along with its payload if the
+ * list owned a copy or the element it came in if it adopted one.
+ */
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_release(node_t *node) {
+  if (node->owner == SL_ADOPTED) sl_disown(node);
+  pool_release(&pool, node, sl_tower(node->height) +
+                            SL_EXTRA(node->owner, node->payload_size));
+}
+
+/*
+ * Delete the first node whose hash matches node's.
+ */
+template <typename K, typename V, typename C, int L>
+bool basic_skip_list<K, V, C, L>::sl_delete(list_ele_t *node) {
+  if (node==NULL) return false;
+  return sl_delete_key(key_from_hash<K>(node->hash));
+}
+
+/*
+ * Find the predecessors of key in every list as sl_insert() does, then
+ * unlink the first matching node from each list it was promoted into,
+ * folding its links' widths into its predecessors', and narrow the links
+ * passing over it above its tower. Each link is followed until it reaches
+ * the node, in case duplicates of key precede it.
+ */
+template <typename K, typename V, typename C, int L>
+bool basic_skip_list<K, V, C, L>::sl_delete_key(K key) {
+  STAT_ADD(&st_remove, calls, 1);
+  node_t *prev_pts[L];
+  sl_find(key, prev_pts, &st_remove);
+  node_t *node = *sl_link(prev_pts[0], 0);
+  if (node == NULL || 0 != sl_cmp(&st_remove, key, node->hash)) return false;
+  finger_ok = false;
+  for (int i = levels - 1; i >= 0; i--) {
+    node_t *prev = prev_pts[i];
+    if (i >= node->height) {
+      if (*sl_link(prev, i) != NULL) (*sl_span(prev, i))--;
+      continue;
+    }
+    while (*sl_link(prev, i) != node) {
+      STAT_ADD(&st_remove, visited, 1);
+      prev = *sl_link(prev, i);
+    }
+    if (node->next[i] != NULL) *sl_span(prev, i) += sl_widths(node)[i] - 1;
+    *sl_link(prev, i) = node->next[i];
+  }
+  sl_release(node);
+  count--;
+  return true;
+}
+
+/*
+ * Delete every node with lo <= hash < hi. Each list is cut once, from the
+ * predecessor of lo straight to the first node not below hi, summing the
+ * widths of the links cut out, and the detached run is then freed along
+ * the bottom list. Every new link then spans what the cut ones did, less
+ * the nodes deleted. Returns the number of nodes deleted.
+ */
+template <typename K, typename V, typename C, int L>
+size_t basic_skip_list<K, V, C, L>::sl_erase_range(K lo, K hi) {
+  C compare;
+  if (0 <= compare(lo, hi)) return 0;
+  STAT_ADD(&st_remove, calls, 1);
+  node_t *prev_pts[L];
+  sl_find(lo, prev_pts, &st_remove);
+  node_t *run = *sl_link(prev_pts[0], 0);
+  finger_ok = false;
+  size_t spans[L];
+  for (int i = levels - 1; i >= 0; i--) {
+    node_t **link = sl_link(prev_pts[i], i);
+    node_t *pt = *link;
+    spans[i] = (pt != NULL) ? *sl_span(prev_pts[i], i) : 0;
+    while (pt != NULL && 0 > compare(pt->hash, hi)) {
+      if (pt->next[i] != NULL) spans[i] += sl_widths(pt)[i];
+      pt = pt->next[i];
+    }
+    *link = pt;
+  }
+  size_t erased = 0;
+  while (run != NULL && 0 > compare(run->hash, hi)) {
+    node_t *next = run->next[0];
+    sl_release(run);
+    run = next;
+    erased++;
+  }
+  for (int i = 0; i < levels; i++) {
+    if (*sl_link(prev_pts[i], i) != NULL) {
+      *sl_span(prev_pts[i], i) = spans[i] - erased;
+    }
+  }
+  count -= erased;
+  return erased;
+}
+
+/*
+ * Detach the smallest node. It heads every sublist it was promoted into,
+ * so unlinking it is one store per level of its tower and no search.
+ * The node stays valid, payload included, until passed to sl_recycle().
+ * Returns NULL if the list is empty.
+ */
+template <typename K, typename V, typename C, int L>
+typename basic_skip_list<K, V, C, L>::node_t *
+basic_skip_list<K, V, C, L>::sl_pop_min() {
+  node_t *node = heads[0];
+  if (node == NULL) return NULL;
+  STAT_ADD(&st_remove, calls, 1);
+  sl_pop_heads(node, 1);
+  for (int i = 0; i < levels; i++) {
+    head_span[i]--;
+  }
+  finger_ok = false;
+  count--;
+  return node;
+}
+
+/*
+ * Detach up to max of the smallest nodes whose hash is at most key, such
+ * as the timers due by then, storing them in out in key order. Every node
+ * taken is at that point the head of each sublist it was promoted into,
+ * so the lists are cut by advancing their heads along the taken prefix of
+ * the bottom list: O(1) expected per node, with no descent from the top.
+ * The nodes stay valid until passed to sl_recycle(). Returns the number
+ * of nodes stored.
+ */
+template <typename K, typename V, typename C, int L>
+size_t basic_skip_list<K, V, C, L>::sl_pop_until(K key, node_t **out,
+                                                 size_t max) {
+  stats_counter_t *st = &st_remove;
+  STAT_ADD(st, calls, 1);
+  size_t n = 0;
+  while (n < max && heads[0] != NULL && 0 <= sl_cmp(st, key, heads[0]->hash)) {
+    node_t *node = heads[0];
+    STAT_ADD(st, visited, 1);
+    sl_pop_heads(node, ++n);
+    out[n - 1] = node;
+  }
+  for (int i = 0; n > 0 && i < levels; i++) {
+    head_span[i] -= n;
+  }
+  if (n > 0) finger_ok = false;
+  count -= n;
+  return n;
+}
+
+/*
+ * Advance every head node leads past it. node is at position rank of the
+ * list as it was before the current pop, and the heads' widths are left
+ * relative to that, for the caller to shift once all nodes are taken.
+ */
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_pop_heads(node_t *node, size_t rank) {
+  for (int i = 0; i < node->height; i++) {
+    heads[i] = node->next[i];
+    if (heads[i] != NULL) head_span[i] = rank + sl_widths(node)[i];
+  }
+}
+
+/*
+ * Hand a node detached by sl_pop_min() or sl_pop_until() back to the
+ * list's pool. No effect if node is NULL
+ */
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_recycle(node_t *node) {
+  if (node == NULL) return;
+  sl_release(node);
+}
+
+/*
+ * Traverse list from top left to bottom right, returning first node found
+ * this way on a hash match. Returns NULL if no node is found in this way.
+ */
+template <typename K, typename V, typename C, int L>
+typename basic_skip_list<K, V, C, L>::node_t *
+basic_skip_list<K, V, C, L>::sl_search(K key) {
+  stats_counter_t *st = &st_search;
+  STAT_ADD(st, calls, 1);
+  node_t *prev = NULL;
+  for (int i = levels - 1; i >= 0; i--) {
+    node_t *pt = *sl_link(prev, i);
+    int cmp = 1;
+    while (pt != NULL && 0 < (cmp = sl_cmp(st, key, pt->hash))) {
+      STAT_ADD(st, visited, 1);
+      prev = pt;
+      pt = pt->next[i];
+    }
+    if (pt != NULL && 0 == cmp) {
+      return pt;
+    }
+  }
+  return NULL;
+}
+
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_probe_start(sl_probe *s, size_t idx) {
+  s->idx = idx;
+  s->prev = NULL;
+  s->level = levels - 1;
+  s->pt = heads[s->level];
+  sl_prefetch(s->pt, s->level);
+}
+
+/*
+ * Advance one probe by a single node on the path sl_search() takes, and
+ * prefetch the node it will look at next. Returns false once the probe
+ * has stored its result.
+ */
+template <typename K, typename V, typename C, int L>
+bool basic_skip_list<K, V, C, L>::sl_probe_step(sl_probe *s, K key,
+                                                node_t **out) {
+  int cmp = (s->pt != NULL) ? sl_cmp(&st_search, key, s->pt->hash) : -1;
+  if (0 < cmp) {
+    STAT_ADD(&st_search, visited, 1);
+    s->prev = s->pt;
+    s->pt = s->pt->next[s->level];
+  }
+  else if (0 == cmp || s->level == 0) {
+    out[s->idx] = (0 == cmp) ? s->pt : NULL;
+    return false;
+  }
+  else {
+    s->level--;
+    s->pt = *sl_link(s->prev, s->level);
+  }
+  sl_prefetch(s->pt, s->level);
+  return true;
+}
+
+/*
+ * sl_search() for n keys, storing each result (or NULL) in out. Up to
+ * SL_BATCH_GROUP searches are interleaved, each taking one step per round,
+ * so that while one waits on a node the misses of the others are already
+ * under way; a finished slot takes the next key. Returns the number found.
+ */
+template <typename K, typename V, typename C, int L>
+size_t basic_skip_list<K, V, C, L>::sl_search_batch(const K *keys, size_t n,
+                                                    node_t **out) {
+  STAT_ADD(&st_search, calls, n);
+  sl_probe probes[SL_BATCH_GROUP];
+  size_t next = 0, active = 0;
+  for (; active < SL_BATCH_GROUP && next < n; active++) {
+    sl_probe_start(&probes[active], next++);
+  }
+  while (active > 0) {
+    for (size_t j = 0; j < active; ) {
+      sl_probe *s = &probes[j];
+      if (sl_probe_step(s, keys[s->idx], out)) {
+        j++;
+      }
+      else if (next < n) {
+        sl_probe_start(s, next++);
+        j++;
+      }
+      else {
+        *s = probes[--active];
+      }
+    }
+  }
+  size_t found = 0;
+  for (size_t j = 0; j < n; j++) {
+    found += out[j] != NULL;
+  }
+  return found;
+}
+
+/*
+ * Descend as sl_find() does, but only remember the bottom list: the first
+ * node not below key (or, if upper, the first node above it).
+ */
+template <typename K, typename V, typename C, int L>
+typename basic_skip_list<K, V, C, L>::node_t *
+basic_skip_list<K, V, C, L>::sl_bound(K key, bool upper) {
+  C compare;
+  node_t *prev = NULL;
+  node_t *pt = NULL;
+  for (int i = levels - 1; i >= 0; i--) {
+    pt = *sl_link(prev, i);
+    while (pt != NULL && (upper ? 0 <= compare(key, pt->hash)
+                                : 0 < compare(key, pt->hash))) {
+      prev = pt;
+      pt = pt->next[i];
+    }
+  }
+  return pt;
+}
+
+/*
+ * First node whose hash is not less than key, or NULL.
+ */
+template <typename K, typename V, typename C, int L>
+typename basic_skip_list<K, V, C, L>::node_t *
+basic_skip_list<K, V, C, L>::sl_lower_bound(K key) {
+  return sl_bound(key, false);
+}
+
+/*
+ * First node whose hash is greater than key, or NULL.
+ */
+template <typename K, typename V, typename C, int L>
+typename basic_skip_list<K, V, C, L>::node_t *
+basic_skip_list<K, V, C, L>::sl_upper_bound(K key) {
+  return sl_bound(key, true);
+}
+
+/*
+ * Number of nodes whose hash sorts before key, i.e. the 0-based position
+ * of sl_lower_bound(key). Descends as sl_bound() does, summing the widths
+ * of the links it follows.
+ */
+template <typename K, typename V, typename C, int L>
+size_t basic_skip_list<K, V, C, L>::sl_rank(K key) {
+  C compare;
+  node_t *prev = NULL;
+  size_t pos = 0;
+  for (int i = levels - 1; i >= 0; i--) {
+    node_t *pt = *sl_link(prev, i);
+    while (pt != NULL && 0 < compare(key, pt->hash)) {
+      pos += *sl_span(prev, i);
+      prev = pt;
+      pt = pt->next[i];
+    }
+  }
+  return pos;
+}
+
+/*
+ * The node at 0-based position i in key order, or NULL if i >= sl_count().
+ * Following a link is allowed while it does not overshoot position i.
+ */
+template <typename K, typename V, typename C, int L>
+typename basic_skip_list<K, V, C, L>::node_t *
+basic_skip_list<K, V, C, L>::sl_select(size_t i) {
+  if (i >= count) return NULL;
+  node_t *prev = NULL;
+  size_t pos = 0;
+  for (int lvl = levels - 1; lvl >= 0; lvl--) {
+    node_t *pt;
+    while ((pt = *sl_link(prev, lvl)) != NULL &&
+           pos + *sl_span(prev, lvl) <= i + 1) {
+      pos += *sl_span(prev, lvl);
+      prev = pt;
+    }
+    if (pos == i + 1) break;
+  }
+  return prev;
+}
+
+/*
+ * Store up to max nodes with lo <= hash < hi in out, in key order, and
+ * return how many were stored. One descent, then a walk of the bottom list.
+ */
+template <typename K, typename V, typename C, int L>
+size_t basic_skip_list<K, V, C, L>::sl_range(K lo, K hi, node_t **out,
+                                             size_t max) {
+  C compare;
+  size_t n = 0;
+  for (node_t *pt = sl_lower_bound(lo);
+       n < max && pt != NULL && 0 > compare(pt->hash, hi); pt = pt->next[0]) {
+    out[n++] = pt;
+  }
+  return n;
+}
+
+/*
+ * Print out the skip list. If start is non-NULL, print that sublist first.
+ */
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_print(node_t *start) {
+  if (start != NULL) {
+    while (start->next[0] != NULL) {
+      printf("|%ld|  -->  ", (long) start->hash);
+      start = start->next[0];
+    }
+    printf("|%ld|  --X\n", (long) start->hash);
+
+  }
+  for (int i = levels - 1; i >=0; i--) {
+    printf("List %d:\t", i);
+    node_t *pt = heads[i];
+    if (pt==NULL) {
+      printf("  --X\n");
+      continue;
+    }
+    while (pt->next[i] != NULL) {
+      printf("|%ld|  -->  ", (long) pt->hash);
+      pt = pt->next[i];
+    }
+    printf("|%ld|  --X\n", (long) pt->hash);
+  }
+}
+/*
+ * Walk the bottom list once, tallying heights and payloads; the nodes in
+ * sublist i are then those taller than i.
+ */
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_stats(sl_stats_t *out) const {
+  out->counted = STATS_ENABLED;
+  out->levels = levels;
+  out->nodes = count;
+  out->payload_bytes = 0;
+  out->alloc_bytes = pool.bytes;
+  memset(out->level_nodes, 0, sizeof(out->level_nodes));
+  for (const node_t *pt = heads[0]; pt != NULL; pt = pt->next[0]) {
+    int top = (pt->height < SL_STATS_LEVELS) ? pt->height : SL_STATS_LEVELS;
+    out->level_nodes[top - 1]++;
+    out->payload_bytes += pt->payload_size;
+  }
+  for (int i = SL_STATS_LEVELS - 2; i >= 0; i--) {
+    out->level_nodes[i] += out->level_nodes[i + 1];
+  }
+  out->search = stats_read(&st_search);
+  out->insert = stats_read(&st_insert);
+  out->remove = stats_read(&st_remove);
+}
+
+/*
+ * Height of the node at 1-based position pos of a bulk load: promoted once
+ * more for every factor of r = 1/p dividing pos, which spaces the upper
+ * lists evenly. r is rounded to an integer of at least 2.
+ */
+template <typename K, typename V, typename C, int L>
+int basic_skip_list<K, V, C, L>::sl_even_height(size_t pos) {
+  if (p <= 0.0f) return 1;
+  size_t r = (size_t) (1.0f / p + 0.5f);
+  if (r < 2) r = 2;
+  int height = 1;
+  while (height < levels && pos % r == 0) {
+    pos /= r;
+    height++;
+  }
+  return height;
+}
+
+/*
+ * Link node, just linked into the bottom list after prev_pts[0], into the
+ * lists above up to its height, splitting the widths of the links it cuts
+ * with the help of their owners' ranks, and widen the links passing over
+ * it above its tower.
+ */
+template <typename K, typename V, typename C, int L>
+void basic_skip_list<K, V, C, L>::sl_promote(node_t *node, node_t **prev_pts,
+                                           const size_t *ranks) {
+  size_t rank = ranks[0] + 1;
+  size_t *widths = sl_widths(node);
+  widths[0] = 1;
+  *sl_span(prev_pts[0], 0) = 1;
+  for (int i = 1; i < levels; i++) {
+    node_t **link = sl_link(prev_pts[i], i);
+    size_t *span = sl_span(prev_pts[i], i);
+    if (i < node->height) {
+      node->next[i] = *link;
+      if (*link != NULL) widths[i] = ranks[i] + *span + 1 - rank;
+      *link = node;
+      *span = rank - ranks[i];
+    }
+    else if (*link != NULL) {
+      (*span)++;
+    }
+  }
+}
+
+/* The compatibility instantiation lives in skip.cpp */
+extern template class basic_skip_list<void *, char, sl_extern_compare,
+                                      SL_MAX_LEVELS>;
+
+/*
+ * The compatibility types use SL_DEFAULT_LEVELS sublists unless told
+ * otherwise, as they always have, but may be given or grow into up to
+ * SL_MAX_LEVELS for large lists.
+ */
+class skip_list
+  : public basic_skip_list<void *, char, sl_extern_compare, SL_MAX_LEVELS> {
+  public:
+    explicit skip_list(int max_levels = SL_DEFAULT_LEVELS,
+                       float p = SL_DEFAULT_P, bool grow = false,
+                       uint64_t seed = 0)
+      : basic_skip_list(max_levels, p, grow, seed) {}
+};
+
+class str_skip_list
+  : public basic_skip_list<sl_str_key, char, sl_str_compare, SL_MAX_LEVELS> {
+  public:
+    explicit str_skip_list(int max_levels = SL_DEFAULT_LEVELS,
+                           float p = SL_DEFAULT_P, bool grow = false,
+                           uint64_t seed = 0)
+      : basic_skip_list(max_levels, p, grow, seed) {}
+};
+
+#endif
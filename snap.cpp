@@ -0,0 +1,339 @@
+/*
+ * This program implements the mmap()able snapshots of snap.h.
+ *
+ * See snap.h for the file layout.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snap.h"
+#include "simd.h"
+#include "skip.h"
+
+static uint64_t snap_align(uint64_t off)
+{
+  return (off + SNAP_ALIGN - 1) & ~(uint64_t) (SNAP_ALIGN - 1);
+}
+
+/*
+ * Payloads are streamed out past where the arrays will go while the
+ * arrays are collected in memory; the header and arrays are written last.
+ */
+static bool snap_fill(FILE *f, snap_header_t *hdr, uint64_t *arrays,
+                      snap_next_fn next, void *cursor)
+{
+  static const char zeros[SNAP_ALIGN] = {0};
+  size_t n = hdr->count;
+  uint64_t *keys = arrays, *sizes = arrays + n, *offs = arrays + 2 * n;
+  uint64_t at = 0;
+  if (fseek(f, (long) hdr->data_off, SEEK_SET) != 0) return false;
+  void *hash;
+  const void *val;
+  size_t size;
+  size_t i = 0;
+  for (; next(cursor, &hash, &val, &size); i++)
+  {
+    if (i == n) return false;
+    uint64_t pad = snap_align(at) - at;
+    if (pad > 0 && fwrite(zeros, 1, pad, f) != pad) return false;
+    at += pad;
+    if (size > 0 && fwrite(val, 1, size, f) != size) return false;
+    keys[i] = (uint64_t) (uintptr_t) hash;
+    sizes[i] = size;
+    offs[i] = at;
+    at += size;
+  }
+  if (i != n) return false;
+  hdr->file_len = hdr->data_off + at;
+  if (fseek(f, 0, SEEK_SET) != 0) return false;
+  if (fwrite(hdr, sizeof(*hdr), 1, f) != 1) return false;
+  if (fseek(f, (long) hdr->keys_off, SEEK_SET) != 0) return false;
+  if (n > 0 && fwrite(arrays, sizeof(uint64_t), 3 * n, f) != 3 * n)
+    return false;
+  if (fflush(f) != 0) return false;
+  return fsync(fileno(f)) == 0;
+}
+
+bool snap_write(const char *path, size_t n, unsigned flags, snap_next_fn next,
+                void *cursor)
+{
+  if (path==NULL || next==NULL) return false;
+  size_t len = strlen(path);
+  char *tmp = (char *) malloc(len + 5);
+  uint64_t *arrays = (uint64_t *) malloc(3 * n * sizeof(uint64_t) + 1);
+  bool ok = false;
+  if (tmp!=NULL && arrays!=NULL)
+  {
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", 5);
+    snap_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAP_VERSION;
+    hdr.flags = flags;
+    hdr.count = n;
+    hdr.keys_off = snap_align(sizeof(hdr));
+    hdr.sizes_off = hdr.keys_off + n * sizeof(uint64_t);
+    hdr.offs_off = hdr.sizes_off + n * sizeof(uint64_t);
+    hdr.data_off = snap_align(hdr.offs_off + n * sizeof(uint64_t));
+    FILE *f = fopen(tmp, "wb");
+    if (f!=NULL)
+    {
+      ok = snap_fill(f, &hdr, arrays, next, cursor);
+      ok = (fclose(f) == 0) && ok;
+      ok = ok && rename(tmp, path) == 0;
+      if (!ok) unlink(tmp);
+    }
+  }
+  free(arrays);
+  free(tmp);
+  return ok;
+}
+
+static bool snap_next_q(void *cursor, void **hash, const void **val,
+                        size_t *size)
+{
+  list_ele_t **pt = (list_ele_t **) cursor;
+  if (*pt == NULL) return false;
+  *hash = (*pt)->hash;
+  *val = (*pt)->value;
+  *size = (*pt)->payload_size;
+  *pt = (*pt)->next;
+  return true;
+}
+
+bool snap_write_q(queue_t *q, const char *path)
+{
+  if (q==NULL) return false;
+  list_ele_t *pt = q->head;
+  return snap_write(path, q->nodes, 0, snap_next_q, &pt);
+}
+
+/*
+ * The header fixes where everything is; check that it all lies inside the
+ * file before handing out pointers into it.
+ */
+static bool snap_valid(const char *base, size_t len)
+{
+  if (len < sizeof(snap_header_t)) return false;
+  const snap_header_t *hdr = (const snap_header_t *) base;
+  if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) != 0) return false;
+  if (hdr->version != SNAP_VERSION || hdr->file_len != len) return false;
+  uint64_t n = hdr->count;
+  if (n > len / (3 * sizeof(uint64_t))) return false;
+  uint64_t words = n * sizeof(uint64_t);
+  // Bound the offsets by len before adding to them, so that none can wrap
+  if (hdr->data_off > len || hdr->keys_off > hdr->data_off) return false;
+  if (hdr->keys_off < sizeof(snap_header_t) || hdr->keys_off % 8 != 0 ||
+      hdr->data_off - hdr->keys_off < 3 * words ||
+      hdr->sizes_off != hdr->keys_off + words ||
+      hdr->offs_off != hdr->sizes_off + words)
+    return false;
+  const uint64_t *sizes = (const uint64_t *) (base + hdr->sizes_off);
+  const uint64_t *offs = (const uint64_t *) (base + hdr->offs_off);
+  uint64_t data_len = len - hdr->data_off;
+  for (uint64_t i = 0; i < n; i++)
+    if (offs[i] > data_len || sizes[i] > data_len - offs[i]) return false;
+  return true;
+}
+
+snap_t *snap_open(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0)
+  {
+    close(fd);
+    return NULL;
+  }
+  size_t len = (size_t) st.st_size;
+  void *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return NULL;
+  snap_t *snap = (snap_t *) malloc(sizeof(snap_t));
+  if (snap==NULL || !snap_valid((const char *) base, len))
+  {
+    free(snap);
+    munmap(base, len);
+    return NULL;
+  }
+  const snap_header_t *hdr = (const snap_header_t *) base;
+  snap->base = (const char *) base;
+  snap->len = len;
+  snap->flags = hdr->flags;
+  snap->count = hdr->count;
+  snap->keys = (const uint64_t *) (snap->base + hdr->keys_off);
+  snap->sizes = (const uint64_t *) (snap->base + hdr->sizes_off);
+  snap->offs = (const uint64_t *) (snap->base + hdr->offs_off);
+  snap->data = snap->base + hdr->data_off;
+  return snap;
+}
+
+void snap_close(snap_t *snap)
+{
+  if (snap==NULL) return;
+  munmap((void *) snap->base, snap->len);
+  free(snap);
+}
+
+size_t snap_find(const snap_t *snap, void *hash)
+{
+  return simd_find_eq(snap->keys, snap->count, (uint64_t) (uintptr_t) hash);
+}
+
+size_t snap_search(const snap_t *snap, void *hash)
+{
+  return snap_search_t(snap, hash, sl_extern_compare());
+}
+
+queue_t *snap_load_q(const snap_t *snap, unsigned flags)
+{
+  queue_t *q = q_new_flags(flags);
+  if (q==NULL) return NULL;
+  for (size_t i = 0; i < snap->count; i++)
+  {
+    list_ele_t *ele = q_pack(q, (void *) snap_value(snap, i),
+                             snap_size(snap, i), snap_hash(snap, i));
+    if (!q_insert_tail(q, ele))
+    {
+      q_release(q, ele);
+      q_free(q);
+      return NULL;
+    }
+  }
+  return q;
+}
+
+void test_snap() {
+  char path[] = "/tmp/dl_snap_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  // Compatibility skip list: small payloads copied, large ones shared
+  char small[16] = "small";
+  char big[Q_INLINE_MAX + 8] = "out of line";
+  list_ele_t *eles[1000];
+  skip_list sl;
+  for (intptr_t i = 0; i < 1000; i++) {
+    intptr_t k = (i * 7) % 1000;
+    memcpy(small, &k, sizeof(k));
+    memcpy(big, &k, sizeof(k));
+    eles[i] = (k % 3 == 0) ? pack(big, sizeof(big), (void *) (2 * k + 2))
+                           : pack(small, sizeof(small), (void *) (2 * k + 2));
+    assert(sl.sl_insert(eles[i]));
+  }
+  assert(snap_write_sl(sl, path));
+  snap_t *snap = snap_open(path);
+  assert(snap && snap_count(snap) == 1000 && (snap->flags & SNAP_SORTED));
+  for (intptr_t k = 0; k < 1000; k++) {
+    size_t i = snap_search(snap, (void *) (2 * k + 2));
+    assert(i == (size_t) k && snap_hash(snap, i) == (void *) (2 * k + 2));
+    assert(snap_size(snap, i) == ((k % 3 == 0) ? sizeof(big) : sizeof(small)));
+    assert(*(const intptr_t *) snap_value(snap, i) == k);
+    assert((uintptr_t) snap_value(snap, i) % SNAP_ALIGN == 0);
+    assert(snap_search(snap, (void *) (2 * k + 3)) == 1000);
+    assert(snap_find(snap, (void *) (2 * k + 2)) == i);
+  }
+  size_t first;
+  assert(snap_range_t(snap, (void *) 10, (void *) 20, &first,
+                      sl_extern_compare()) == 5);
+  assert(snap_hash(snap, first) == (void *) 10);
+  assert(snap_range_t(snap, (void *) 20, (void *) 10, &first,
+                      sl_extern_compare()) == 0);
+  skip_list loaded;
+  assert(snap_load_sl(snap, loaded) == 1000 && loaded.sl_count() == 1000);
+  for (intptr_t k = 0; k < 1000; k++) {
+    skip_list::node_t *hit = loaded.sl_search((void *) (2 * k + 2));
+    assert(hit && *(intptr_t *) hit->value == k);
+  }
+  for (int i = 0; i < 1000; i++) {
+    unpack(NULL, eles[i]);
+  }
+
+  // Typed keys keep their sign and order through the file
+  typedef basic_skip_list<int64_t, int64_t, sl_three_way<int64_t>, 32> isl_t;
+  isl_t isl(16, 0.5f, true);
+  for (int64_t k = -500; k < 500; k++) {
+    assert(isl.insert(k, k * k, true));
+  }
+  assert(snap_write_sl(isl, path));
+  snap_t *isnap = snap_open(path);
+  assert(isnap && snap_count(isnap) == 1000);
+  sl_three_way<int64_t> cmp;
+  for (int64_t k = -500; k < 500; k++) {
+    size_t i = snap_search_t(isnap, k, cmp);
+    assert(i == (size_t) (k + 500));
+    assert(*(const int64_t *) snap_value(isnap, i) == k * k);
+  }
+  assert(snap_search_t(isnap, (int64_t) 500, cmp) == 1000);
+  assert(snap_lower_bound_t(isnap, (int64_t) -1000, cmp) == 0);
+  assert(snap_range_t(isnap, (int64_t) -3, (int64_t) 3, &first, cmp) == 6);
+  isl_t iloaded(16, 0.5f, true);
+  assert(snap_load_sl(isnap, iloaded) == 1000 && iloaded.sl_levels() == 10);
+  for (int64_t k = -500; k < 500; k++) {
+    sl_node<int64_t> *hit = iloaded.sl_search(k);
+    assert(hit && *iloaded.value(hit) == k * k);
+  }
+  snap_close(isnap);
+  snap_close(snap);
+
+  // Queues come back in the same order
+  queue_t *q = q_new_pooled();
+  for (intptr_t i = 0; i < 100; i++) {
+    size_t n = (i % 4 == 0) ? sizeof(big) : (size_t) (i % 7);
+    memcpy(big, &i, sizeof(i));
+    assert(q_insert_tail(q, q_pack(q, big, n, (void *) (100 - i))));
+  }
+  assert(snap_write_q(q, path));
+  snap = snap_open(path);
+  assert(snap && snap_count(snap) == 100 && !(snap->flags & SNAP_SORTED));
+  assert(snap_find(snap, (void *) 1) == 99 && snap_find(snap, NULL) == 100);
+  queue_t *q2 = snap_load_q(snap, Q_DOUBLY);
+  assert(q2 && q_nodes(q2) == 100 && q_size(q2) == q_size(q));
+  for (list_ele_t *a = q->head, *b = q2->head; a != NULL;
+       a = a->next, b = b->next) {
+    assert(b && a->hash == b->hash && a->payload_size == b->payload_size);
+    assert(0 == memcmp(a->value, b->value, a->payload_size));
+  }
+  snap_close(snap);
+  q_free(q2);
+
+  // Arrays moved back by their own length, so that keys_off wraps
+  snap_header_t hdr;
+  FILE *f = fopen(path, "r+b");
+  assert(f && fread(&hdr, sizeof(hdr), 1, f) == 1);
+  uint64_t words = hdr.count * sizeof(uint64_t);
+  assert(hdr.keys_off < words);
+  hdr.keys_off -= words;
+  hdr.sizes_off -= words;
+  hdr.offs_off -= words;
+  assert(fseek(f, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, f) == 1);
+  fclose(f);
+  assert(snap_open(path) == NULL);
+
+  // Empty, truncated and foreign files
+  q_free(q);
+  q = q_new();
+  assert(snap_write_q(q, path));
+  snap = snap_open(path);
+  assert(snap && snap_count(snap) == 0 && snap_find(snap, NULL) == 0);
+  snap_close(snap);
+  q_free(q);
+  assert(snap_write_sl(isl, path) && truncate(path, 4096) == 0);
+  assert(snap_open(path) == NULL);
+  f = fopen(path, "wb");
+  assert(f && fwrite(big, 1, sizeof(big), f) == sizeof(big));
+  fclose(f);
+  assert(snap_open(path) == NULL);
+  assert(snap_open("/nonexistent/dl_snap") == NULL);
+  unlink(path);
+}
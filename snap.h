@@ -0,0 +1,258 @@
+/*
+ * This program implements a flat, read-only snapshot format for the
+ * contents of a queue_t or a skip list, meant to be mmap()ed back in.
+ *
+ * A snapshot is a header followed by three arrays of count 64-bit words
+ * (keys, payload sizes and payload offsets) and then the payload bytes,
+ * each payload starting on a SNAP_ALIGN boundary. There are no pointers,
+ * only offsets, so a mapped file can be searched and scanned in place:
+ * opening one costs a single validation pass over the size and offset
+ * arrays, and everything else is paged in on demand. Keys are the hash
+ * fields of the elements, stored as integers.
+ *
+ * Skip list snapshots are written in key order and flagged SNAP_SORTED;
+ * they support binary search and range scans with the list's comparator,
+ * and load back into a list with a single sl_insert_batch() pass. Queue
+ * snapshots keep queue order, are searched by a vectorized scan of the
+ * key array (simd.h), and load back with one q_insert_tail() per element.
+ *
+ * Files use native byte order and word size, and are not meant to be
+ * moved between architectures. Only lists with integer or pointer keys
+ * can be snapshotted: a string-keyed list (str_skip_list) would store
+ * the addresses of its strings, which mean nothing once reloaded, and is
+ * refused at compile time.
+ */
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <type_traits>
+#include "q.h"
+
+#define SNAP_MAGIC "DLSNAP\0\1"
+#define SNAP_VERSION 1
+#define SNAP_ALIGN 16 // payload alignment within the file
+
+/* Flags in the header */
+#define SNAP_SORTED 0x1 /* Keys ascend in the writer's comparator order */
+
+/************** Data structure declarations ****************/
+
+/* Offsets are from the start of the file */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t count;
+    uint64_t keys_off;   /* uint64_t keys[count] */
+    uint64_t sizes_off;  /* uint64_t sizes[count] */
+    uint64_t offs_off;   /* uint64_t offs[count], relative to data_off */
+    uint64_t data_off;
+    uint64_t file_len;
+} snap_header_t;
+
+/* A mapped snapshot */
+typedef struct {
+    const char *base;
+    size_t len;
+    unsigned flags;
+    size_t count;
+    const uint64_t *keys;
+    const uint64_t *sizes;
+    const uint64_t *offs;
+    const char *data;
+} snap_t;
+
+/*
+ * Called by snap_write() for each element in turn. Store the element's
+ * hash, payload and payload size and return true, or return false once
+ * there are no more.
+ */
+typedef bool (*snap_next_fn)(void *cursor, void **hash, const void **val,
+                             size_t *size);
+
+/************** Operations on snapshots ********************/
+
+/*
+  Write the n elements produced by next to path. The file is written
+  under a temporary name and renamed into place, so readers only ever see
+  a complete snapshot.
+  Return false if the file could not be written or next produced a
+  different number of elements.
+ */
+bool snap_write(const char *path, size_t n, unsigned flags, snap_next_fn next,
+                void *cursor);
+
+/*
+  Write the elements of q, head first.
+  Return false if q is NULL or the file could not be written.
+ */
+bool snap_write_q(queue_t *q, const char *path);
+
+/*
+  Map a snapshot written by snap_write(), read-only.
+  Return NULL if it could not be opened or is malformed.
+ */
+snap_t *snap_open(const char *path);
+
+/*
+  Unmap a snapshot. Every payload pointer obtained from it, including
+  those shared by a list it was loaded into, becomes invalid.
+  No effect if snap is NULL
+ */
+void snap_close(snap_t *snap);
+
+static inline size_t snap_count(const snap_t *snap) { return snap->count; }
+
+static inline void *snap_hash(const snap_t *snap, size_t i)
+{
+    return (void *) (uintptr_t) snap->keys[i];
+}
+
+static inline const void *snap_value(const snap_t *snap, size_t i)
+{
+    return snap->data + snap->offs[i];
+}
+
+static inline size_t snap_size(const snap_t *snap, size_t i)
+{
+    return (size_t) snap->sizes[i];
+}
+
+/*
+  Index of the first element whose hash is bitwise equal to hash, or
+  snap_count() if there is none. Works on snapshots in any order.
+ */
+size_t snap_find(const snap_t *snap, void *hash);
+
+/*
+  A new queue with the given Q_* flags holding a copy of every element,
+  in snapshot order.
+  Return NULL if could not allocate space.
+ */
+queue_t *snap_load_q(const snap_t *snap, unsigned flags);
+
+/*
+  Search a SNAP_SORTED snapshot written from the compatibility skip_list,
+  using sl_compare(). Index of the match, or snap_count() if there is none.
+ */
+size_t snap_search(const snap_t *snap, void *hash);
+
+/************** Typed interface ****************************/
+
+/*
+ * Index of the first element of a SNAP_SORTED snapshot whose key is not
+ * less than key under the three-way comparator cmp (as for the skip list),
+ * or snap_count() if there is none.
+ */
+template <typename K, typename Compare>
+size_t snap_lower_bound_t(const snap_t *snap, K key, Compare cmp)
+{
+    size_t lo = 0, hi = snap->count;
+    while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (0 < cmp(key, key_from_hash<K>(snap_hash(snap, mid)))) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo;
+}
+
+template <typename K, typename Compare>
+size_t snap_search_t(const snap_t *snap, K key, Compare cmp)
+{
+    size_t i = snap_lower_bound_t(snap, key, cmp);
+    if (i < snap->count && 0 == cmp(key, key_from_hash<K>(snap_hash(snap, i))))
+      return i;
+    return snap->count;
+}
+
+/*
+ * Elements with lo <= key < hi of a SNAP_SORTED snapshot are the
+ * contiguous run [*first, *first + n); return n.
+ */
+template <typename K, typename Compare>
+size_t snap_range_t(const snap_t *snap, K lo, K hi, size_t *first,
+                    Compare cmp)
+{
+    size_t a = snap_lower_bound_t(snap, lo, cmp);
+    size_t b = snap_lower_bound_t(snap, hi, cmp);
+    *first = a;
+    return (b > a) ? b - a : 0;
+}
+
+/* Keys a snapshot can hold as they are */
+template <typename SL>
+struct snap_key_ok {
+    typedef typename SL::key_type K;
+    static const bool value = std::is_integral<K>::value ||
+                              std::is_pointer<K>::value;
+};
+
+/*
+ * Iterates over a skip list for snap_write(); SL is any basic_skip_list
+ * with integer or pointer keys.
+ */
+template <typename SL>
+bool snap_next_sl(void *cursor, void **hash, const void **val, size_t *size)
+{
+    static_assert(snap_key_ok<SL>::value,
+                  "snapshots store integer or pointer keys only");
+    typename SL::node_t **pt = (typename SL::node_t **) cursor;
+    if (*pt == NULL) return false;
+    *hash = key_to_hash(SL::key(*pt));
+    *val = (*pt)->value;
+    *size = (*pt)->payload_size;
+    *pt = (*pt)->next[0];
+    return true;
+}
+
+/*
+ * Write every node of sl in key order, flagged SNAP_SORTED.
+ */
+template <typename SL>
+bool snap_write_sl(SL &sl, const char *path)
+{
+    static_assert(snap_key_ok<SL>::value,
+                  "snapshots store integer or pointer keys only");
+    typename SL::node_t *pt = *sl.begin();
+    return snap_write(path, sl.sl_count(), SNAP_SORTED, snap_next_sl<SL>, &pt);
+}
+
+/*
+ * Bulk-load every element of snap into sl with one sl_insert_batch() pass
+ * (evenly spaced towers if even is set), and return the number inserted.
+ * Payloads the list does not copy stay in the mapping, which must then
+ * outlive the list, and are read-only.
+ */
+template <typename SL>
+size_t snap_load_sl(const snap_t *snap, SL &sl, bool even = true)
+{
+    static_assert(snap_key_ok<SL>::value,
+                  "snapshots store integer or pointer keys only");
+    size_t n = snap->count;
+    if (n == 0) return 0;
+    list_ele_t *eles = (list_ele_t *) malloc(n * sizeof(list_ele_t));
+    list_ele_t **batch = (list_ele_t **) malloc(n * sizeof(list_ele_t *));
+    size_t done = 0;
+    if (eles != NULL && batch != NULL)
+    {
+      for (size_t i = 0; i < n; i++)
+      {
+        eles[i].hash = snap_hash(snap, i);
+        eles[i].value = (void *) snap_value(snap, i);
+        eles[i].payload_size = snap_size(snap, i);
+        eles[i].owner = ELE_BORROWED;
+        eles[i].next = NULL;
+        batch[i] = &eles[i];
+      }
+      done = sl.sl_insert_batch(batch, n, even);
+    }
+    free(batch);
+    free(eles);
+    return done;
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * This program implements the optional traversal counters kept by the
+ * queue and the skip list.
+ *
+ * Counting is switched on at compile time with -DDL_STATS (make STATS=1).
+ * Without it a counter is an empty struct and STAT_ADD() compiles to
+ * nothing, so instrumented traversals cost exactly what they did before.
+ * Either way, snapshots are read into plain stats_counts_t values, which
+ * are all zero when counting is off.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/************** Data structure declarations ****************/
+
+/* Cost of one kind of operation, summed over every call */
+typedef struct {
+    uint64_t calls;
+    uint64_t compares;  /* Comparator invocations */
+    uint64_t visited;   /* Nodes (or index slots) stepped over or examined */
+} stats_counts_t;
+
+#ifdef DL_STATS
+#define STATS_ENABLED true
+typedef stats_counts_t stats_counter_t;
+#define STAT_ADD(st, field, n) ((st)->field += (n))
+#else
+#define STATS_ENABLED false
+typedef struct {} stats_counter_t;
+#define STAT_ADD(st, field, n) ((void) (st))
+#endif
+
+/************** Operations on counters *********************/
+
+static inline stats_counts_t stats_read(const stats_counter_t *st)
+{
+    stats_counts_t out = {0, 0, 0};
+#ifdef DL_STATS
+    out = *st;
+#else
+    (void) st;
+#endif
+    return out;
+}
+
+static inline void stats_reset(stats_counter_t *st)
+{
+    *st = stats_counter_t();
+}
+
+#endif